@@ -0,0 +1,137 @@
+// Memory Allocation Accounting
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _ALLOCATIONS_H
+#define _ALLOCATIONS_H
+
+
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <inttypes.h>
+
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+
+#include "TilePool.h"
+
+
+/// What a buffer is used for
+enum AllocationCategory {
+  ALLOC_TILES,      // Tile data, whether cached or being served
+  ALLOC_REGIONS,    // Regions composed from tiles, such as CVT exports
+  ALLOC_JPEG,       // JPEG compressor output buffers
+  ALLOC_JNI,        // BioFormats JNI communication buffers
+  ALLOC_CATEGORIES
+};
+
+
+
+/// Live bytes allocated for each category of buffer
+/** Sizes are those the allocator actually reserved: the class size for
+    TilePool buffers and malloc_usable_size() for heap buffers where available.
+    Heap buffers are not counted on platforms without malloc_usable_size(), so
+    that frees always match allocations.
+ */
+class Allocations {
+
+ private:
+
+  static std::atomic<int64_t>* counters() {
+    static std::atomic<int64_t> live[ALLOC_CATEGORIES];
+    return live;
+  }
+
+
+ public:
+
+  /// Return the number of bytes actually reserved for a buffer
+  /** @param buffer buffer from the TilePool or the heap
+      @return bytes reserved, or 0 if this cannot be determined
+   */
+  static size_t usableSize( const void* buffer ) {
+    if( !buffer ) return 0;
+    size_t size = TilePool::usableSize( buffer );
+    if( size ) return size;
+#ifdef HAVE_MALLOC_USABLE_SIZE
+    return malloc_usable_size( const_cast<void*>( buffer ) );
+#else
+    return 0;
+#endif
+  }
+
+
+  /// Return the number of heap bytes held by a string
+  /** The string's buffer need not be the start of a heap block, so we cannot
+      ask the allocator for its size
+   */
+  static size_t stringSize( const std::string& s ) {
+    const char* p = s.data();
+    // Short strings are held within the string object itself
+    if( p >= (const char*) &s && p < (const char*) ( &s + 1 ) ) return 0;
+    return s.capacity() + 1;
+  }
+
+
+  /// Record a buffer being allocated
+  static void allocated( AllocationCategory c, const void* buffer ) {
+    counters()[c] += usableSize( buffer );
+  }
+
+  /// Record a buffer about to be freed
+  static void freed( AllocationCategory c, const void* buffer ) {
+    counters()[c] -= usableSize( buffer );
+  }
+
+  /// Move a buffer's bytes from one category to another
+  static void transfer( AllocationCategory from, AllocationCategory to, const void* buffer ) {
+    if( from == to ) return;
+    size_t size = usableSize( buffer );
+    counters()[from] -= size;
+    counters()[to] += size;
+  }
+
+
+  /// Return the live bytes for a category
+  static int64_t live( AllocationCategory c ) { return counters()[c]; }
+
+
+  /// Return a one line summary of live bytes in MB by category
+  static std::string summary() {
+    const char* names[ALLOC_CATEGORIES] = { "tiles", "regions", "JPEG buffers", "JNI buffers" };
+    std::ostringstream s;
+    s.precision( 3 );
+    for( int c = 0; c < ALLOC_CATEGORIES; c++ ){
+      if( c ) s << ", ";
+      s << names[c] << " " << live( (AllocationCategory) c ) / (1024.0 * 1024.0) << "MB";
+    }
+    TilePool::Statistics pool = TilePool::statistics();
+    if( pool.capacity ){
+      s << " (tile buffer pool " << pool.inUse / (1024.0 * 1024.0) << "MB in use of "
+	<< pool.reserved / (1024.0 * 1024.0) << "MB reserved)";
+    }
+    return s.str();
+  }
+
+};
+
+
+#endif
@@ -8,8 +8,9 @@
 #ifndef BIOFORMATSIMAGE_H
 #define BIOFORMATSIMAGE_H
 
-#include "IIPImage.h"
+#include "VirtualPyramidImage.h"
 #include "BioFormatsManager.h"
+#include "BioFormatsPool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -17,74 +18,84 @@
 #include <inttypes.h>
 #include <iostream>
 #include <fstream>
-
-#include "Cache.h"
+#include <vector>
 
 #define throw(a)
 
-class BioFormatsImage : public IIPImage
+// Size of the tiles we serve. Reads are aligned to the optimal tiles of each level instead, see nativeBlockTiles
+#define BIOFORMATS_TILESIZE 256
+
+/// Minimum edge in pixels of the blocks read at once, so that each JNI call reads a worthwhile amount
+#define BIOFORMATS_MIN_BLOCK 1024
+
+class BioFormatsImage : public VirtualPyramidImage
 {
 private:
-    BioFormatsInstance bfi;
+    // How the pixels of a native level are received from BioFormats, found once when the image is opened
+    struct PixelFormat
+    {
+        int channels;       // Samples per pixel, 3 or 4
+        int bytes;          // Bytes per sample
+        int pixel_type;     // BioFormats FormatTools pixel type
+        bool little_endian; // Byte order of samples wider than a byte
+        bool interleaved;   // Samples of a pixel together rather than each channel's plane in turn
+
+        int bpc;                // Bits per sample of our tiles: 8, 16 or 32
+        SampleType sample_type; // Sample type of our tiles
+        double max;             // Largest sample value in our tiles
+        bool direct;            // Already our packed RGB, so received straight into our buffers
+
+        // Converts pixels received from BioFormats to our RGB at full depth in a single pass
+        void (*convert)(const uint8_t *src, uint8_t *dst, size_t pixels);
+    };
 
-    TileCache *tileCache;
+    BioFormatsInstance bfi;
 
-    std::vector<size_t> numTilesX, numTilesY;
-    std::vector<size_t> lastTileXDim, lastTileYDim;
-    std::vector<int> bioformats_level_to_use, bioformats_downsample_in_level;
+    // Whether bfi holds our file open
+    bool readerOpen = false;
 
     int channels_internal;
-    int pick_byte = 0; // 0 for pick first (big endian), 1 for pick last
-    int milliseconds = 0;
+
+    // Identifies our file to the BioFormats pool, 0 if reads use bfi
+    uint64_t poolImage = 0;
+
+    // File the pool threads open their readers on
+    std::string readerPath;
+
+    // Optimal tile size the reader gives for each native level, 0 if unknown
+    std::vector<size_t> bioformats_tile_widths, bioformats_tile_heights;
+
+    // Pixel format of each native level
+    std::vector<PixelFormat> bioformats_formats;
 
     // Unimplemented methods in line with OpenslideImage.h:
     //    void read(...);
     //    void downsample_region(...);
 
-    /**
-     * @brief get cached tile.
-     * @detail  return from the local cache a tile.
-     *          The tile may be native (directly from file),
-     *                previously cached,
-     *                or downsampled (recursively called.
-     *  note that tilex and tiley can be found by multiplying by 2 raised to power of the difference in levels.
-     *  2 versions - direct and recursive.  direct should have slightly lower latency.
-     *
-     * @param tilex
-     * @param tiley
-     * @param res
-     * @return
-     */
-    /// check if cache has tile.  if yes, return it.  if not, and is a native layer, getNativeTile, else call halfsampleAndComposeTile
-    RawTilePtr getCachedTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+    /// read from file with a given reader, color convert, and return tile.
+    RawTilePtr readTile(BioFormatsInstance &reader, const size_t tilex, const size_t tiley, const uint32_t iipres);
 
-    /// read from file, color convert, store in cache, and return tile.
-    RawTilePtr getNativeTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+    /// Return the pixel format of the current resolution of a reader, throwing if we cannot convert it
+    static PixelFormat readPixelFormat(BioFormatsInstance &reader);
 
-    /// call 4x (getCachedTile at next res, downsample, compose), store in cache, and return tile.  (causes recursion, stops at native layer or in cache.)
-    RawTilePtr halfsampleAndComposeTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+    /// read a region of a native level with a given reader into packed RGB of our bpc.
+    /// Regions larger than the reader's communication buffer are read in strips of whole rows
+    void readRegion(BioFormatsInstance &reader, uint32_t native, size_t x, size_t y, size_t w, size_t h, uint8_t *buffer);
 
-    /// average 2 rows, then average 2 pixels
-    inline uint32_t halfsample_kernel_3(const uint8_t *r1, const uint8_t *r2)
-    {
-        uint64_t a = *(reinterpret_cast<const uint64_t *>(r1));
-        uint64_t c = *(reinterpret_cast<const uint64_t *>(r2));
-        uint64_t t1 = (((a ^ c) & 0xFEFEFEFEFEFEFEFE) >> 1) + (a & c);
-        uint32_t t2 = t1 & 0x0000000000FFFFFF;
-        uint32_t t3 = (t1 >> 24) & 0x0000000000FFFFFF;
-        return (((t3 ^ t2) & 0xFEFEFEFE) >> 1) + (t3 & t2);
-    }
-
-    /// downsample by 2
-    void halfsample_3(const uint8_t *in, const size_t in_w, const size_t in_h,
-                      uint8_t *out, size_t &out_w, size_t &out_h);
-
-    void compose(const uint8_t *in, const size_t in_w, const size_t in_h,
-                 const size_t &xoffset, const size_t &yoffset,
-                 uint8_t *out, const size_t &out_w, const size_t &out_h);
+    /// read a tile through the BioFormats pool if it is enabled, otherwise with bfi.
+    virtual RawTilePtr getNativeTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+
+    /// read a region of a level directly, in strips of the level's optimal tiles read in parallel through the BioFormats pool if it is enabled.
+    virtual void readNativeRegion(uint32_t level, size_t x, size_t y, size_t w, size_t h, uint8_t *buffer);
+
+    /// read levels in blocks covering the reader's optimal tiles, so that every tile of a block is cached from one read
+    virtual void nativeBlockTiles(uint32_t level, size_t &bw, size_t &bh);
+
+    /// Return the number of our tiles across a block of a level with optimal tiles of native_tile pixels
+    static size_t blockTilesFor(size_t native_tile, size_t tile);
 
     /// Constructor
-    BioFormatsImage() : IIPImage()
+    BioFormatsImage() : VirtualPyramidImage()
     {
         bfi = BioFormatsManager::get_new();
     };
@@ -93,7 +104,7 @@ public:
     /// Constructor
     /** \param path image path
      */
-    BioFormatsImage(const std::string &path, TileCache *tile_cache) : IIPImage(path), tileCache(tile_cache)
+    BioFormatsImage(const std::string &path, TileCache *tile_cache) : VirtualPyramidImage(path, tile_cache)
     {
         bfi = BioFormatsManager::get_new();
         // set tile width on loadimage, not here
@@ -103,23 +114,17 @@ public:
 
     /** \param image IIPImage object
      */
-    BioFormatsImage(const IIPImage &image, TileCache *tile_cache) : IIPImage(image), tileCache(tile_cache)
+    BioFormatsImage(const IIPImage &image, TileCache *tile_cache) : VirtualPyramidImage(image, tile_cache)
     {
         bfi = BioFormatsManager::get_new();
     };
 
     /** \param image IIPImage object
      */
-    explicit BioFormatsImage(const BioFormatsImage &image) : IIPImage(image),
+    explicit BioFormatsImage(const BioFormatsImage &image) : VirtualPyramidImage(image)
                                                              // Copy everything including JVM pointers for moving here.
-                                                             tileCache(image.tileCache),
                                                              /*bfi(image.bfi)*/
-                                                             numTilesX(image.numTilesX),
-                                                             numTilesY(image.numTilesY),
-                                                             lastTileXDim(image.lastTileXDim),
-                                                             lastTileYDim(image.lastTileYDim),
-                                                             bioformats_level_to_use(image.bioformats_level_to_use),
-                                                             bioformats_downsample_in_level(image.bioformats_downsample_in_level)/*,
+                                                             /*,
                                                              receive_buffer(image.receive_buffer)*/
     {
         fprintf(stderr, "Error: copy constructor\n\n");
@@ -139,6 +144,8 @@ public:
 
     virtual ~BioFormatsImage()
     {
+        if (poolImage)
+            BioFormatsPool::detach(poolImage);
         BioFormatsManager::free(std::move(bfi));
     };
 
@@ -152,14 +159,17 @@ public:
 
     virtual void closeImage();
 
-    /// Overloaded function for getting a particular tile
-    /** \param x horizontal sequence angle
-        \param y vertical sequence angle
-        \param r resolution
-        \param l number of quality layers to decode
-        \param t tile number
-     */
-    virtual RawTilePtr getTile(int x, int y, unsigned int r, int l, unsigned int t) throw(file_error);
+    /// Add our reader's communication buffer and level tables to the memory usage
+    virtual size_t getMemoryUsage();
+
+    /// Our reader holds the file open between openImage() and closeImage()
+    virtual unsigned int getDescriptorUsage() { return readerOpen ? 1 : 0; }
+
+    /// Return our description
+    virtual const std::string getDescription() { return std::string("BioFormats"); };
+
+    /// Tiles may be read from several threads at once when the BioFormats pool gives each its own reader
+    virtual bool concurrentDecoding() { return BioFormatsPool::enabled(); };
 
     // Unimplemented with OpenSlideImage.h:
     //	virtual RawTile getRegion(...);
@@ -1,17 +1,20 @@
 #include "BioFormatsInstance.h"
 #include "BioFormatsThread.h"
 
-BioFormatsThread BioFormatsInstance::thread;
+thread_local BioFormatsThread BioFormatsInstance::thread;
 
 BioFormatsInstance::BioFormatsInstance()
 {
+    char *buffer = new char[bfi_communication_buffer_len];
+    Allocations::allocated(ALLOC_JNI, buffer);
+
     // Expensive function being used from a header-only library.
     // Shouldn't be called from a header file
     bfbridge_error_t *error =
         bfbridge_make_instance(
             &bfinstance,
             &thread.bfthread,
-            new char[bfi_communication_buffer_len],
+            buffer,
             bfi_communication_buffer_len);
     if (error)
     {
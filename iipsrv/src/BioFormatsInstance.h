@@ -13,6 +13,7 @@
 #include <memory>
 #include <jni.h>
 #include "BioFormatsThread.h"
+#include "Allocations.h"
 
 /*
 Memory management
@@ -45,7 +46,9 @@ class BioFormatsInstance
 {
 public:
   // std::unique_ptr<BioFormatsThread> or shared ptr would also work
-  static BioFormatsThread thread;
+  // JNIEnv pointers are only valid on their own thread, so every worker
+  // thread attaches itself to the JVM on first use
+  static thread_local BioFormatsThread thread;
 
   bfbridge_instance_t bfinstance;
 
@@ -93,6 +96,7 @@ public:
     char *buffer = communication_buffer();
     if (buffer)
     {
+      Allocations::freed(ALLOC_JNI, buffer);
       delete[] buffer;
     }
 
@@ -188,6 +192,12 @@ public:
     return bf_get_pixel_type(&bfinstance, &thread.bfthread);
   }
 
+  // Significant bits of each sample, which may be fewer than its bytes hold
+  int get_bits_per_pixel()
+  {
+    return bf_get_bits_per_pixel(&bfinstance, &thread.bfthread);
+  }
+
   int get_bytes_per_pixel()
   {
     return bf_get_bytes_per_pixel(&bfinstance, &thread.bfthread);
@@ -250,6 +260,13 @@ public:
   {
     return bf_open_bytes(&bfinstance, &thread.bfthread, 0, x, y, w, h);
   }
+
+  // Like open_bytes, but the bytes are received straight into dest
+  // rather than into the communication buffer
+  int open_bytes_to(int x, int y, int w, int h, char *dest, int dest_len)
+  {
+    return bf_open_bytes_to(&bfinstance, &thread.bfthread, 0, x, y, w, h, dest, dest_len);
+  }
 };
 
 #endif /* BIOFORMATSINSTANCE_H */
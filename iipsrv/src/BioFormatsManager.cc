@@ -1,3 +1,4 @@
 #include "BioFormatsManager.h"
 
 std::vector<BioFormatsInstance> BioFormatsManager::free_list;
+std::mutex BioFormatsManager::free_list_mutex;
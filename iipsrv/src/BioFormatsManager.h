@@ -6,55 +6,40 @@
 #define BIOFORMATSMANAGER_H
 
 #include <vector>
+#include <mutex>
 #include "BioFormatsInstance.h"
-#include <stdio.h>
 
 class BioFormatsManager
 {
 private:
     static std::vector<BioFormatsInstance> free_list;
 
+    // Worker threads share the free list
+    static std::mutex free_list_mutex;
+
 public:
     // call me with std::move
     static void free(BioFormatsInstance graal_isolate)
     {
+        // Close any file before handing the instance to another thread
+        graal_isolate.refresh();
+        std::lock_guard<std::mutex> guard(free_list_mutex);
         free_list.push_back(std::move(graal_isolate));
-        free_list.back().refresh();
     }
 
     static BioFormatsInstance get_new()
     {
+        std::unique_lock<std::mutex> lock(free_list_mutex);
         if (free_list.size() == 0)
         {
-
-            fprintf(stderr, "preparemid1\n");
-
-            BioFormatsInstance bfi;
-            fprintf(stderr, "preparemid2\n");
-
-            free_list.push_back(std::move(bfi));
-            fprintf(stderr, "preparemid3\n");
-        }
-
-        fprintf(stderr, "getnew start\n");
-        if (free_list.size() == 0)
-        {
-            fprintf(stderr, "Expect crash1\n");
+            // Creating an instance is slow, don't hold up other threads
+            lock.unlock();
+            return BioFormatsInstance();
         }
 
         BioFormatsInstance bfi = std::move(free_list.back());
-        fprintf(stderr, "getnew mid\n");
-
-        if (free_list.size() == 0)
-        {
-            fprintf(stderr, "Expect crash2\n");
-        } else {
-            fprintf(stderr, "not expect crash2\n");
-        }
-            free_list.pop_back(); // calls destructuor
-            fprintf(stderr, "getnew end\n");
-
-            return bfi;
+        free_list.pop_back();
+        return bfi;
     }
 };
 
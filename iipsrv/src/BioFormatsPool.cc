@@ -0,0 +1,281 @@
+/*
+ * File:   BioFormatsPool.cc
+ */
+
+#include "BioFormatsPool.h"
+#include "BioFormatsManager.h"
+#include "IIPImage.h"
+
+#include <deque>
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+namespace
+{
+    struct Job
+    {
+        uint64_t image;
+        string path;
+        function<void(BioFormatsInstance &)> work;
+        promise<void> done;
+        // Times a thread took a later job ahead of this one
+        unsigned int skipped;
+    };
+
+    // A reader open on an image, owned by one thread
+    struct Reader
+    {
+        uint64_t image;
+        BioFormatsInstance instance;
+
+        Reader(uint64_t i, BioFormatsInstance &&b) : image(i), instance(std::move(b)) {}
+    };
+
+    struct Worker
+    {
+        std::thread handle;
+        // Images detached since this thread last looked
+        vector<uint64_t> retired;
+    };
+
+    unsigned int threads = 0, maxQueue = 1, maxReaders = 1;
+
+    mutex poolLock;
+    condition_variable ready, room;
+    deque<unique_ptr<Job>> jobQueue;
+    vector<unique_ptr<Worker>> workers;
+    bool started = false, stopping = false;
+
+    atomic<uint64_t> nextImage(0);
+    atomic<uint64_t> jobs(0), opened(0), closed(0), waited(0);
+}
+
+// Close a thread's reader, handing the instance back for reuse
+static void release(list<Reader> &readers, list<Reader>::iterator r)
+{
+    BioFormatsManager::free(std::move(r->instance));
+    readers.erase(r);
+}
+
+// Return this thread's reader for a job's image, opening one if need be
+static BioFormatsInstance &reader(list<Reader> &readers, const Job &job)
+{
+    for (list<Reader>::iterator r = readers.begin(); r != readers.end(); ++r)
+    {
+        if (r->image == job.image)
+        {
+            // Most recently used first
+            readers.splice(readers.begin(), readers, r);
+            return readers.front().instance;
+        }
+    }
+
+    BioFormatsInstance instance = BioFormatsManager::get_new();
+    if (!instance.open(job.path))
+    {
+        string error = instance.get_error();
+        BioFormatsManager::free(std::move(instance));
+        throw file_error("Error opening '" + job.path + "' with BioFormats, error " + error);
+    }
+    opened++;
+
+    while (readers.size() >= maxReaders)
+    {
+        release(readers, --readers.end());
+        closed++;
+    }
+
+    readers.emplace_front(job.image, std::move(instance));
+    return readers.front().instance;
+}
+
+// Choose the next job for a thread from the queue, which must not be empty
+// Opening a file can take BioFormats far longer than reading a tile, so a
+// thread prefers the oldest job for an image it already has a reader for.
+// The oldest job of all is only passed over once by each thread, so that
+// it still runs soon
+static deque<unique_ptr<Job>>::iterator choose(const list<Reader> &readers)
+{
+    deque<unique_ptr<Job>>::iterator front = jobQueue.begin();
+    if ((*front)->skipped >= threads)
+        return front;
+
+    for (deque<unique_ptr<Job>>::iterator j = front; j != jobQueue.end(); ++j)
+    {
+        for (list<Reader>::const_iterator r = readers.begin(); r != readers.end(); ++r)
+        {
+            if (r->image == (*j)->image)
+            {
+                if (j != front)
+                    (*front)->skipped++;
+                return j;
+            }
+        }
+    }
+    return front;
+}
+
+static void run(Worker *worker)
+{
+    list<Reader> readers;
+
+    while (true)
+    {
+        unique_ptr<Job> job;
+        vector<uint64_t> retired;
+        {
+            unique_lock<mutex> guard(poolLock);
+            ready.wait(guard, [worker] { return stopping || !jobQueue.empty() || !worker->retired.empty(); });
+            if (stopping)
+                break;
+            retired.swap(worker->retired);
+            if (!jobQueue.empty())
+            {
+                deque<unique_ptr<Job>>::iterator next = choose(readers);
+                job = std::move(*next);
+                jobQueue.erase(next);
+                room.notify_one();
+            }
+        }
+
+        for (size_t i = 0; i < retired.size(); i++)
+        {
+            for (list<Reader>::iterator r = readers.begin(); r != readers.end(); ++r)
+            {
+                if (r->image == retired[i])
+                {
+                    release(readers, r);
+                    break;
+                }
+            }
+        }
+
+        if (!job)
+            continue;
+
+        try
+        {
+            job->work(reader(readers, *job));
+            job->done.set_value();
+        }
+        catch (...)
+        {
+            job->done.set_exception(current_exception());
+        }
+        jobs++;
+    }
+
+    // Readers must be freed while this thread is still attached to the JVM
+    while (!readers.empty())
+        release(readers, readers.begin());
+}
+
+void BioFormatsPool::configure(unsigned int n, unsigned int queue, unsigned int readers)
+{
+    threads = n;
+    maxQueue = queue > 0 ? queue : 1;
+    maxReaders = readers > 0 ? readers : 1;
+}
+
+bool BioFormatsPool::enabled()
+{
+    return threads > 0;
+}
+
+unsigned int BioFormatsPool::size()
+{
+    return threads;
+}
+
+uint64_t BioFormatsPool::attach()
+{
+    return ++nextImage;
+}
+
+void BioFormatsPool::detach(uint64_t image)
+{
+    lock_guard<mutex> guard(poolLock);
+    if (workers.empty())
+        return;
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i]->retired.push_back(image);
+    ready.notify_all();
+}
+
+future<void> BioFormatsPool::submit(uint64_t image, const string &path,
+                                    function<void(BioFormatsInstance &)> work)
+{
+    unique_ptr<Job> job(new Job);
+    job->image = image;
+    job->path = path;
+    job->work = std::move(work);
+    job->skipped = 0;
+    future<void> result = job->done.get_future();
+
+    unique_lock<mutex> guard(poolLock);
+
+    if (stopping)
+    {
+        job->done.set_exception(make_exception_ptr(file_error("BioFormats readers have been shut down")));
+        return result;
+    }
+
+    if (!started)
+    {
+        started = true;
+        for (unsigned int i = 0; i < threads; i++)
+        {
+            workers.push_back(unique_ptr<Worker>(new Worker));
+            workers.back()->handle = std::thread(run, workers.back().get());
+        }
+    }
+
+    if (jobQueue.size() >= maxQueue)
+    {
+        waited++;
+        room.wait(guard, [] { return stopping || jobQueue.size() < maxQueue; });
+        if (stopping)
+        {
+            job->done.set_exception(make_exception_ptr(file_error("BioFormats readers have been shut down")));
+            return result;
+        }
+    }
+
+    jobQueue.push_back(std::move(job));
+    ready.notify_one();
+    return result;
+}
+
+void BioFormatsPool::shutdown()
+{
+    {
+        lock_guard<mutex> guard(poolLock);
+        stopping = true;
+        ready.notify_all();
+        room.notify_all();
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i]->handle.join();
+
+    // Waiting callers see a broken promise
+    lock_guard<mutex> guard(poolLock);
+    jobQueue.clear();
+}
+
+BioFormatsPool::Statistics BioFormatsPool::statistics()
+{
+    Statistics s;
+    s.jobs = jobs;
+    s.opened = opened;
+    s.closed = closed;
+    s.waited = waited;
+    return s;
+}
@@ -0,0 +1,80 @@
+/*
+ * File:   BioFormatsPool.h
+ */
+
+#ifndef BIOFORMATSPOOL_H
+#define BIOFORMATSPOOL_H
+
+#include <string>
+#include <functional>
+#include <future>
+#include <inttypes.h>
+
+class BioFormatsInstance;
+
+// A bounded pool of threads attached to the JVM which run BioFormats reads.
+//
+// BioFormats readers are not thread safe, so a BioFormatsImage used to make
+// every read through its one reader, one at a time. Instead each pool thread
+// keeps readers of its own, opened on the images it has been asked to read,
+// so that tiles of one image, whether for different requests or for the
+// blocks of one large region, are decoded in parallel by different threads.
+//
+// Work is queued and each job runs on whichever thread is free first, with
+// that thread's reader for the job's image, opening it if needed. A free
+// thread prefers queued jobs for images it already has open. Each
+// thread keeps up to a fixed number of readers, closing the least recently
+// used beyond that, as every reader holds an open file and a large
+// communication buffer. When the queue is full, submit() waits for room.
+//
+// The pool is disabled until configure() is called with at least one thread,
+// which must happen before any other threads start. The threads themselves
+// start on the first read, so that the JVM is only created if a BioFormats
+// image is read.
+class BioFormatsPool
+{
+public:
+    struct Statistics
+    {
+        uint64_t jobs;   // Reads run
+        uint64_t opened; // Readers opened on an image
+        uint64_t closed; // Readers closed to make room for another image
+        uint64_t waited; // Jobs which had to wait for room in the queue
+    };
+
+    // Enable the pool
+    // threads: number of threads reading, 0 to leave the pool disabled
+    // queue: maximum number of jobs waiting for a thread
+    // readers: maximum number of images each thread keeps a reader open on
+    static void configure(unsigned int threads, unsigned int queue, unsigned int readers);
+
+    // Whether reads should be submitted to the pool
+    static bool enabled();
+
+    // Return a new identifier for an opened image, under which its reads are submitted
+    static uint64_t attach();
+
+    // Close the readers any thread holds for an image
+    // To be called when the image is closed, so that a later identifier
+    // for the same path reopens the file
+    static void detach(uint64_t image);
+
+    // Queue a read
+    // image: identifier from attach()
+    // path: file to open if the thread running the job has no reader for image
+    // job: function run with the thread's reader, open on path
+    // Returns a future which is ready once the job has run, and which rethrows
+    // any exception it threw, or a file_error if the file could not be opened
+    static std::future<void> submit(uint64_t image, const std::string &path,
+                                    std::function<void(BioFormatsInstance &)> job);
+
+    // Stop our threads, abandoning queued jobs
+    static void shutdown();
+
+    static Statistics statistics();
+
+    // Return the configured number of threads
+    static unsigned int size();
+};
+
+#endif /* BIOFORMATSPOOL_H */
@@ -3,9 +3,13 @@
  */
 
 #include "BioFormatsThread.h"
+#include <mutex>
 
-BioFormatsThread::BioFormatsThread() {
-    fprintf(stderr, "started bioformatsthread\n");
+bfbridge_vm_t BioFormatsThread::bfvm;
+
+static std::once_flag bfvm_created;
+
+static void make_vm() {
     // In our Docker caMicroscpe deployment we pass these using fcgid.conf
     // and other conf files
     // Required:
@@ -23,21 +27,22 @@ BioFormatsThread::BioFormatsThread() {
         cachedir = NULL;
     }
     fprintf(stderr, "started bioformatsthread2\n");
-    bfbridge_error_t *error = bfbridge_make_vm(&bfvm, cpdir, cachedir);
+    bfbridge_error_t *error = bfbridge_make_vm(&BioFormatsThread::bfvm, cpdir, cachedir);
     fprintf(stderr, "started bioformatsthrea2.5\n");
     if (error) {
         fprintf(stderr, "BioFormatsThread.cc bfbridge_make_vm gave error\n");
         throw "";
     }
-    fprintf(stderr, "started bioformatsthreadd3\n");
+}
+
+BioFormatsThread::BioFormatsThread() {
+    std::call_once(bfvm_created, make_vm);
 
     // Expensive function being used from a header-only library.
     // Shouldn't be called from a header file
-    error = bfbridge_make_thread(&bfthread, &bfvm);
-    fprintf(stderr, "started bioformatsthrea3.5\n");
+    bfbridge_error_t *error = bfbridge_make_thread(&bfthread, &bfvm);
     if (error) {
         fprintf(stderr, "BioFormatsThread.cc bfbridge_make_thread gave error\n");
         throw "";
     }
-    fprintf(stderr, "started bioformatsthrea4\n");
 }
\ No newline at end of file
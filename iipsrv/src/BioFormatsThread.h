@@ -12,10 +12,14 @@
 #define BFBRIDGE_KNOW_BUFFER_LEN
 #include "bfbridge_basiclib.h"
 
+// Attaches the constructing thread to the JVM. Each thread making JNI calls
+// needs its own attachment, so instances are kept thread_local
+// (see BioFormatsInstance::thread) while the JVM itself is process wide
+// and created by whichever thread first needs it.
 class BioFormatsThread
 {
 public:
-    bfbridge_vm_t bfvm;
+    static bfbridge_vm_t bfvm;
     bfbridge_thread_t bfthread;
 
     BioFormatsThread();
@@ -30,10 +34,10 @@ public:
     {
         bfbridge_free_thread(&bfthread);
 
-        // Must run only once, on app termination
+        // bfbridge_free_vm must run only once, on app termination
         // Any other time, it breaks JVM and won't run again
-        // Therefore even if JVM is unused for some time, it must be kept alive
-        bfbridge_free_vm(&bfvm);
+        // Other threads may still be attached when one exits,
+        // so leave the JVM to be torn down with the process
     }
 };
 
@@ -85,14 +85,57 @@ namespace __gnu_cxx {
 
 #include <iostream>
 #include <list>
+#include <set>
+#include <vector>
 #include <string>
+#include <functional>
+#include <mutex>
+#include <atomic>
 #include "RawTile.h"
 #include "IIPImage.h"
+#include "TileKey.h"
+#include "HashIndex.h"
+#include "TinyLFU.h"
+#include "TileStore.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+
+
+/// Default cache index - a hashed map from key to list position
+#ifdef HAVE_EXT_POOL_ALLOCATOR
+template <typename K, typename V>
+  using MapIndex = HASHMAP < K, V, __gnu_cxx::hash< K >, std::equal_to< K >,
+                             __gnu_cxx::__pool_alloc< std::pair<K, V> > >;
+#else
+template <typename K, typename V>
+  using MapIndex = HASHMAP < K, V >;
+#endif
+
+
+/// Percentage of the cache given to the admission window when TinyLFU admission is used
+#define ADMISSION_WINDOW_PERCENT 1
 
 
 /// Cache to store raw tile data
-template <typename Key, typename Value>
+/** By default this is a plain LRU cache. Optionally, a W-TinyLFU admission policy
+    can be used: new entries go into a small LRU window and, when they leave it,
+    only enter the main LRU list if they have been requested more often than the
+    entry they would displace. This stops one-off scans such as large region
+    exports from flushing frequently used entries.
+
+    Eviction from the main list is either by recency (LRU) or GreedyDual-Size,
+    where each entry has a priority of L + cost / size and the lowest priority
+    entry is evicted first. L is raised to the priority of each evicted entry,
+    so entries that are not requested again age out. Expensive tiles that are
+    small therefore survive longest.
+
+    Entries can also be grouped (by image for tiles) with a byte quota per
+    group, so that a single group cannot take over the whole cache.
+ */
+template <typename Key, typename Value, template <typename, typename> class Index = MapIndex>
 class Cache {
 
   protected:
@@ -110,15 +153,30 @@ class Cache {
    /// Current memory running total
    size_t currentSize;
 
-   /// Main cache storage typedef  Don't need to store key in list again.
+   /// List entry. We keep the key and record size here so that eviction
+   /// does not need to recompute either of them
+   struct Entry {
+     Key key;
+     ValuePtr value;
+     size_t size;
+     double cost;
+     double priority;
+     bool inWindow;
+     typename std::list<Key>::iterator groupEntry;
+   };
+
+   /// Entries of a quota group, kept so that the group's victim is found without a search
+   struct Group {
+     size_t size;
+     std::list<Key> recency;                           // most recently used first
+     std::set< std::pair<double, Key> > priorities;   // main list entries, for GreedyDual-Size
+   };
+
+   /// Main cache storage typedef
  #ifdef HAVE_EXT_POOL_ALLOCATOR
- //  typedef std::list < std::pair<std::string, ValuePtr >,
- //    __gnu_cxx::__pool_alloc< std::pair<std::string, ValuePtr > > > ObjectList;
-   typedef std::list < ValuePtr ,
-     __gnu_cxx::__pool_alloc< ValuePtr > > ObjectList;
+   typedef std::list < Entry, __gnu_cxx::__pool_alloc< Entry > > ObjectList;
  #else
- //  typedef std::list < std::pair<std::string, ValuePtr > > ObjectList;
-   typedef std::list < ValuePtr > ObjectList;
+   typedef std::list < Entry > ObjectList;
  #endif
 
    /// Main cache list iterator typedef
@@ -127,34 +185,69 @@ class Cache {
    // can store list iterators in map because list iterators are not affected by insert/delete etc to list.
 
    /// Index typedef
- #ifdef HAVE_EXT_POOL_ALLOCATOR
-   typedef HASHMAP < std::string, List_Iter,
-     __gnu_cxx::hash< std::string >,
-     std::equal_to< std::string >,
-     __gnu_cxx::__pool_alloc< std::pair<std::string, List_Iter> >
-     > ObjectMap;
- #else
-   typedef HASHMAP < std::string, List_Iter > ObjectMap;
- #endif
+   typedef Index < Key, List_Iter > ObjectMap;
 
 
    /// Main cache storage object
    ObjectList objList;
 
+   /// Admission window - entries wait here until they are admitted to objList
+   ObjectList window;
+
+   /// Current and maximum size of the admission window
+   size_t windowSize, windowMax;
+
+   /// Access frequency sketch - NULL unless TinyLFU admission is enabled
+   FrequencySketch* sketch;
+
+   /// Whether to use GreedyDual-Size rather than LRU eviction
+   const bool gds;
+
+   /// GreedyDual-Size inflation value L
+   double inflation;
+
+   /// Entries of the main list ordered by GreedyDual-Size priority
+   std::set< std::pair<double, Key> > priorities;
+
+   /// Maximum size per group, or 0 for no limit
+   const size_t quota;
+
+   /// Each group's size and entries - only kept when there is a quota
+   HASHMAP < uint32_t, Group > groups;
+
    /// Main Cache storage index object
    ObjectMap objMap;
 
+   /// Whether to keep entries evicted because the cache is full in demoted
+   bool demote;
+
+   /// Entries evicted because the cache is full, with their keys, for the subclass to move elsewhere
+   std::vector< std::pair<Key, ValuePtr> > demoted;
+
+   /// Mutex protecting the list, index and size counter - caches are shared between worker threads
+   std::mutex mutex;
+
 
    /// Internal touch function
    /** Touches a key in the Cache and makes it the most recently used
     *  @param key to be touched
     *  @return a Map_Iter pointing to the key that was touched.
     */
-   typename ObjectMap::iterator _touch( const std::string &key ) {
+   typename ObjectMap::iterator _touch( const Key &key ) {
      typename ObjectMap::iterator miter = objMap.find( key );
      if( miter == objMap.end() ) return miter;
-     // Move the found node to the head of the list.
-     objList.splice( objList.begin(), objList, miter->second );
+     // Move the found node to the head of its list.
+     ObjectList& list = miter->second->inWindow ? window : objList;
+     list.splice( list.begin(), list, miter->second );
+     if( quota ){
+       std::list<Key>& recency = groups[ getGroup( key ) ].recency;
+       recency.splice( recency.begin(), recency, miter->second->groupEntry );
+     }
+     // Restore its full priority
+     if( gds && !miter->second->inWindow ){
+       this->_deprioritise( miter->second );
+       this->_prioritise( miter->second );
+     }
      return miter;
    }
 
@@ -165,14 +258,30 @@ class Cache {
     *  @warning miter is no longer usable after being passed to this function.
     */
    void _remove( const typename ObjectMap::iterator &miter ) {
+     this->_removed( miter->first );
+
      // Reduce our current size counter
-     currentSize -= getRecordSize(miter);
-     objList.erase( miter->second );
+     currentSize -= miter->second->size;
+
+     if( gds && !miter->second->inWindow ) this->_deprioritise( miter->second );
+
+     if( quota ){
+       uint32_t group = getGroup( miter->first );
+       Group& g = groups[group];
+       g.size -= miter->second->size;
+       g.recency.erase( miter->second->groupEntry );
+       if( g.recency.empty() ) groups.erase( group );
+     }
 
 #if !defined(HAS_SHARED_PTR)
-     delete *(miter->second);
+     delete miter->second->value;
 #endif
 
+     if( miter->second->inWindow ){
+       windowSize -= miter->second->size;
+       window.erase( miter->second );
+     }
+     else objList.erase( miter->second );
      objMap.erase( miter );
 
      // internal shared pointer should have reference count decremented automatically.
@@ -180,29 +289,121 @@ class Cache {
 
    /// Interal remove function
    /** @param key to remove */
-   void _remove( const std::string &key ) {
+   void _remove( const Key &key ) {
      typename ObjectMap::iterator miter = objMap.find( key );
-     this->_remove( miter );
+     if( miter != objMap.end() ) this->_remove( miter );
    }
 
-   // remember to add objSize.
-   size_t getRecordSize( const typename ObjectMap::iterator &miter ) {
-     return getRecordSize(miter->first, *(miter->second));
+   /// Set the GreedyDual-Size priority of a main list entry and add it to the priority order
+   void _prioritise( List_Iter entry ) {
+     entry->priority = inflation + entry->cost / (double) ( entry->size ? entry->size : 1 );
+     priorities.insert( std::make_pair( entry->priority, entry->key ) );
+     if( quota ) groups[ getGroup( entry->key ) ].priorities.insert( std::make_pair( entry->priority, entry->key ) );
    }
 
-   virtual size_t getRecordSize( const std::string &key, const ValuePtr val ) = 0;
 
-   virtual std::string getIndex( const ValuePtr r ) = 0;
+   /// Take a main list entry out of the GreedyDual-Size priority order
+   void _deprioritise( List_Iter entry ) {
+     priorities.erase( std::make_pair( entry->priority, entry->key ) );
+     if( quota ) groups[ getGroup( entry->key ) ].priorities.erase( std::make_pair( entry->priority, entry->key ) );
+   }
+
+
+   /// Return the main list entry to evict next. The main list must not be empty
+   List_Iter _victim() {
+     if( gds ) return objMap.find( priorities.begin()->second )->second;
+     return --objList.end();
+   }
+
+
+   /// Evict an entry from the main list because the cache is full
+   void _evict( List_Iter victim ) {
+     if( gds ) inflation = victim->priority;
+     if( demote ) demoted.push_back( std::make_pair( victim->key, victim->value ) );
+     this->_remove( victim->key );
+   }
+
+
+   /// Find the entry of a group to drop when the group is over its quota
+   /** Takes the group's lowest priority main list entry with GreedyDual-Size or,
+    *  failing that, its least recently used entry
+    *  @return false if the group has no entries
+    */
+   bool _groupVictim( uint32_t group, List_Iter& victim ) {
+     typename HASHMAP < uint32_t, Group >::iterator g = groups.find( group );
+     if( g == groups.end() ) return false;
+     if( gds && !g->second.priorities.empty() ) victim = objMap.find( g->second.priorities.begin()->second )->second;
+     else victim = objMap.find( g->second.recency.back() )->second;
+     return true;
+   }
+
+
+   /// Move entries from the admission window into the main list
+   /** Each candidate leaving the window is admitted only if it has been requested
+    *  more often than the least recently used entries it would replace. Otherwise
+    *  the candidate itself is dropped.
+    */
+   void _admit() {
+     while( windowSize > windowMax ) {
+       List_Iter candidate = --window.end();
+       candidate->inWindow = false;
+       windowSize -= candidate->size;
+       objList.splice( objList.begin(), window, candidate );
+       if( gds ) this->_prioritise( candidate );
+
+       uint32_t frequency = sketch->frequency( std::hash<Key>()( candidate->key ) );
+
+       while( currentSize > maxSize ) {
+         List_Iter victim = this->_victim();
+         if( victim != candidate &&
+             frequency > sketch->frequency( std::hash<Key>()( victim->key ) ) ){
+           this->_evict( victim );
+         }
+         else {
+           if( demote ) demoted.push_back( std::make_pair( candidate->key, candidate->value ) );
+           this->_remove( candidate->key );
+           break;
+         }
+       }
+     }
+   }
+
+   // remember to add objSize.
+   virtual size_t getRecordSize( const Key &key, const ValuePtr val ) = 0;
+
+   virtual Key getIndex( const ValuePtr r ) = 0;
 
    virtual time_t getTimestamp ( const ValuePtr r ) = 0;
 
+   /// Return the cost of rebuilding an entry for GreedyDual-Size eviction
+   virtual double getCost( const ValuePtr r ) { return 1.0; }
+
+   /// Return the quota group of a key
+   virtual uint32_t getGroup( const Key &key ) { return 0; }
+
+   /// Called with our lock held as an entry leaves the cache, other than by clear()
+   virtual void _removed( const Key& /*key*/ ) {}
+
    /// Constructor
-   /** @param max Maximum cache size in bytes or count */
-   explicit Cache( const size_t max ) :
+   /** @param max Maximum cache size in bytes or count
+    *  @param admission expected number of entries for TinyLFU admission, or 0 for plain LRU
+    *  @param greedyDual whether to use GreedyDual-Size eviction rather than LRU
+    *  @param groupQuota maximum size of each quota group, or 0 for no limit
+    */
+   explicit Cache( const size_t max, const size_t admission = 0,
+                   const bool greedyDual = false, const size_t groupQuota = 0 ) :
        maxSize(max),
        currentSize(0),
        objList(),
-       objMap()
+       window(),
+       windowSize(0),
+       windowMax(max * ADMISSION_WINDOW_PERCENT / 100),
+       sketch( admission ? new FrequencySketch( admission ) : NULL ),
+       gds( greedyDual ),
+       inflation( 0 ),
+       quota( groupQuota ),
+       objMap(),
+       demote( false )
    {};
 
 
@@ -213,24 +414,37 @@ class Cache {
    /// Destructor
    virtual ~Cache() {
      clear();
+     delete sketch;
    }
 
-   void clear() {
+   virtual void clear() {
+     std::lock_guard<std::mutex> guard( mutex );
 #if !defined(HAS_SHARED_PTR)
      for (List_Iter it = objList.begin(); it != objList.end(); ++it) {
-       delete *it;
+       delete it->value;
+     }
+     for (List_Iter it = window.begin(); it != window.end(); ++it) {
+       delete it->value;
      }
 #endif
 
      objList.clear();
+     window.clear();
      objMap.clear();
+     priorities.clear();
+     groups.clear();
+     demoted.clear();
+     currentSize = 0;
+     windowSize = 0;
+     inflation = 0;
+     if( sketch ) sketch->clear();
 
      // shared pointers deleter called automatically.
    }
 
    /// Insert a tile
    /** @param r Tile to be inserted.  shared pointer copied in.*/
-   void insert( const ValuePtr rt ) {
+   virtual void insert( const ValuePtr rt ) {
 
      if( maxSize == 0 ) return;
 
@@ -239,7 +453,9 @@ class Cache {
      // make a local copy of the POINTER
      ValuePtr r(rt);
 
-     std::string key = this->getIndex( r );
+     Key key = this->getIndex( r );
+
+     std::lock_guard<std::mutex> guard( mutex );
 
      // Touch the key, if it exists
      typename ObjectMap::iterator miter = this->_touch( key );
@@ -247,71 +463,96 @@ class Cache {
      // Check whether this tile exists in our cache
      if( miter != objMap.end() ){
        // Check the timestamp and delete if necessary
-       if( getTimestamp(*(miter->second)) < getTimestamp(r) ){
+       if( getTimestamp(miter->second->value) < getTimestamp(r) ){
          this->_remove( miter );  // old RawTile will be destroyed when no one else is using it.
        }
        // If this index already exists and it is up to date, do nothing
        else return;  // r will be destroyed properly, leaving miter.
      }
 
-     // Update our total current size variable BEFORE moving it. Use the string::capacity function
-     // rather than length() as std::string can allocate slightly more than necessary
-     // The +1 is for the terminating null byte
-     currentSize += getRecordSize(key, r);
+     // Update our total current size variable BEFORE moving it
+     Entry entry = { key, r, getRecordSize(key, r), getCost(r), 0, sketch != NULL, typename std::list<Key>::iterator() };
+     currentSize += entry.size;
+     if( quota ){
+       Group& g = groups[ getGroup(key) ];
+       g.size += entry.size;
+       g.recency.push_front( key );
+       entry.groupEntry = g.recency.begin();
+     }
 
-     // Store the key if it doesn't already exist in our cache
-     // Ok, do the actual insert at the head of the list
-     objList.push_front( r );
+     // Ok, do the actual insert at the head of the list - or of the admission window
+     if( sketch ){
+       windowSize += entry.size;
+       window.push_front( entry );
+       objMap[ key ] = window.begin();
+       this->_admit();
+     }
+     else {
+       objList.push_front( entry );
+       objMap[ key ] = objList.begin();
+       if( gds ) this->_prioritise( objList.begin() );
+     }
 
-     // And store this in our map
-     List_Iter liter = objList.begin();
-     objMap[ key ] = liter;
 
+     // Keep this entry's group within its quota
+     if( quota ){
+       uint32_t group = getGroup( key );
+       List_Iter victim;
+       while( groups.count( group ) && groups[group].size > quota && this->_groupVictim( group, victim ) ){
+         this->_remove( victim->key );
+       }
+     }
 
 
      // Check to see if we need to remove an element due to exceeding max_size
-     while( currentSize > maxSize ) {
-       // Remove the last element
-       liter = objList.end();
-       --liter;
-       key = this->getIndex( *liter );
-       this->_remove( key );
+     while( currentSize > maxSize && !objList.empty() ) {
+       // Remove the least recently used or lowest priority element
+       this->_evict( this->_victim() );
      }
 
    }
 
 
    /// Return the number of tiles in the cache
-   unsigned int getNumElements() { return objList.size(); }
+   virtual unsigned int getNumElements() {
+     std::lock_guard<std::mutex> guard( mutex );
+     return objList.size() + window.size();
+   }
 
 
    /// Get a tile from the cache
    /**
-    *  @param f filename
-    *  @param r resolution number
-    *  @param t tile number
-    *  @param h horizontal sequence number
-    *  @param v vertical sequence number
-    *  @param c compression type
-    *  @param q compression quality
+    *  @param key cache key - see getIndex() in the subclasses
     *  @return pointer to data or NULL on error
     */
-   ValuePtr getObject( const std::string &key ) {
+   virtual ValuePtr getObject( const Key &key ) {
 
-     if( maxSize == 0 ) return NULL;
+     if( maxSize == 0 ) return ValuePtr();
 
-     typename ObjectMap::iterator miter = objMap.find( key );
-     if( miter == objMap.end() ) return ValuePtr();
+     std::lock_guard<std::mutex> guard( mutex );
 
-     this->_touch( key );
+     // Count requests whether or not they hit so that a new entry's popularity is known
+     if( sketch ) sketch->increment( std::hash<Key>()( key ) );
 
-     return ValuePtr(*(miter->second));
+     typename ObjectMap::iterator miter = this->_touch( key );
+     if( miter == objMap.end() ) return ValuePtr();
+
+     return ValuePtr( miter->second->value );
    }
 
 
-   void evict( const ValuePtr rt ) {
-     std::string key = this->getIndex( rt );
-     this->_remove( key );
+   /// Remove an out of date entry
+   /** Another thread may already have replaced the entry with a newer one, which is kept
+    *  @param rt entry to remove, or a copy of it
+    */
+   virtual void evict( const ValuePtr rt ) {
+     Key key = this->getIndex( rt );
+     std::lock_guard<std::mutex> guard( mutex );
+     typename ObjectMap::iterator miter = objMap.find( key );
+     if( miter != objMap.end() && ( miter->second->value == rt ||
+                                    getTimestamp( miter->second->value ) <= getTimestamp( rt ) ) ){
+       this->_remove( miter );
+     }
    }
 
    /// Return the amount of cache used, in units defined by the subclass.
@@ -319,14 +560,134 @@ class Cache {
 
 };
 
-class TileCache : public Cache<std::string, RawTile> {
+
+
+/// Tile size in bytes used to estimate how many tiles the cache holds when sizing the frequency sketch
+#define SKETCH_TILE_SIZE 8192
+
+/// zlib compression level for tiles in the cold tier - favour speed over ratio
+#define COLD_TIER_COMPRESSION 1
+
+
+/// Tile cache index - open addressing on the precomputed tile key hash
+template <typename K, typename V>
+  using TileIndex = HashIndex < K, V, TileKeyHash >;
+
+
+/// Interface of our tile caches
+/** Main.cc chooses the implementation: a MemoryTileCache, a ShardedTileCache
+    of several of them, or a SharedTileCache
+ */
+class TileCache {
+
+ public:
+
+  /// Lookup statistics for each tier, counted on every getObject() call
+  struct TierStatistics {
+    uint64_t lookups;
+    uint64_t hotHits;
+    uint64_t coldHits;
+    uint64_t diskHits;
+    uint64_t coldTime;        // microseconds spent inflating cold tier hits
+    uint64_t diskTime;        // microseconds spent reading second level hits
+    uint64_t demotions;
+    uint64_t demotionTime;    // microseconds spent deflating demoted tiles
+  };
+
+
+  /// Destructor
+  virtual ~TileCache() {}
+
+  /// Insert a tile
+  virtual void insert( const RawTilePtr r ) = 0;
+
+  /// Return a tile or an empty pointer if not cached
+  virtual RawTilePtr getObject( const TileKey &key ) = 0;
+
+  /// Remove an out of date tile, keeping any newer one inserted in the meantime
+  virtual void evict( const RawTilePtr r ) = 0;
+
+  /// Remove all tiles held in this process
+  /** Stores shared with other processes or kept across restarts are left alone */
+  virtual void clear() = 0;
+
+  /// Remove all tiles from stores shared with other processes or kept across restarts
+  /** For administration only: every process using the stores loses their tiles */
+  virtual void clearStores() = 0;
+
+  /// Return the number of tiles cached
+  virtual unsigned int getNumElements() = 0;
+
+  /// Return the memory used in MBs
+  virtual float getMemorySize() = 0;
+
+  /// Set a second level store
+  /** The caller must keep the store open for the life of the cache
+   *  @param store tile store
+   */
+  virtual void setSecondLevel( TileStore* store ) = 0;
+
+  /// Return the lookup statistics of each tier - none unless the cache has tiers
+  virtual TierStatistics getTierStatistics() {
+    TierStatistics stats;
+    memset( &stats, 0, sizeof(stats) );
+    return stats;
+  }
+
+
+  /// Create a tile key
+  /**
+   *  @param i interned image - see IIPImage::getImageId()
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param c compression type
+   *  @param q compression quality
+   *  @return key
+   */
+  static TileKey getIndex( const TileKey::Image* i, int r, int t, int h, int v, CompressionType c, int q ) {
+    return TileKey( i, r, t, h, v, c, q );
+  }
+
+
+  /// Create a tile key from an image path
+  /** Slower than the version above as the path must be interned on each call
+   *  @param f filename
+   */
+  static TileKey getIndex( const std::string& f, int r, int t, int h, int v, CompressionType c, int q ) {
+    return TileKey( TileKey::intern( f ), r, t, h, v, c, q );
+  }
+
+
+  /// Create the key of a tile. This interns the tile's file name, so is
+  /// only used on insertion and eviction, not on lookups
+  static TileKey getIndex( const RawTile& r ) {
+    return getIndex( r.filename, r.resolution, r.tileNum, r.hSequence, r.vSequence, r.compressionType, r.quality );
+  }
+
+};
+
+
+
+/// Cache to store tiles in our own memory
+/** Optionally, part of the budget can be set aside for a compressed cold tier:
+    uncompressed tiles evicted from the main (hot) cache are deflated into a
+    separate LRU cache and inflated and moved back when next requested, so that
+    several times as many raw tiles fit in the same memory. Already compressed
+    tiles are moved as they are. Lookups which miss both tiers go on to any
+    second level store, and compressed tiles leaving memory are written to it.
+ */
+class MemoryTileCache : public TileCache, public Cache<TileKey, RawTile, TileIndex> {
 
   protected:
 
-   typedef Cache<std::string, RawTile> BaseCacheType;
+   typedef Cache<TileKey, RawTile, TileIndex> BaseCacheType;
 
-  /// Main cache storage typedef  Don't need to store key in list again.
+  /// Main cache storage typedef
   typedef BaseCacheType::ObjectList ObjectList;
+  /// Main cache list entry typedef
+  typedef BaseCacheType::Entry Entry;
   /// Main cache list iterator typedef
   typedef BaseCacheType::List_Iter List_Iter;
   /// Index typedef
@@ -336,70 +697,419 @@ class TileCache : public Cache<std::string, RawTile> {
   /// Basic object storage size
   const int objSize;
 
+  /// Optional second level store, such as a file on a local SSD. Not owned by us
+  TileStore* secondLevel;
+
+  /// Store that tiles leaving memory are written to - the second level store of
+  /// the last of our tiers, or NULL
+  TileStore* spill;
+
+  /// Compressed cold tier or NULL
+  MemoryTileCache* cold;
+
+  /// Tier statistics - updated without our lock held
+  std::atomic<uint64_t> lookups, hotHits, coldHits, diskHits, coldTime, diskTime, demotions, demotionTime;
+
+
+  /// Return an empty tile with the same key and format as another
+  static RawTilePtr _header( const RawTile& r ) {
+    RawTilePtr t( new RawTile( r.tileNum, r.resolution, r.hSequence, r.vSequence,
+                               r.width, r.height, r.channels, r.bpc ) );
+    t->compressionType = r.compressionType;
+    t->quality = r.quality;
+    t->filename = r.filename;
+    t->timestamp = r.timestamp;
+    t->cost = r.cost;
+    t->sampleType = r.sampleType;
+    t->padded = r.padded;
+    return t;
+  }
+
+
+  /// Deflate an uncompressed tile for the cold tier
+  /** The data is the uncompressed length as a 32 bit integer followed by the zlib stream
+   *  @return compressed tile, the tile itself if already compressed, or an empty pointer
+   *          if the tile does not compress
+   */
+  static RawTilePtr _pack( const RawTilePtr r ) {
+    if( r->compressionType != UNCOMPRESSED ) return r;
+#ifdef HAVE_ZLIB
+    uLongf length = compressBound( r->dataLength );
+    std::vector<unsigned char> buffer( length );
+    if( compress2( &buffer[0], &length, (const Bytef*) r->data, r->dataLength, COLD_TIER_COMPRESSION ) != Z_OK ||
+        length + sizeof(uint32_t) >= (size_t) r->dataLength ) return RawTilePtr();
+
+    RawTilePtr packed = _header( *r );
+    packed->dataLength = length + sizeof(uint32_t);
+    packed->data = packed->allocate( packed->dataLength );
+    uint32_t original = r->dataLength;
+    memcpy( packed->data, &original, sizeof(uint32_t) );
+    memcpy( (unsigned char*) packed->data + sizeof(uint32_t), &buffer[0], length );
+    return packed;
+#else
+    return RawTilePtr();
+#endif
+  }
+
+
+  /// Inflate a tile from the cold tier
+  /** @return tile, or an empty pointer if the data is damaged */
+  static RawTilePtr _unpack( const RawTilePtr packed ) {
+    if( packed->compressionType != UNCOMPRESSED ) return packed;
+#ifdef HAVE_ZLIB
+    uint32_t original;
+    memcpy( &original, packed->data, sizeof(uint32_t) );
+    RawTilePtr r = _header( *packed );
+    r->data = r->allocate( original );
+    uLongf length = original;
+    if( uncompress( (Bytef*) r->data, &length, (const Bytef*) packed->data + sizeof(uint32_t),
+                    packed->dataLength - sizeof(uint32_t) ) != Z_OK || length != original ) return RawTilePtr();
+    r->dataLength = original;
+    return r;
+#else
+    return RawTilePtr();
+#endif
+  }
+
+
+  /// Move tiles evicted from this tier into the cold tier or, without one, into the second level
+  /** Only compressed tiles are worth a write to the second level. Compression and
+   *  writing are done without our lock held
+   */
+  void _demote() {
+    std::vector< std::pair<TileKey, RawTilePtr> > tiles;
+    {
+      std::lock_guard<std::mutex> guard( this->mutex );
+      tiles.swap( this->demoted );
+    }
+    for( unsigned int i = 0; i < tiles.size(); i++ ){
+      const RawTilePtr& tile = tiles[i].second;
+      if( !cold ){
+        if( spill && tile->compressionType != UNCOMPRESSED ) spill->put( *tiles[i].first.source, *tile );
+        continue;
+      }
+      Timer timer;
+      timer.start();
+      RawTilePtr packed = _pack( tile );
+      demotionTime += timer.getTime();
+      demotions++;
+      if( packed ) cold->insert( packed );
+    }
+  }
+
+
+  /// Add a tile found in a lower tier to the hot tier
+  void _promote( const RawTilePtr r ) {
+    BaseCacheType::insert( r );
+    if( this->demote ) this->_demote();
+  }
+
+
+  /// Move a tile from the cold tier to the hot tier
+  /** @return tile or an empty pointer if not in the cold tier */
+  RawTilePtr _thaw( const TileKey &key ) {
+    RawTilePtr packed = cold->getObject( key );
+    if( !packed ) return packed;
+
+    Timer timer;
+    timer.start();
+    RawTilePtr r = _unpack( packed );
+    coldTime += timer.getTime();
+
+    cold->evict( packed );
+    if( r ){
+      coldHits++;
+      this->_promote( r );
+    }
+    return r;
+  }
+
   // can store list iterators in map because list iterators are not affected by insert/delete etc to list.
 
   // remember to add objSize.
-  virtual size_t getRecordSize( const std::string &key, const RawTilePtr val ) {
-    return ( val->dataLength +
-            ( val->filename.capacity() + key.capacity() ) * sizeof(char) +
-        this->objSize );
+  /// Count the bytes the allocator actually reserved for the tile where it can tell us
+  virtual size_t getRecordSize( const TileKey &key, const RawTilePtr val ) {
+    size_t data = val->allocatedSize();
+    size_t tile = Allocations::usableSize( val.get() );
+    return ( ( data ? data : val->dataLength ) +
+             Allocations::stringSize( val->filename ) +
+             ( tile ? tile : sizeof( RawTile ) ) +
+             this->objSize );
   }
 
 
-  virtual std::string getIndex( const RawTilePtr r ) {
-    return TileCache::getIndex( r->filename, r->resolution, r->tileNum,
-                     r->hSequence, r->vSequence, r->compressionType, r->quality );
+  virtual TileKey getIndex( const RawTilePtr r ) {
+    return TileCache::getIndex( *r );
   }
 
   virtual time_t getTimestamp ( const RawTilePtr r ) {
     return r->timestamp;
   }
 
+  /// Tiles whose production time was not measured are treated as cheap
+  virtual double getCost( const RawTilePtr r ) {
+    return r->cost ? r->cost : 1;
+  }
+
+  /// Tiles are grouped by image for quotas
+  virtual uint32_t getGroup( const TileKey &key ) {
+    return key.image;
+  }
+
 
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in MBs */
-  explicit TileCache( float max ) :
-   objSize(sizeof( RawTile ) +
-           sizeof( RawTilePtr ) +
-           sizeof( List_Iter ) +
-           sizeof( std::pair<std::string, List_Iter> ) +
-           sizeof(char) * 64), BaseCacheType(ceil(max * 1024.0 * 1024.0)) {};
-  // 64 chars added at the end represents an average string length
+  /** @param max Maximum cache size in MBs
+      @param admission whether to use TinyLFU admission rather than plain LRU
+      @param greedyDual whether to use GreedyDual-Size rather than LRU eviction
+      @param quota maximum size in MBs of the tiles of any one image, or 0 for no limit
+      @param coldSize size in MBs of the compressed cold tier, taken from max. Ignored
+             without zlib
+   */
+  explicit MemoryTileCache( float max, bool admission = false, bool greedyDual = false, float quota = 0,
+                            float coldSize = 0 ) :
+   BaseCacheType(ceil((max - coldTierSize(coldSize)) * 1024.0 * 1024.0),
+                 admission ? (size_t) ceil((max - coldTierSize(coldSize)) * 1024.0 * 1024.0 / SKETCH_TILE_SIZE) : 0,
+                 greedyDual, ceil(quota * 1024.0 * 1024.0)),
+   objSize(4 * sizeof( void* ) +                               // shared pointer control block
+           sizeof( Entry ) + 2 * sizeof( void* ) +              // list node
+           sizeof( ObjectMap::Slot ) * 10 / 7),                 // index slot at maximum load
+   secondLevel( NULL ),
+   spill( NULL ),
+   cold( NULL ),
+   lookups( 0 ), hotHits( 0 ), coldHits( 0 ), diskHits( 0 ),
+   coldTime( 0 ), diskTime( 0 ), demotions( 0 ), demotionTime( 0 ) {
+    if( coldTierSize( coldSize ) > 0 ){
+      cold = new MemoryTileCache( coldTierSize( coldSize ) );
+      this->demote = true;
+    }
+  };
 
 
   /// Destructor
-  virtual ~TileCache() {}
+  virtual ~MemoryTileCache() {
+    delete cold;
+  }
 
 
-  /// Create a hash index
-  /** 
-   *  @param f filename
-   *  @param r resolution number
-   *  @param t tile number
-   *  @param h horizontal sequence number
-   *  @param v vertical sequence number
-   *  @param c compression type
-   *  @param q compression quality
-   *  @return string
+  /// Return the cold tier size in MBs that a requested size gives
+  static float coldTierSize( float coldSize ) {
+#ifdef HAVE_ZLIB
+    return coldSize > 0 ? coldSize : 0;
+#else
+    return 0;
+#endif
+  }
+
+
+  /// Return the lookup statistics of each tier
+  virtual TierStatistics getTierStatistics() {
+    TierStatistics stats = { lookups, hotHits, coldHits, diskHits,
+                             coldTime, diskTime, demotions, demotionTime };
+    return stats;
+  }
+
+
+  /// Set a second level store
+  /** Misses are looked up in the store and hits promoted to memory. Compressed
+   *  tiles are written to the store as they are evicted from memory, so tiles
+   *  still in memory when the process exits are not kept. Must be called before
+   *  the cache is used. The caller must keep the store open for the life of the cache
+   *  @param store tile store
    */
-  static std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
-    char tmp[1024];
-    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+  virtual void setSecondLevel( TileStore* store ) {
+    secondLevel = store;
+    MemoryTileCache* last = cold ? cold : this;
+    last->spill = store;
+    last->demote = ( store != NULL );
+  }
+
+
+  virtual void clear() {
+    BaseCacheType::clear();
+    if( cold ) cold->clear();
+  }
+
+  virtual void clearStores() {
+    if( secondLevel ) secondLevel->clear();
+  }
+
+  virtual void insert( const RawTilePtr r ) {
+    BaseCacheType::insert( r );
+    if( this->demote ) this->_demote();
+  }
+
+  virtual RawTilePtr getObject( const TileKey &key ) {
+    lookups++;
+    RawTilePtr r = BaseCacheType::getObject( key );
+    if( r ){
+      hotHits++;
+      return r;
+    }
+    if( cold && (r = this->_thaw( key )) ) return r;
+    if( !secondLevel || !key.source ) return r;
+
+    Timer timer;
+    timer.start();
+    r = secondLevel->get( *key.source, key );
+    if( r ){
+      diskTime += timer.getTime();
+      diskHits++;
+      r->filename = key.source->path;
+      this->_promote( r );
+    }
+    return r;
+  }
+
+  virtual void evict( const RawTilePtr r ) {
+    BaseCacheType::evict( r );
+    if( cold && r ) cold->evict( r );
+    if( secondLevel && r ){
+      TileKey key = getIndex( r );
+      secondLevel->remove( *key.source, key, r->timestamp );
+    }
+  }
+
+  virtual unsigned int getNumElements() {
+    return BaseCacheType::getNumElements() + ( cold ? cold->getNumElements() : 0 );
   }
 
   virtual float getMemorySize() {
-    return currentSize / (1024.0 * 1024.0);
+    float size = cold ? cold->getMemorySize() : 0;
+    std::lock_guard<std::mutex> guard( this->mutex );
+    return size + currentSize / (1024.0 * 1024.0);
+  }
+
+
+};
+
+
+
+/// Smallest shard size in MB worth having - smaller shards make LRU eviction too coarse
+#define MIN_SHARD_SIZE 4
+
+
+/// Tile cache split into independently locked LRU shards
+/** Keys are distributed over the shards by their hash so that concurrent requests
+    for different tiles rarely wait on the same lock. The byte budget is divided
+    equally between the shards.
+ */
+class ShardedTileCache : public TileCache {
+
+ private:
+
+  /// Our shards
+  std::vector<MemoryTileCache*> shards;
+
+  /// Return the shard responsible for a particular key
+  /** Uses the upper half of the key hash as the lower bits select the index slot */
+  MemoryTileCache* shard( const TileKey &key ) {
+    return shards[ (key.hash >> 32) % shards.size() ];
+  }
+
+
+ public:
+
+  /// Constructor
+  /** @param max Maximum total cache size in MBs
+      @param n number of shards
+      @param admission whether to use TinyLFU admission rather than plain LRU
+      @param greedyDual whether to use GreedyDual-Size rather than LRU eviction
+      @param quota maximum size in MBs of the tiles of any one image, or 0 for no limit.
+             An image's tiles are spread over all shards, so each shard gets its share
+      @param coldSize total size in MBs of the compressed cold tiers, taken from max
+   */
+  ShardedTileCache( float max, unsigned int n, bool admission = false, bool greedyDual = false, float quota = 0,
+                    float coldSize = 0 ) {
+    if( n < 1 ) n = 1;
+    for( unsigned int i = 0; i < n; i++ ){
+      shards.push_back( new MemoryTileCache( max / n, admission, greedyDual, quota / n, coldSize / n ) );
+    }
+  };
+
+
+  /// Destructor
+  virtual ~ShardedTileCache() {
+    for( unsigned int i = 0; i < shards.size(); i++ ) delete shards[i];
+  }
+
+
+  /// Return the number of shards
+  unsigned int getNumShards() { return shards.size(); }
+
+
+  virtual void setSecondLevel( TileStore* store ) {
+    for( unsigned int i = 0; i < shards.size(); i++ ) shards[i]->setSecondLevel( store );
+  }
+
+
+  virtual void clear() {
+    for( unsigned int i = 0; i < shards.size(); i++ ) shards[i]->clear();
+  }
+
+  /// Our shards share their second level store
+  virtual void clearStores() {
+    shards[0]->clearStores();
+  }
+
+  virtual void insert( const RawTilePtr r ) {
+    if( !r ) return;
+    shard( getIndex( *r ) )->insert( r );
+  }
+
+  virtual RawTilePtr getObject( const TileKey &key ) {
+    return shard( key )->getObject( key );
+  }
+
+  virtual void evict( const RawTilePtr r ) {
+    if( !r ) return;
+    shard( getIndex( *r ) )->evict( r );
+  }
+
+  virtual unsigned int getNumElements() {
+    unsigned int n = 0;
+    for( unsigned int i = 0; i < shards.size(); i++ ) n += shards[i]->getNumElements();
+    return n;
+  }
+
+  virtual float getMemorySize() {
+    float size = 0;
+    for( unsigned int i = 0; i < shards.size(); i++ ) size += shards[i]->getMemorySize();
+    return size;
   }
 
+  virtual TierStatistics getTierStatistics() {
+    TierStatistics total;
+    memset( &total, 0, sizeof(total) );
+    for( unsigned int i = 0; i < shards.size(); i++ ){
+      TierStatistics s = shards[i]->getTierStatistics();
+      total.lookups += s.lookups;
+      total.hotHits += s.hotHits;
+      total.coldHits += s.coldHits;
+      total.diskHits += s.diskHits;
+      total.coldTime += s.coldTime;
+      total.diskTime += s.diskTime;
+      total.demotions += s.demotions;
+      total.demotionTime += s.demotionTime;
+    }
+    return total;
+  }
 
 };
 
 
 
 
+
+/// Cache of open images
+/** Entries are sized by their estimated memory use, including the memory held
+    by their codec library. As well as the byte budget, the cache limits the
+    number of images and the number of file descriptors they hold open. Images
+    evicted while no request is using them are closed straight away, so that
+    their descriptors and codec memory are released deterministically. Images
+    still in use are closed when the last request using them finishes.
+ */
 class ImageCache : public Cache<std::string, IIPImage> {
 
   protected:
@@ -407,7 +1117,7 @@ class ImageCache : public Cache<std::string, IIPImage> {
    typedef Cache<std::string, IIPImage> BaseCacheType;
 
 
-  /// Main cache storage typedef  Don't need to store key in list again.
+  /// Main cache storage typedef
   typedef BaseCacheType::ObjectList ObjectList;
   /// Main cache list iterator typedef
   typedef BaseCacheType::List_Iter List_Iter;
@@ -415,11 +1125,23 @@ class ImageCache : public Cache<std::string, IIPImage> {
   typedef BaseCacheType::ObjectMap ObjectMap;
 
 
+  /// Maximum number of images
+  const unsigned int maxImages;
+
+  /// Maximum number of file descriptors held by our images, or 0 for no limit
+  const unsigned int maxDescriptors;
+
+  /// Number of descriptors each image held when it was inserted
+  HASHMAP < std::string, unsigned int > descriptors;
+
+  /// Running total of descriptors
+  unsigned int descriptorCount;
+
+
   // can store list iterators in map because list iterators are not affected by insert/delete etc to list.
 
-  // remember to add objSize.
   virtual size_t getRecordSize( const std::string &key, const IIPImagePtr val ) {
-    return 1;
+    return val->getMemoryUsage() + key.capacity();
   }
 
   virtual std::string getIndex( const IIPImagePtr r ) {
@@ -432,20 +1154,92 @@ class ImageCache : public Cache<std::string, IIPImage> {
   }
 
 
+  /// Forget the descriptors of an image leaving the cache
+  virtual void _removed( const std::string &key ) {
+    HASHMAP < std::string, unsigned int >::iterator i = descriptors.find( key );
+    if( i == descriptors.end() ) return;
+    descriptorCount -= i->second;
+    descriptors.erase( i );
+  }
+
+
+  /// Close evicted images that no request is using
+  /** Closing can be slow, so is done without our lock held */
+  void _close() {
+    std::vector< std::pair<std::string, IIPImagePtr> > images;
+    {
+      std::lock_guard<std::mutex> guard( this->mutex );
+      images.swap( this->demoted );
+    }
+    for( unsigned int i = 0; i < images.size(); i++ ){
+      if( images[i].second.use_count() == 1 ) images[i].second->closeImage();
+    }
+  }
+
+
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in number of IIPImage Objects */
-  explicit ImageCache( int max ) : BaseCacheType(max) {};
-  // 64 chars added at the end represents an average string length
+  /** @param max Maximum number of images, or 0 to disable the cache
+      @param maxMemory Maximum estimated memory use in MBs, or 0 for no limit
+      @param maxFiles Maximum number of open file descriptors, or 0 for no limit
+   */
+  explicit ImageCache( unsigned int max, float maxMemory = 0, unsigned int maxFiles = 0 ) :
+    BaseCacheType( max == 0 ? 0 : ( maxMemory > 0 ? (size_t) ceil( maxMemory * 1024.0 * 1024.0 ) : (size_t) -1 ) ),
+    maxImages( max ),
+    maxDescriptors( maxFiles ),
+    descriptorCount( 0 ) {
+    this->demote = true;
+  };
 
 
   /// Destructor
   virtual ~ImageCache() {}
 
-  // get number of image objects.
+
+  virtual void clear() {
+    BaseCacheType::clear();
+    std::lock_guard<std::mutex> guard( this->mutex );
+    descriptors.clear();
+    descriptorCount = 0;
+  }
+
+
+  virtual void insert( const IIPImagePtr r ) {
+    if( maxSize == 0 || !r ) return;
+
+    unsigned int n = r->getDescriptorUsage();
+
+    BaseCacheType::insert( r );
+    {
+      std::lock_guard<std::mutex> guard( this->mutex );
+      if( objMap.find( r->getImagePath() ) != objMap.end() ){
+        unsigned int& d = descriptors[ r->getImagePath() ];
+        descriptorCount += n - d;
+        d = n;
+      }
+
+      // Keep within our image count and descriptor budgets
+      while( !objList.empty() &&
+             ( objList.size() > maxImages || ( maxDescriptors && descriptorCount > maxDescriptors ) ) ){
+        this->_evict( this->_victim() );
+      }
+    }
+    this->_close();
+  }
+
+
+  /// Return the number of file descriptors held by our images
+  unsigned int getNumDescriptors() {
+    std::lock_guard<std::mutex> guard( this->mutex );
+    return descriptorCount;
+  }
+
+
+  /// Return the estimated memory use of our images in MBs
   virtual float getMemorySize() {
-    return currentSize;
+    std::lock_guard<std::mutex> guard( this->mutex );
+    return currentSize / (1024.0 * 1024.0);
   }
 
 };
@@ -0,0 +1,348 @@
+/*
+    IIP Tile Cache Benchmark
+
+    Measures tile cache throughput with several threads hitting the cache at
+    once. Compares the single lock MemoryTileCache with the ShardedTileCache.
+    Then measures the viewer hit ratio of the LRU and TinyLFU admission
+    policies while region exports stream one-off tiles through the cache.
+    Then measures the hit ratio of each tier when part of the cache is a
+    compressed cold tier holding raw tiles. Finally compares allocating tile
+    buffers from the heap and from the TilePool.
+
+    Build with "make cachebench" and run as:
+
+      cachebench [max threads] [operations per thread] [cache size MB] [shards]
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "Cache.h"
+#include "TilePool.h"
+#include "Timer.h"
+
+
+using namespace std;
+
+
+// Number of images and tiles per image making up our key space
+#define IMAGES 8
+#define TILES_PER_IMAGE 1024
+
+// Size of each cached tile - roughly that of a 256x256 JPEG tile
+#define TILE_BYTES 16384
+
+// Percentage of operations which are lookups. Misses are followed by an insert
+#define LOOKUP_PERCENT 95
+
+// Region exports: every SCAN_INTERVAL viewer requests, SCAN_TILES one-off
+// uncompressed tiles of SCAN_TILE_BYTES each pass through the cache
+#define SCAN_INTERVAL 2000
+#define SCAN_TILES 200
+#define SCAN_TILE_BYTES (256*256*3)
+
+// Tile buffers each thread holds while allocating new ones
+#define LIVE_BUFFERS 32
+
+// Bytes reserved for the TilePool
+#define POOL_SIZE (256*1024*1024)
+
+
+/// Small xorshift random number generator - one per thread
+class Random {
+  unsigned long long s;
+ public:
+  Random( unsigned long long seed ) : s( seed*2654435761ULL + 1 ) {};
+  unsigned int next() {
+    s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+    return (unsigned int) s;
+  }
+};
+
+
+/// Create a tile for a particular image and tile number
+static RawTilePtr makeTile( unsigned int image, unsigned int tile ){
+  char name[64];
+  snprintf( name, 64, "/images/benchmark/slide_%u.svs", image );
+  RawTilePtr rt( new RawTile( tile, 0, 0, 0, 256, 256, 3, 8 ) );
+  rt->filename = name;
+  rt->compressionType = JPEG;
+  rt->quality = 75;
+  rt->dataLength = TILE_BYTES;
+  rt->data = rt->allocate( TILE_BYTES );
+  rt->memoryManaged = 1;
+  return rt;
+}
+
+
+/// Pick a tile, skewed towards the start of the key space as with a viewer
+static void pick( Random& random, unsigned int& image, unsigned int& tile ){
+  unsigned int n = random.next() % (IMAGES*TILES_PER_IMAGE);
+  for( int i = 0; i < 2; i++ ){
+    unsigned int r = random.next() % (IMAGES*TILES_PER_IMAGE);
+    if( r < n ) n = r;
+  }
+  image = n / TILES_PER_IMAGE;
+  tile = n % TILES_PER_IMAGE;
+}
+
+
+/// Interned ids of our image names - as returned by IIPImage::getImageId()
+static vector<const TileKey::Image*> imageIds;
+
+
+/// Worker loop: lookups with inserts on misses
+static void worker( TileCache* cache, unsigned int id, unsigned long ops, atomic<unsigned long>* hits ){
+  Random random( id + 1 );
+  unsigned long h = 0;
+
+  for( unsigned long n = 0; n < ops; n++ ){
+    unsigned int image, tile;
+    pick( random, image, tile );
+
+    if( (random.next() % 100) < LOOKUP_PERCENT ){
+      RawTilePtr rt = cache->getObject( TileCache::getIndex( imageIds[image], 0, tile, 0, 0, JPEG, 75 ) );
+      if( rt ){
+	h++;
+	continue;
+      }
+    }
+    cache->insert( makeTile( image, tile ) );
+  }
+
+  *hits += h;
+}
+
+
+/// Run viewer requests interleaved with region exports and return the viewer hit ratio
+static double scan( TileCache* cache, unsigned long ops ){
+  Random random( 1 );
+  unsigned long h = 0;
+  unsigned int export_tile = 0;
+  const TileKey::Image* export_image = TileKey::intern( "/images/benchmark/export.svs" );
+
+  for( unsigned long n = 0; n < ops; n++ ){
+    unsigned int image, tile;
+    pick( random, image, tile );
+    RawTilePtr rt = cache->getObject( TileCache::getIndex( imageIds[image], 0, tile, 0, 0, JPEG, 75 ) );
+    if( rt ) h++;
+    else cache->insert( makeTile( image, tile ) );
+
+    if( n % SCAN_INTERVAL == SCAN_INTERVAL - 1 ){
+      for( unsigned int t = 0; t < SCAN_TILES; t++, export_tile++ ){
+	if( cache->getObject( TileCache::getIndex( export_image, 0, export_tile, 0, 0, UNCOMPRESSED, 0 ) ) ) continue;
+	RawTilePtr et( new RawTile( export_tile, 0, 0, 0, 256, 256, 3, 8 ) );
+	et->filename = "/images/benchmark/export.svs";
+	et->compressionType = UNCOMPRESSED;
+	et->dataLength = SCAN_TILE_BYTES;
+	et->data = et->allocate( SCAN_TILE_BYTES );
+	et->memoryManaged = 1;
+	cache->insert( et );
+      }
+    }
+  }
+
+  return (double) h / (double) ops;
+}
+
+
+/// Create an uncompressed tile which compresses about as well as a slide tile:
+/// mostly smooth background with some noise
+static RawTilePtr makeRawTile( unsigned int image, unsigned int tile, Random& random ){
+  RawTilePtr rt( new RawTile( tile, 0, 0, 0, 256, 256, 3, 8 ) );
+  rt->filename = "/images/benchmark/raw.svs";
+  rt->hSequence = image;
+  rt->dataLength = SCAN_TILE_BYTES;
+  unsigned char* data = (unsigned char*) rt->allocate( SCAN_TILE_BYTES );
+  for( unsigned int i = 0; i < SCAN_TILE_BYTES; i++ ){
+    data[i] = 220 + ( ( (i / 768) + (i % 768) / 48 + tile ) & 15 ) + ( random.next() & 3 );
+  }
+  rt->data = data;
+  rt->memoryManaged = 1;
+  return rt;
+}
+
+
+/// Run viewer requests for uncompressed tiles and report the hit ratio of each tier
+static void tiers( TileCache* cache, unsigned long ops, float cold ){
+  Random random( 1 );
+  const TileKey::Image* raw_image = TileKey::intern( "/images/benchmark/raw.svs" );
+
+  for( unsigned long n = 0; n < ops; n++ ){
+    unsigned int image, tile;
+    pick( random, image, tile );
+    if( !cache->getObject( TileCache::getIndex( raw_image, 0, tile, image, 0, UNCOMPRESSED, 0 ) ) ){
+      cache->insert( makeRawTile( image, tile, random ) );
+    }
+  }
+
+  TileCache::TierStatistics stats = cache->getTierStatistics();
+  printf( "%8.0f%% %10.3f %10.3f %10.3f %12.0f %12.0f\n", cold,
+	  (double) stats.hotHits / stats.lookups, (double) stats.coldHits / stats.lookups,
+	  (double) (stats.hotHits + stats.coldHits) / stats.lookups,
+	  stats.coldHits ? (double) stats.coldTime / stats.coldHits : 0.0,
+	  stats.demotions ? (double) stats.demotionTime / stats.demotions : 0.0 );
+}
+
+
+/// Buffer sizes: 256x256 RGB and RGBA tiles and the JPEG compressor's output buffer
+static const size_t bufferSizes[] = { 256*256*3, 256*256*4, 256*256*3 + 16536 };
+
+
+/// Worker loop: replace random buffers among those held, writing to each page as a decoder would
+static void churn( unsigned int id, unsigned long ops ){
+  Random random( id + 1 );
+  void* live[LIVE_BUFFERS] = { NULL };
+
+  for( unsigned long n = 0; n < ops; n++ ){
+    unsigned int i = random.next() % LIVE_BUFFERS;
+    size_t bytes = bufferSizes[ random.next() % 3 ];
+    RawTile::deallocate( live[i], 8, FIXEDPOINT );
+    live[i] = RawTile::allocate( bytes, 8, FIXEDPOINT );
+    for( size_t b = 0; b < bytes; b += 4096 ) ((unsigned char*) live[i])[b] = (unsigned char) n;
+  }
+
+  for( unsigned int i = 0; i < LIVE_BUFFERS; i++ ){
+    RawTile::deallocate( live[i], 8, FIXEDPOINT );
+  }
+}
+
+
+/// Run buffer allocations on several threads and return the throughput in allocations per second
+static double allocations( unsigned int threads, unsigned long ops ){
+  vector<thread> workers;
+  Timer timer;
+  timer.start();
+  for( unsigned int t = 0; t < threads; t++ ) workers.push_back( thread( churn, t, ops ) );
+  for( unsigned int t = 0; t < threads; t++ ) workers[t].join();
+  return (ops * threads) / ( timer.getTime() / 1000000.0 );
+}
+
+
+/// Run a benchmark on a cache and return the throughput in operations per second
+static double run( TileCache* cache, unsigned int threads, unsigned long ops, double& hit_ratio ){
+
+  // Warm the cache up first
+  Random random( 12345 );
+  for( unsigned int n = 0; n < IMAGES*TILES_PER_IMAGE/4; n++ ){
+    unsigned int image, tile;
+    pick( random, image, tile );
+    cache->insert( makeTile( image, tile ) );
+  }
+
+  atomic<unsigned long> hits( 0 );
+  vector<thread> workers;
+
+  Timer timer;
+  timer.start();
+  for( unsigned int t = 0; t < threads; t++ ){
+    workers.push_back( thread( worker, cache, t, ops, &hits ) );
+  }
+  for( unsigned int t = 0; t < threads; t++ ) workers[t].join();
+  double seconds = timer.getTime() / 1000000.0;
+
+  hit_ratio = (double) hits / (double) (ops * threads);
+  return (ops * threads) / seconds;
+}
+
+
+
+int main( int argc, char *argv[] )
+{
+  unsigned int max_threads = (argc > 1) ? atoi( argv[1] ) : thread::hardware_concurrency();
+  unsigned long ops = (argc > 2) ? atol( argv[2] ) : 200000;
+  float size = (argc > 3) ? atof( argv[3] ) : 64;
+  unsigned int shards = (argc > 4) ? atoi( argv[4] ) : 0;
+
+  if( max_threads < 1 ) max_threads = 1;
+
+  for( unsigned int i = 0; i < IMAGES; i++ ){
+    char name[64];
+    snprintf( name, 64, "/images/benchmark/slide_%u.svs", i );
+    imageIds.push_back( TileKey::intern( name ) );
+  }
+
+  printf( "Tile cache benchmark: %lu operations per thread, %.0f MB cache, %d%% lookups\n\n",
+	  ops, size, LOOKUP_PERCENT );
+  printf( "%8s %8s %16s %10s %16s %10s %8s\n",
+	  "threads", "shards", "TileCache op/s", "hit ratio", "Sharded op/s", "hit ratio", "speedup" );
+
+  for( unsigned int threads = 1; threads <= max_threads; threads *= 2 ){
+
+    unsigned int n = shards ? shards : 4 * threads;
+
+    double single_hits, sharded_hits;
+
+    TileCache* single = new MemoryTileCache( size );
+    double single_ops = run( single, threads, ops, single_hits );
+    delete single;
+
+    TileCache* sharded = new ShardedTileCache( size, n );
+    double sharded_ops = run( sharded, threads, ops, sharded_hits );
+    delete sharded;
+
+    printf( "%8u %8u %16.0f %10.3f %16.0f %10.3f %7.2fx\n",
+	    threads, n, single_ops, single_hits, sharded_ops, sharded_hits, sharded_ops / single_ops );
+  }
+
+  printf( "\nViewer hit ratio with a %d tile region export every %d requests\n\n", SCAN_TILES, SCAN_INTERVAL );
+  printf( "%10s %10s\n", "LRU", "TinyLFU" );
+
+  TileCache* lru = new MemoryTileCache( size );
+  double lru_hits = scan( lru, ops );
+  delete lru;
+
+  TileCache* tinylfu = new MemoryTileCache( size, true );
+  double tinylfu_hits = scan( tinylfu, ops );
+  delete tinylfu;
+
+  printf( "%10.3f %10.3f\n", lru_hits, tinylfu_hits );
+
+  if( MemoryTileCache::coldTierSize( 1 ) > 0 ){
+    printf( "\nHit ratio of each tier for uncompressed %dx%d tiles\n\n", 256, 256 );
+    printf( "%9s %10s %10s %10s %12s %12s\n", "cold", "memory", "compressed", "total", "inflate us", "deflate us" );
+    float percent[] = { 0, 50, 75 };
+    for( unsigned int i = 0; i < 3; i++ ){
+      TileCache* cache = new MemoryTileCache( size, false, false, 0, size * percent[i] / 100 );
+      tiers( cache, ops / 40, percent[i] );
+      delete cache;
+    }
+  }
+
+  // The pool can only be enabled once, so measure the heap for every thread count first
+  printf( "\nTile buffer allocation with %d buffers held per thread\n\n", LIVE_BUFFERS );
+  printf( "%8s %16s %16s %8s\n", "threads", "heap alloc/s", "pool alloc/s", "speedup" );
+  vector<double> heap;
+  for( unsigned int threads = 1; threads <= max_threads; threads *= 2 ){
+    heap.push_back( allocations( threads, ops ) );
+  }
+  TilePool::configure( POOL_SIZE, false );
+  unsigned int i = 0;
+  for( unsigned int threads = 1; threads <= max_threads; threads *= 2, i++ ){
+    double pool = allocations( threads, ops );
+    printf( "%8u %16.0f %16.0f %7.2fx\n", threads, heap[i], pool, pool / heap[i] );
+  }
+  TilePool::Statistics stats = TilePool::statistics();
+  printf( "Pool: %lu buffers, %lu from the heap\n",
+	  (unsigned long) stats.allocations, (unsigned long) stats.fallbacks );
+
+  return 0;
+}
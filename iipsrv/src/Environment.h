@@ -27,9 +27,32 @@
 #define VERBOSITY 1
 #define LOGFILE "/tmp/iipsrv.log"
 #define MAX_IMAGE_CACHE_SIZE 100
+#define MAX_IMAGE_CACHE_MEMORY 0  // MB, 0 = no limit
+#define MAX_IMAGE_CACHE_FILES 0  // 0 = half of the process's open file limit
 #define MAX_TILE_CACHE_SIZE 10
+#define TILE_CACHE_SHARDS 0  // 0 = choose according to the number of worker threads
+#define TILE_CACHE_ADMISSION "lru"  // or "tinylfu"
+#define TILE_CACHE_EVICTION "lru"  // or "gds" for GreedyDual-Size
+#define TILE_CACHE_IMAGE_QUOTA 0  // MB per image, 0 = no limit
+#define TILE_CACHE_COLD 0  // percentage of the tile cache holding compressed tiles
+#define TILE_CACHE_SHM ""  // shared memory name, eg. "/iipsrv", to share the tile cache between processes
+#define TILE_CACHE_DISK ""  // file for a persistent second level tile cache, eg. on a local SSD
+#define TILE_CACHE_DISK_SIZE 1024  // MB
+#define TILE_POOL_SIZE 64  // MB reserved for pooled tile buffers, 0 to allocate from the heap
+#define TILE_POOL_HUGEPAGES 0  // back pooled tile buffers with transparent huge pages
+#define WORKER_THREADS 1
+#define PREFETCH_THREADS 0  // threads prefetching likely next tiles, 0 to disable prefetching
+#define PREFETCH_DEPTH 4  // tiles predicted after each tile request
+#define PREFETCH_QUEUE 64  // maximum predictions waiting to be prefetched
+#define BIOFORMATS_THREADS 0  // threads reading BioFormats images in parallel, 0 to read on the requesting thread
+#define BIOFORMATS_QUEUE 64  // maximum BioFormats reads waiting for a thread
+#define BIOFORMATS_READERS 2  // images each BioFormats thread keeps open, each with a 32MB buffer, so the pool
+                              // can hold BIOFORMATS_THREADS x BIOFORMATS_READERS x 32MB per process
+#define WARM_LEVELS 0  // lowest resolutions built in the background when an image is opened
+#define PRELOAD_MANIFEST ""  // file listing images to open and warm at startup, one per line
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
+#define JPEG_PASSTHROUGH 0  // send JPEG tiles stored in image files as they are to requests at the default quality
 #define MAX_CVT 5000
 #define MAX_LAYERS 0
 #define FILESYSTEM_PREFIX ""
@@ -80,6 +103,28 @@ class Environment {
     return max_image_cache_size;
   }
 
+  static float getMaxImageCacheMemory(){
+    float max_image_cache_memory = MAX_IMAGE_CACHE_MEMORY;
+    char* envpara = getenv( "MAX_IMAGE_CACHE_MEMORY" );
+    if( envpara ){
+      max_image_cache_memory = atof( envpara );
+      if( max_image_cache_memory < 0 ) max_image_cache_memory = 0;
+    }
+    return max_image_cache_memory;
+  }
+
+
+  static unsigned int getMaxImageCacheFiles(){
+    int max_image_cache_files = MAX_IMAGE_CACHE_FILES;
+    char* envpara = getenv( "MAX_IMAGE_CACHE_FILES" );
+    if( envpara ){
+      max_image_cache_files = atoi( envpara );
+      if( max_image_cache_files < 0 ) max_image_cache_files = 0;
+    }
+    return max_image_cache_files;
+  }
+
+
   static float getMaxTileCacheSize(){
     float max_tile_cache_size = MAX_TILE_CACHE_SIZE;
     char* envpara = getenv( "MAX_TILE_CACHE_SIZE" );
@@ -90,6 +135,204 @@ class Environment {
   }
 
 
+  static unsigned int getTileCacheShards(){
+    int tile_cache_shards = TILE_CACHE_SHARDS;
+    char* envpara = getenv( "TILE_CACHE_SHARDS" );
+    if( envpara ){
+      tile_cache_shards = atoi( envpara );
+      if( tile_cache_shards < 0 ) tile_cache_shards = 0;
+    }
+    return tile_cache_shards;
+  }
+
+
+  static std::string getTileCacheAdmission(){
+    char* envpara = getenv( "TILE_CACHE_ADMISSION" );
+    std::string admission;
+    if( envpara ) admission = std::string( envpara );
+    else admission = TILE_CACHE_ADMISSION;
+    return admission;
+  }
+
+
+  static std::string getTileCacheEviction(){
+    char* envpara = getenv( "TILE_CACHE_EVICTION" );
+    std::string eviction;
+    if( envpara ) eviction = std::string( envpara );
+    else eviction = TILE_CACHE_EVICTION;
+    return eviction;
+  }
+
+
+  static float getTileCacheImageQuota(){
+    float quota = TILE_CACHE_IMAGE_QUOTA;
+    char* envpara = getenv( "TILE_CACHE_IMAGE_QUOTA" );
+    if( envpara ){
+      quota = atof( envpara );
+      if( quota < 0 ) quota = 0;
+    }
+    return quota;
+  }
+
+
+  static float getTileCacheCold(){
+    float cold = TILE_CACHE_COLD;
+    char* envpara = getenv( "TILE_CACHE_COLD" );
+    if( envpara ){
+      cold = atof( envpara );
+      if( cold < 0 ) cold = 0;
+      else if( cold > 90 ) cold = 90;
+    }
+    return cold;
+  }
+
+
+  static std::string getTileCacheSHM(){
+    char* envpara = getenv( "TILE_CACHE_SHM" );
+    std::string name;
+    if( envpara ) name = std::string( envpara );
+    else name = TILE_CACHE_SHM;
+    return name;
+  }
+
+
+  static std::string getTileCacheDisk(){
+    char* envpara = getenv( "TILE_CACHE_DISK" );
+    std::string path;
+    if( envpara ) path = std::string( envpara );
+    else path = TILE_CACHE_DISK;
+    return path;
+  }
+
+
+  static float getTileCacheDiskSize(){
+    float size = TILE_CACHE_DISK_SIZE;
+    char* envpara = getenv( "TILE_CACHE_DISK_SIZE" );
+    if( envpara ){
+      size = atof( envpara );
+      if( size < 1 ) size = 1;
+    }
+    return size;
+  }
+
+
+  static float getTilePoolSize(){
+    float size = TILE_POOL_SIZE;
+    char* envpara = getenv( "TILE_POOL_SIZE" );
+    if( envpara ){
+      size = atof( envpara );
+      if( size < 0 ) size = 0;
+    }
+    return size;
+  }
+
+
+  static bool getTilePoolHugePages(){
+    bool huge = TILE_POOL_HUGEPAGES;
+    char* envpara = getenv( "TILE_POOL_HUGEPAGES" );
+    if( envpara ) huge = ( atoi( envpara ) != 0 );
+    return huge;
+  }
+
+
+  static unsigned int getPrefetchThreads(){
+    int threads = PREFETCH_THREADS;
+    char* envpara = getenv( "PREFETCH_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 0 ) threads = 0;
+    }
+    return threads;
+  }
+
+
+  static unsigned int getPrefetchDepth(){
+    int depth = PREFETCH_DEPTH;
+    char* envpara = getenv( "PREFETCH_DEPTH" );
+    if( envpara ){
+      depth = atoi( envpara );
+      if( depth < 1 ) depth = 1;
+    }
+    return depth;
+  }
+
+
+  static unsigned int getPrefetchQueue(){
+    int queue = PREFETCH_QUEUE;
+    char* envpara = getenv( "PREFETCH_QUEUE" );
+    if( envpara ){
+      queue = atoi( envpara );
+      if( queue < 1 ) queue = 1;
+    }
+    return queue;
+  }
+
+
+  static unsigned int getBioFormatsThreads(){
+    int threads = BIOFORMATS_THREADS;
+    char* envpara = getenv( "BIOFORMATS_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 0 ) threads = 0;
+    }
+    return threads;
+  }
+
+
+  static unsigned int getBioFormatsQueue(){
+    int queue = BIOFORMATS_QUEUE;
+    char* envpara = getenv( "BIOFORMATS_QUEUE" );
+    if( envpara ){
+      queue = atoi( envpara );
+      if( queue < 1 ) queue = 1;
+    }
+    return queue;
+  }
+
+
+  static unsigned int getBioFormatsReaders(){
+    int readers = BIOFORMATS_READERS;
+    char* envpara = getenv( "BIOFORMATS_READERS" );
+    if( envpara ){
+      readers = atoi( envpara );
+      if( readers < 1 ) readers = 1;
+    }
+    return readers;
+  }
+
+
+  static unsigned int getWarmLevels(){
+    int levels = WARM_LEVELS;
+    char* envpara = getenv( "WARM_LEVELS" );
+    if( envpara ){
+      levels = atoi( envpara );
+      if( levels < 0 ) levels = 0;
+    }
+    return levels;
+  }
+
+
+  static std::string getPreloadManifest(){
+    char* envpara = getenv( "PRELOAD_MANIFEST" );
+    std::string path;
+    if( envpara ) path = std::string( envpara );
+    else path = PRELOAD_MANIFEST;
+    return path;
+  }
+
+
+  static unsigned int getWorkerThreads(){
+    int worker_threads = WORKER_THREADS;
+    char* envpara = getenv( "WORKER_THREADS" );
+    if( envpara ){
+      worker_threads = atoi( envpara );
+      // We always need at least one thread to serve requests
+      if( worker_threads < 1 ) worker_threads = 1;
+    }
+    return worker_threads;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
@@ -116,6 +359,14 @@ class Environment {
   }
 
 
+  static bool getJPEGPassthrough(){
+    bool passthrough = JPEG_PASSTHROUGH;
+    char* envpara = getenv( "JPEG_PASSTHROUGH" );
+    if( envpara ) passthrough = ( atoi( envpara ) != 0 );
+    return passthrough;
+  }
+
+
   static int getMaxCVT(){
     char* envpara = getenv( "MAX_CVT" );
     int max_CVT;
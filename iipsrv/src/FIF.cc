@@ -30,6 +30,7 @@
 #include "URL.h"
 #include "Environment.h"
 #include "TPTImage.h"
+#include "SingleFlight.h"
 
 #ifdef HAVE_KAKADU
 #include "KakaduImage.h"
@@ -42,6 +43,10 @@
 using namespace std;
 
 
+/// Images being opened, shared by all worker threads
+static SingleFlight<string, IIPImagePtr> imageOpens;
+
+
 
 void FIF::run( Session* session, const string& src ){
 
@@ -80,76 +85,111 @@ void FIF::run( Session* session, const string& src ){
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
+    IIPImagePtr previous;
     auto temp = session->imageCache->getObject(argument);
     // Cache Hit
     if(  temp ){
       if( session->loglevel >= 2 ){
-        *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->getNumElements() << endl;
+        *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->getNumElements()
+                            << ", " << session->imageCache->getMemorySize() << " MB, "
+                            << session->imageCache->getNumDescriptors() << " open files" << endl;
       }
 
       // get the image, then check it's timestamp.
       if (difftime(IIPImage::getFileTimestamp(temp->getFileName(temp->currentX, temp->currentY)),
                    temp->timestamp)  >
           std::numeric_limits<double>::round_error()) {
-        // file on filesystem newer. so reopen it.
+        // file on filesystem newer. Other threads may still be using the cached
+        // object, so open a fresh one which replaces it in the cache.
 
           if( session->loglevel >= 2 ){
             *(session->logfile) << "FIF :: Newer file on FS.  reloading " << endl;
           }
-        temp->closeImage();
-        temp->openImage();
+        previous = temp;
+        temp.reset();
       }
     }
     // Cache Miss
-    else{
+    if( !temp ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
       // eviction handled by ImageCache.
 
-       //==== Create our test IIPImage object to get timestamp and image type.
-        IIPImage test = IIPImage( argument );
-        test.setFileNamePattern( filename_pattern );
-        test.setFileSystemPrefix( filesystem_prefix );
-        test.Initialise();  // also gathers the timestamp here.
+      // Only one request opens an image at a time. Requests for the same image
+      // arriving meanwhile wait and share the result rather than opening it again
+      bool shared = false;
+      temp = imageOpens.run( argument, [&]() -> IIPImagePtr {
 
-        /***************************************************************
-          Test for different image types - only TIFF is native for now
-        ***************************************************************/
+          // Another request may have opened the image since we looked
+          IIPImagePtr cached = session->imageCache->getObject( argument );
+          if( cached && cached != previous ) return cached;
 
-        ImageFormat format = test.getImageFormat();
+          //==== Create our test IIPImage object to get timestamp and image type.
+          IIPImage test = IIPImage( argument );
+          test.setFileNamePattern( filename_pattern );
+          test.setFileSystemPrefix( filesystem_prefix );
+          test.Initialise();  // also gathers the timestamp here.
 
-        if( format == TIF ){
-          if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
-          temp = IIPImagePtr(new TPTImage( test ));
-        }
+          /***************************************************************
+            Test for different image types - only TIFF is native for now
+          ***************************************************************/
+
+          ImageFormat format = test.getImageFormat();
+
+          if( format == TIF ){
+            if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
+            temp = IIPImagePtr(new TPTImage( test ));
+          }
 #pragma mark Adding in basic openslide functionality
-        else if( format == OPENSLIDE ){
-          if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: OpenSlide image detected" << endl;
-          temp = IIPImagePtr(new OpenSlideImage( test, session->tileCache ));
-        }
+          else if( format == OPENSLIDE ){
+            if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: OpenSlide image detected" << endl;
+            temp = IIPImagePtr(new OpenSlideImage( test, session->tileCache ));
+          }
 #pragma mark Adding in basic bioformats functionality
-        else if (format == BIOFORMATS)
-        {
-          if (session->loglevel >= 2)
-            *(session->logfile) << "FIF :: BioFormats image detected" << endl;
-          temp = IIPImagePtr(new BioFormatsImage(test, session->tileCache));
-        }
+          else if (format == BIOFORMATS)
+          {
+            if (session->loglevel >= 2)
+              *(session->logfile) << "FIF :: BioFormats image detected" << endl;
+            temp = IIPImagePtr(new BioFormatsImage(test, session->tileCache));
+          }
 #ifdef HAVE_KAKADU
-        else if( format == JPEG2000 ){
-          if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
-          temp = IIPImagePtr(new KakaduImage( test ));
-        }
+          else if( format == JPEG2000 ){
+            if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
+            temp = IIPImagePtr(new KakaduImage( test ));
+          }
     #endif
-        else throw string( "Unsupported image type: " + argument );
+          else throw string( "Unsupported image type: " + argument );
+
+          //==== create format specific iipimage subclass instance as pointer.
+
+          // Open image, and add it to our cache
+          temp->openImage();
+          temp->internImageId();
+          session->imageCache->insert(temp);    // insert into cache.
+
+          // Build the lowest resolutions in the background, as every viewer starts there
+          unsigned int warm_levels = Environment::getWarmLevels();
+          if( session->prefetcher && warm_levels > 0 ){
+            session->prefetcher->warm( temp, warm_levels, session->view->getLayers(), session->jpeg->getQuality() );
+            if( session->loglevel >= 3 ){
+              *(session->logfile) << "FIF :: Warming " << warm_levels << " lowest resolutions" << endl;
+            }
+          }
 
-        //==== create format specific iipimage subclass instance as pointer.
+          if( session->loglevel >= 3 ){
+            *(session->logfile) << "FIF :: Created and cached image object with key = \"" << argument << "\"" << endl
+                                << "FIF :: Image uses " << temp->getMemoryUsage() / 1024 << " kB and "
+                                << temp->getDescriptorUsage() << " open files. Image cache: "
+                                << session->imageCache->getNumElements() << " images, "
+                                << session->imageCache->getMemorySize() << " MB, "
+                                << session->imageCache->getNumDescriptors() << " open files" << endl;
+          }
 
-        // Open image, and add it to our cache
-        temp->openImage();
-        session->imageCache->insert(temp);    // insert into cache.
+          return temp;
+        }, &shared );
 
-        if( session->loglevel >= 3 ){
-          *(session->logfile) << "FIF :: Created and cached image object with key = \"" << argument << "\"" << endl;
-        }
+      if( shared && session->loglevel >= 2 ){
+        *(session->logfile) << "FIF :: Image opened by a concurrent request" << endl;
+      }
     }
 
 
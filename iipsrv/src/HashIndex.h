@@ -0,0 +1,138 @@
+// Open Addressing Hash Index
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HASHINDEX_H
+#define _HASHINDEX_H
+
+
+#include <vector>
+#include <cstddef>
+
+
+/// Open addressing hash table with linear probing
+/** Stores entries inline in a single array so that a lookup touches one or two
+    cache lines rather than following bucket chains. Deletion uses backward
+    shifting, so there are no tombstones and probe sequences stay short.
+    Implements the subset of the std::unordered_map interface used by Cache.
+    Keys should carry a good hash: the low bits select the slot.
+
+    Iterators are invalidated by any insertion or erasure.
+ */
+template <typename Key, typename Value, typename Hash>
+class HashIndex {
+
+ public:
+
+  /// Table slot. Named like std::pair so iterators can be used in the same way
+  struct Slot {
+    Key first;
+    Value second;
+    bool used;
+    Slot() : used( false ) {};
+  };
+
+  typedef Slot* iterator;
+
+
+ private:
+
+  std::vector<Slot> slots;
+  size_t count;
+  size_t mask;
+  Hash hasher;
+
+  /// Grow once the table is 70% full
+  bool full() const { return (count+1) * 10 > slots.size() * 7; };
+
+  size_t position( const Key& key ) const { return hasher( key ) & mask; };
+
+  void rehash( size_t n ){
+    std::vector<Slot> old;
+    old.swap( slots );
+    slots.resize( n );
+    mask = n - 1;
+    count = 0;
+    for( size_t i = 0; i < old.size(); i++ ){
+      if( old[i].used ) (*this)[ old[i].first ] = old[i].second;
+    }
+  };
+
+
+ public:
+
+  /// Constructor
+  /** @param n initial number of slots - must be a power of two */
+  explicit HashIndex( size_t n = 64 ) : slots( n ), count( 0 ), mask( n - 1 ) {};
+
+  iterator end() { return NULL; };
+
+  size_t size() const { return count; };
+
+  void clear(){
+    for( size_t i = 0; i < slots.size(); i++ ) slots[i] = Slot();
+    count = 0;
+  };
+
+
+  iterator find( const Key& key ){
+    for( size_t i = position( key ); slots[i].used; i = (i+1) & mask ){
+      if( slots[i].first == key ) return &slots[i];
+    }
+    return end();
+  };
+
+
+  /// Return a reference to the value for a key, inserting a default value if necessary
+  Value& operator [] ( const Key& key ){
+    if( full() ) rehash( slots.size() * 2 );
+    size_t i = position( key );
+    for( ; slots[i].used; i = (i+1) & mask ){
+      if( slots[i].first == key ) return slots[i].second;
+    }
+    slots[i].first = key;
+    slots[i].second = Value();
+    slots[i].used = true;
+    count++;
+    return slots[i].second;
+  };
+
+
+  /// Remove an entry, shifting back any following entries of the same probe run
+  void erase( iterator it ){
+    size_t i = it - &slots[0];
+    size_t j = i;
+    while( true ){
+      j = (j+1) & mask;
+      if( !slots[j].used ) break;
+      size_t k = position( slots[j].first );
+      // Move slot j into the gap at i if its home position is not within (i,j]
+      if( (j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)) ){
+	slots[i] = slots[j];
+	i = j;
+      }
+    }
+    slots[i] = Slot();
+    count--;
+  };
+
+};
+
+
+#endif
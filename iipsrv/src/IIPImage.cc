@@ -52,6 +52,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
 {
   // Swap the members of the two objects
   std::swap( first.imagePath, second.imagePath );
+  std::swap( first.imageId, second.imageId );
   std::swap( first.isFile, second.isFile );
   std::swap( first.suffix, second.suffix );
   std::swap( first.virtual_levels, second.virtual_levels );
@@ -347,6 +348,20 @@ const string IIPImage::getFileName( int seq, int ang )
 
 
 
+size_t IIPImage::getMemoryUsage()
+{
+  size_t size = sizeof( IIPImage ) + imagePath.capacity() + fileSystemPrefix.capacity() +
+    ( image_widths.capacity() + image_heights.capacity() ) * sizeof( unsigned int ) +
+    ( min.capacity() + max.capacity() ) * sizeof( float );
+
+  for( map<const string,string>::const_iterator i = metadata.begin(); i != metadata.end(); ++i ){
+    size += i->first.capacity() + i->second.capacity() + 4 * sizeof( void* );
+  }
+  return size;
+}
+
+
+
 int operator == ( const IIPImage& A, const IIPImage& B )
 {
   if( A.imagePath == B.imagePath ) return( 1 );
@@ -35,8 +35,10 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <mutex>
 
 #include "RawTile.h"
+#include "TileKey.h"
 
 
 /// Define our own derived exception class for file errors
@@ -65,6 +67,9 @@ class IIPImage {
   /// Image path supplied
   std::string imagePath; 
 
+  /// Interned image path used in tile cache keys
+  const TileKey::Image* imageId;
+
   /// Prefix to add to paths
   std::string fileSystemPrefix;
 
@@ -140,16 +145,21 @@ class IIPImage {
   /// Image modification timestamp
   time_t timestamp;
 
+  /// Serialises tile and region decoding for image types that cannot decode concurrently
+  std::mutex decoderMutex;
+
 
  public:
 
   /// Default Constructor
   IIPImage()
-   : isFile( false ),
+   : imageId( 0 ),
+    isFile( false ),
     tile_width( 0 ),
     tile_height( 0 ),
     bpc( 0 ),
     channels( 0 ),
+    sampleType( FIXEDPOINT ),
     quality_layers( 0 ),
     isSet( false ),
     currentX( 0 ),
@@ -161,12 +171,14 @@ class IIPImage {
    */
   IIPImage( const std::string& s )
    : imagePath( s ),
+    imageId( 0 ),
     isFile( false ),
     virtual_levels( 0 ),
     tile_width( 0 ),
     tile_height( 0 ),
     bpc( 0 ),
     channels( 0 ),
+    sampleType( FIXEDPOINT ),
     quality_layers( 0 ),
     isSet( false ),
     currentX( 0 ),
@@ -178,6 +190,7 @@ class IIPImage {
    */
   IIPImage( const IIPImage& image )
    : imagePath( image.imagePath ),
+    imageId( image.imageId ),
     fileSystemPrefix( image.fileSystemPrefix ),
     fileNamePattern( image.fileNamePattern ),
     isFile( image.isFile ),
@@ -225,6 +238,17 @@ class IIPImage {
   /// Return the image path
   const std::string& getImagePath() { return imagePath; };
 
+  /// Return the interned image path for use in tile cache keys
+  /** This is 0 until internImageId() is called */
+  const TileKey::Image* getImageId() { return imageId; };
+
+  /// Intern the image path for use in tile cache keys
+  /** Interned paths are never released, so this is only done once the image
+      has been opened successfully. Otherwise requests for non-existent images
+      could grow the registry without limit
+   */
+  void internImageId() { if( !imageId ) imageId = TileKey::intern( imagePath ); };
+
   /// Return the full file path for a particular horizontal and vertical angle
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -307,6 +331,10 @@ class IIPImage {
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return whether getTile() and getRegion() may be called from several threads at once
+  /** Image types returning false are accessed under decoderMutex */
+  virtual bool concurrentDecoding(){ return false; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
@@ -329,6 +357,16 @@ class IIPImage {
   virtual void closeImage() {;};
 
 
+  /// Return an estimate of the memory in bytes held by this object
+  /** Overloaded by child classes to add the memory held by their codec library */
+  virtual size_t getMemoryUsage();
+
+
+  /// Return the number of file descriptors this image holds open
+  /** Overloaded by child classes, which count the files they open and close */
+  virtual unsigned int getDescriptorUsage(){ return 0; };
+
+
   /// Return an individual tile for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
       @param h horizontal angle
@@ -340,6 +378,15 @@ class IIPImage {
   virtual RawTilePtr getTile( int h, int v, unsigned int r, int l, unsigned int t ) { return RawTilePtr(); };
 
 
+  /// Return a tile exactly as it is compressed in the file, where it can be sent without decoding
+  /** Overloaded by child classes whose files may hold tiles already compressed
+      as requested and at our tile size. Parameters as for getTile()
+      @param c compression type wanted
+      @return the compressed tile, or an empty pointer if the tile must be decoded
+   */
+  virtual RawTilePtr getCompressedTile( int h, int v, unsigned int r, int l, unsigned int t, CompressionType c ) { return RawTilePtr(); };
+
+
   /// Return a region for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
       @param ha horizontal angle
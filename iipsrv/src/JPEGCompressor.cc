@@ -362,7 +362,7 @@ int JPEGCompressor::Compress( RawTilePtr rawtile ) throw (string)
   dest->strip_height = 0;
 
   // Allocate memory for our destination
-  dest->source = new unsigned char[width*height*channels + MX]; // Add some extra buffering
+  dest->source = (unsigned char*) RawTile::allocate( width*height*channels + MX, 8, FIXEDPOINT, ALLOC_JPEG ); // Add some extra buffering
 
   // Set floating point quality (highest, but possibly slower depending
   //  on hardware)
@@ -415,16 +415,19 @@ int JPEGCompressor::Compress( RawTilePtr rawtile ) throw (string)
 
   // Check that we have enough memory in our tile for the JPEG data.
   // This can happen on small tiles with high quality factors. If so
-  // delete and reallocate memory.
+  // hand our output buffer over to the tile. Tiles viewing another
+  // tile's data always take our buffer too.
   y = dest->size;
-  if( y > rawtile->width*rawtile->height*rawtile->channels ){
-    delete[] (unsigned char*) rawtile->data;
-    rawtile->data = new unsigned char[y];
+  if( rawtile->isShared() || y > rawtile->width*rawtile->height*rawtile->channels ){
+    rawtile->freeData();
+    rawtile->data = dest->source;
+    Allocations::transfer( ALLOC_JPEG, rawtile->category, dest->source );
+  }
+  else{
+    // Copy memory back to the tile
+    memcpy( rawtile->data, dest->source, y );
+    RawTile::deallocate( dest->source, 8, FIXEDPOINT, ALLOC_JPEG );
   }
-
-  // Copy memory back to the tile
-  memcpy( rawtile->data, dest->source, y );
-  delete[] dest->source;
   jpeg_destroy_compress( &cinfo );
 
 
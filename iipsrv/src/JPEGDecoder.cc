@@ -0,0 +1,123 @@
+// JPEG Decoder
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "JPEGDecoder.h"
+
+#include <cstdio>
+
+extern "C"{
+/* Undefine this to prevent compiler warning
+ */
+#undef HAVE_STDLIB_H
+#include <jpeglib.h>
+}
+
+
+using namespace std;
+
+
+
+/* Pass libjpeg errors back to the caller as an exception rather than exiting.
+   The caller destroys the decompression object
+*/
+METHODDEF(void) iip_decoder_error_exit( j_common_ptr cinfo )
+{
+  char buffer[ JMSG_LENGTH_MAX ];
+  (*cinfo->err->format_message) ( cinfo, buffer );
+  throw string( "JPEGDecoder: " ) + buffer;
+}
+
+
+/* Source manager reading from memory: the whole stream is supplied at once
+*/
+METHODDEF(void) iip_init_source( j_decompress_ptr cinfo ){}
+
+METHODDEF(boolean) iip_fill_input_buffer( j_decompress_ptr cinfo )
+{
+  // Truncated stream: supply an end of image marker, as libjpeg's own sources do
+  static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+METHODDEF(void) iip_skip_input_data( j_decompress_ptr cinfo, long n )
+{
+  if( n <= 0 ) return;
+  if( (size_t) n > cinfo->src->bytes_in_buffer ) n = (long) cinfo->src->bytes_in_buffer;
+  cinfo->src->next_input_byte += n;
+  cinfo->src->bytes_in_buffer -= n;
+}
+
+METHODDEF(void) iip_term_source( j_decompress_ptr cinfo ){}
+
+
+
+void JPEGDecoder::decode( const uint8_t* data, size_t length, unsigned int scale, unsigned int channels,
+			  vector<uint8_t>& out, unsigned int& width, unsigned int& height ) throw (string)
+{
+  if( channels != 1 && channels != 3 ){
+    throw string( "JPEGDecoder: JPEG can only be decoded to either 1 or 3 channels" );
+  }
+
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  struct jpeg_source_mgr src;
+
+  cinfo.err = jpeg_std_error( &jerr );
+  jerr.error_exit = iip_decoder_error_exit;
+  jpeg_create_decompress( &cinfo );
+
+  src.init_source = iip_init_source;
+  src.fill_input_buffer = iip_fill_input_buffer;
+  src.skip_input_data = iip_skip_input_data;
+  src.resync_to_restart = jpeg_resync_to_restart;
+  src.term_source = iip_term_source;
+  src.next_input_byte = (const JOCTET*) data;
+  src.bytes_in_buffer = length;
+  cinfo.src = &src;
+
+  try{
+    jpeg_read_header( &cinfo, TRUE );
+
+    cinfo.out_color_space = ( channels == 1 ) ? JCS_GRAYSCALE : JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    jpeg_start_decompress( &cinfo );
+
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    size_t stride = (size_t) width * channels;
+    out.resize( stride * height );
+
+    while( cinfo.output_scanline < cinfo.output_height ){
+      JSAMPROW row = &out[ cinfo.output_scanline * stride ];
+      jpeg_read_scanlines( &cinfo, &row, 1 );
+    }
+
+    jpeg_finish_decompress( &cinfo );
+  }
+  catch( const string& error ){
+    jpeg_destroy_decompress( &cinfo );
+    throw;
+  }
+
+  jpeg_destroy_decompress( &cinfo );
+}
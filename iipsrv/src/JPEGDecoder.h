@@ -0,0 +1,58 @@
+// JPEG Decoder
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _JPEGDECODER_H
+#define _JPEGDECODER_H
+
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <inttypes.h>
+
+
+
+/// Wrapper to decode JPEG images in memory with the IJG JPEG library
+/** Images may be decoded reduced by 2, 4 or 8 in each direction. The library
+    then computes a smaller inverse DCT of each 8x8 block, which costs a
+    fraction of decoding at full size and box filtering the result. At 1/8,
+    each pixel is its block's DC coefficient, which is the block's mean.
+    At 1/2 and 1/4 the result is close to a box filter but not identical.
+ */
+class JPEGDecoder {
+
+ public:
+
+  /// Decode a JPEG image
+  /** @param data JPEG stream
+      @param length length of the stream in bytes
+      @param scale reduction in each direction: 1, 2, 4 or 8
+      @param channels samples per output pixel: 1 for greyscale or 3 for RGB
+      @param out decoded pixels, resized to hold them
+      @param width decoded width, rounded up when the image is not a multiple of scale
+      @param height decoded height, rounded up likewise
+   */
+  static void decode( const uint8_t* data, size_t length, unsigned int scale, unsigned int channels,
+		      std::vector<uint8_t>& out, unsigned int& width, unsigned int& height ) throw (std::string);
+
+};
+
+
+#endif
@@ -0,0 +1,194 @@
+/*
+    IIP JPEG Scaled Decoding Benchmark
+
+    Compares the two ways of building a virtual level from JPEG compressed
+    tiles: decoding each tile at full size and halfsampling the result, as
+    is done for other sources, against decoding it already reduced by 2, 4
+    or 8 in the DCT domain. Reports the throughput of each in tiles and
+    megapixels of source per second, and how far the reduced decode is from
+    the box filtered one.
+
+    Build with "make jpegbench" and run as:
+
+      jpegbench [tile size] [tiles] [JPEG quality]
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+
+extern "C"{
+#undef HAVE_STDLIB_H
+#include <jpeglib.h>
+}
+
+#include "JPEGDecoder.h"
+#include "PixelKernels.h"
+#include "Timer.h"
+
+
+using namespace std;
+
+
+// Channels of the test tiles
+#define CHANNELS 3
+
+
+
+/// Fill a tile with smooth structure plus a little noise, roughly like a stained slide
+static void fill( vector<uint8_t>& tile, size_t size, unsigned int seed ){
+  unsigned long long s = 88172645463325252ULL + seed;
+  for( size_t y = 0; y < size; y++ ){
+    for( size_t x = 0; x < size; x++ ){
+      for( int c = 0; c < CHANNELS; c++ ){
+	s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+	double v = 160 + 60 * sin( (x + seed * 37) * 0.031 + c ) * cos( (y + seed * 11) * 0.017 ) + (int)( s % 17 ) - 8;
+	tile[ ( y * size + x ) * CHANNELS + c ] = (uint8_t) ( v < 0 ? 0 : ( v > 255 ? 255 : v ) );
+      }
+    }
+  }
+}
+
+
+/// Compress a tile to JPEG in memory
+static vector<uint8_t> compress( const vector<uint8_t>& tile, size_t size, int quality ){
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  unsigned char* buffer = NULL;
+  unsigned long length = 0;
+
+  cinfo.err = jpeg_std_error( &jerr );
+  jpeg_create_compress( &cinfo );
+  jpeg_mem_dest( &cinfo, &buffer, &length );
+  cinfo.image_width = size;
+  cinfo.image_height = size;
+  cinfo.input_components = CHANNELS;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults( &cinfo );
+  jpeg_set_quality( &cinfo, quality, TRUE );
+  jpeg_start_compress( &cinfo, TRUE );
+  while( cinfo.next_scanline < cinfo.image_height ){
+    JSAMPROW row = (JSAMPROW) &tile[ cinfo.next_scanline * size * CHANNELS ];
+    jpeg_write_scanlines( &cinfo, &row, 1 );
+  }
+  jpeg_finish_compress( &cinfo );
+  jpeg_destroy_compress( &cinfo );
+
+  vector<uint8_t> jpeg( buffer, buffer + length );
+  free( buffer );
+  return jpeg;
+}
+
+
+/// Halfsample an image in place until it is reduced by a scale, returning its new width
+static size_t reduce( vector<uint8_t>& image, size_t w, size_t h, unsigned int scale ){
+  vector<uint8_t> half;
+  for( ; scale > 1; scale /= 2 ){
+    half.resize( (w/2) * (h/2) * CHANNELS );
+    for( size_t y = 0; y + 1 < h; y += 2 ){
+      PixelKernels::halfsample( &image[ y * w * CHANNELS ], &image[ (y+1) * w * CHANNELS ],
+				&half[ (y/2) * (w/2) * CHANNELS ], w / 2, CHANNELS );
+    }
+    image.swap( half );
+    w /= 2;
+    h /= 2;
+  }
+  return w;
+}
+
+
+/// Decode every tile reduced by a scale, either in the DCT domain or at full size and then halfsampled
+/** @return the time taken in seconds; the last tile's output is left in out */
+static double run( const vector< vector<uint8_t> >& jpegs, unsigned int scale, bool dct, vector<uint8_t>& out ){
+  unsigned int w, h;
+  Timer timer;
+  timer.start();
+  for( size_t t = 0; t < jpegs.size(); t++ ){
+    if( dct ) JPEGDecoder::decode( &jpegs[t][0], jpegs[t].size(), scale, CHANNELS, out, w, h );
+    else{
+      JPEGDecoder::decode( &jpegs[t][0], jpegs[t].size(), 1, CHANNELS, out, w, h );
+      reduce( out, w, h, scale );
+    }
+  }
+  return timer.getTime() / 1000000.0;
+}
+
+
+/// Return the peak signal to noise ratio in dB between two images, or infinity if they are the same
+static double psnr( const vector<uint8_t>& a, const vector<uint8_t>& b, int& maximum ){
+  double sum = 0;
+  maximum = 0;
+  for( size_t i = 0; i < a.size(); i++ ){
+    int d = abs( (int) a[i] - (int) b[i] );
+    if( d > maximum ) maximum = d;
+    sum += d * d;
+  }
+  if( sum == 0 ) return INFINITY;
+  return 10 * log10( 255.0 * 255.0 * a.size() / sum );
+}
+
+
+
+int main( int argc, char *argv[] )
+{
+  size_t size = (argc > 1) ? atol( argv[1] ) : 256;
+  unsigned int tiles = (argc > 2) ? atoi( argv[2] ) : 200;
+  int quality = (argc > 3) ? atoi( argv[3] ) : 75;
+
+  // Tiles must be whole 8x8 blocks, as TIFF requires of JPEG tiles
+  size = ( size < 8 ) ? 8 : size - ( size % 8 );
+  if( tiles < 1 ) tiles = 1;
+  if( quality < 1 || quality > 100 ) quality = 75;
+
+  // A handful of distinct tiles, decoded in turn
+  vector< vector<uint8_t> > jpegs;
+  vector<uint8_t> tile( size * size * CHANNELS );
+  size_t bytes = 0;
+  for( unsigned int t = 0; t < tiles; t++ ){
+    if( t < 8 ){
+      fill( tile, size, t );
+      jpegs.push_back( compress( tile, size, quality ) );
+    }
+    else jpegs.push_back( jpegs[ t % 8 ] );
+    bytes += jpegs.back().size();
+  }
+
+  printf( "JPEG scaled decoding benchmark: %u %lux%lu tiles, quality %d, %.1f KB per tile, %s pixel kernels\n\n",
+	  tiles, (unsigned long) size, (unsigned long) size, quality, bytes / ( 1024.0 * tiles ),
+	  PixelKernels::name( PixelKernels::level() ) );
+  printf( "%6s %22s %22s %8s %10s %8s\n", "scale", "full+halfsample MP/s", "DCT scaled MP/s", "speedup", "PSNR dB", "max diff" );
+
+  double megapixels = (double) size * size * tiles / 1000000.0;
+  vector<uint8_t> boxed, scaled;
+
+  for( unsigned int scale = 2; scale <= 8; scale *= 2 ){
+    double full = run( jpegs, scale, false, boxed );
+    double dct = run( jpegs, scale, true, scaled );
+
+    int maximum;
+    double p = psnr( boxed, scaled, maximum );
+
+    printf( "%6s %15.1f %6.0f/s %15.1f %6.0f/s %7.1fx %10.1f %8d\n", ( "1/" + to_string( scale ) ).c_str(),
+	    megapixels / full, tiles / full, megapixels / dct, tiles / dct, full / dct, p, maximum );
+  }
+
+  return 0;
+}
@@ -71,13 +71,21 @@ void JTL::send( Session* session, int resolution, int tile ){
       || session->view->getContrast() != 1.0 || session->view->getGamma() != 1.0 
       || session->view->getRotation() != 0.0 || session->view->shaded
       || session->view->cmapped || session->view->inverted
-      || session->view->ctw.size() ) ct = UNCOMPRESSED;
+      || session->view->ctw.size() || session->view->flip != 0
+      || ( (session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ) ) ct = UNCOMPRESSED;
   else ct = JPEG;
 
 
   RawTilePtr rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
+  // Let the prefetcher queue the tiles likely to follow this one
+  if( session->prefetcher ){
+    session->prefetcher->observe( session->image, session->headers["REMOTE_ADDR"], resolution, tile,
+				  session->view->xangle, session->view->yangle, session->view->getLayers(),
+				  ct, (ct == JPEG) ? session->jpeg->getQuality() : 0 );
+  }
+
 
   int len = rawtile->dataLength;
 
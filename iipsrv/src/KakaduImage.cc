@@ -59,7 +59,7 @@ using namespace std;
 
 
 #ifdef DEBUG
-extern std::ofstream logfile;
+extern thread_local std::ofstream logfile;
 #endif
 
 
@@ -332,11 +332,10 @@ RawTilePtr KakaduImage::getTile( int seq, int ang, unsigned int res, int layers,
 
 
   // Create our raw tile buffer and initialize some values
-  if( obpc == 16 ) rawtile->data = new unsigned short[tw*th*channels];
-  else if( obpc == 8 ) rawtile->data = new unsigned char[tw*th*channels];
-  else throw file_error( "Kakadu :: Unsupported number of bits" );
+  if( obpc != 16 && obpc != 8 ) throw file_error( "Kakadu :: Unsupported number of bits" );
 
   rawtile->dataLength = tw*th*channels*obpc/8;
+  rawtile->data = rawtile->allocate( rawtile->dataLength );
   rawtile->filename = getImagePath();
   rawtile->timestamp = timestamp;
 
@@ -369,11 +368,10 @@ RawTilePtr KakaduImage::getRegion( int seq, int ang, unsigned int res, int layer
 
   RawTilePtr rawtile( 0, res, seq, ang, w, h, channels, obpc );
 
-  if( obpc == 16 ) rawtile->data = new unsigned short[w*h*channels];
-  else if( obpc == 8 ) rawtile->data = new unsigned char[w*h*channels];
-  else throw file_error( "Kakadu :: Unsupported number of bits" );
+  if( obpc != 16 && obpc != 8 ) throw file_error( "Kakadu :: Unsupported number of bits" );
 
   rawtile->dataLength = w*h*channels*obpc/8;
+  rawtile->data = rawtile->allocate( rawtile->dataLength );
   rawtile->filename = getImagePath();
   rawtile->timestamp = timestamp;
 
@@ -500,13 +498,9 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 #endif
 
     // Create our buffers
-    if( obpc == 16 ){
-      stripe_buffer = new kdu_uint16[tw*stripe_heights[0]*channels];
-      buffer = new unsigned short[tw*th*channels];
-    }
-    else if( obpc == 8 ){
-      stripe_buffer = new kdu_byte[tw*stripe_heights[0]*channels];
-      buffer = new unsigned char[tw*th*channels];
+    if( obpc == 16 || obpc == 8 ){
+      stripe_buffer = RawTile::allocate( tw*stripe_heights[0]*channels*obpc/8, obpc, FIXEDPOINT );
+      buffer = RawTile::allocate( tw*th*channels*obpc/8, obpc, FIXEDPOINT );
     }
 
 
@@ -635,8 +629,8 @@ void KakaduImage::process( unsigned int res, int layers, int xoffset, int yoffse
 // Delete our buffers
 void KakaduImage::delete_buffer( void* buffer ){
   if( buffer ){
-    if( bpc <= 16 && bpc > 8 ) delete[] (kdu_uint16*) buffer;
-    else if( bpc<=8 ) delete[] (kdu_byte*) buffer;
+    if( bpc <= 16 && bpc > 8 ) RawTile::deallocate( buffer, 16, FIXEDPOINT );
+    else if( bpc<=8 ) RawTile::deallocate( buffer, 8, FIXEDPOINT );
   }
 
 
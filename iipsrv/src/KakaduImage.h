@@ -46,7 +46,7 @@
 using namespace kdu_supp; // Also includes the `kdu_core' namespace
 #endif
 
-extern std::ofstream logfile;
+extern thread_local std::ofstream logfile;
 
 
 /// Wrapper class to handle error messages from Kakadu
@@ -177,6 +177,9 @@ class KakaduImage : public IIPImage {
   /// Overloaded function for closing a JPEG2000 image
   void closeImage();
 
+  /// An open JPEG2000 file holds a single descriptor
+  unsigned int getDescriptorUsage(){ return src.exists() ? 1 : 0; };
+
   /// Return whether this image type directly handles region decoding
   bool regionDecoding(){ return true; };
 
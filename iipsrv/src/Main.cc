@@ -32,6 +32,14 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <sys/resource.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -40,6 +48,10 @@
 #include "View.h"
 #include "Timer.h"
 #include "TileManager.h"
+#include "SharedTileCache.h"
+#include "TilePool.h"
+#include "BioFormatsPool.h"
+#include "PixelKernels.h"
 #include "Task.h"
 #include "Environment.h"
 #include "Writer.h"
@@ -86,16 +98,106 @@ using namespace std;
 
 
 /* We need to define some variables globally so that the signal handler
-   can have access to them
+   can have access to them. Each worker thread writes to its own append-mode
+   stream on the log file so that output from different threads does not
+   corrupt a shared stream buffer
 */
 int loglevel;
-ofstream logfile;
-unsigned long IIPcount;
+thread_local ofstream logfile;
+atomic<unsigned long> IIPcount;
 char *tz = NULL;
 
 
 
-/* Handle a signal - print out some stats and exit
+/* Server settings and the objects shared between all of our worker threads
+ */
+struct ServerContext {
+  string version;
+  string logfile_path;
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+  string cors;
+  string base_url;
+  Watermark* watermark;
+  imageCacheMapType* imageCache;
+  TileCache* tileCache;
+  Prefetcher* prefetcher;
+  bool tile_cache_cold;
+  bool tile_cache_disk;
+  bool tile_pool;
+#ifdef DEBUG
+  const char* query;
+#else
+  int listen_socket;
+#ifdef HAVE_MEMCACHED
+  string memcached_servers;
+  unsigned int memcached_timeout;
+#endif
+#endif
+};
+
+
+/* Some platforms do not allow several threads to sit in accept() on the same socket
+ */
+static mutex accept_mutex;
+
+
+
+/* Report how our caches, prefetcher and pools performed
+ */
+void IIPStatistics( const ServerContext& server )
+{
+  if( loglevel < 1 ) return;
+
+  // How each tier of the tile cache performed
+  TileCache::TierStatistics stats = server.tileCache->getTierStatistics();
+  if( stats.lookups > 0 ){
+    logfile << "Tile cache lookups: " << stats.lookups
+	    << ", memory hits: " << 100.0 * stats.hotHits / stats.lookups << "%";
+    if( server.tile_cache_cold ){
+      logfile << ", compressed hits: " << 100.0 * stats.coldHits / stats.lookups << "% ("
+	      << ( stats.coldHits ? stats.coldTime / stats.coldHits : 0 ) << " microseconds to decompress)";
+    }
+    if( server.tile_cache_disk ){
+      logfile << ", disk hits: " << 100.0 * stats.diskHits / stats.lookups << "% ("
+	      << ( stats.diskHits ? stats.diskTime / stats.diskHits : 0 ) << " microseconds to read)";
+    }
+    logfile << endl;
+  }
+
+  // How well prefetching predicted requests and how much of its work went unused
+  if( server.prefetcher ){
+    Prefetcher::Statistics prefetched = server.prefetcher->statistics();
+    logfile << "Prefetch: " << prefetched.queued << " tiles queued, " << prefetched.dropped << " dropped, "
+	    << prefetched.cached << " already cached, " << prefetched.built << " built ("
+	    << ( prefetched.built ? prefetched.buildTime / prefetched.built : 0 ) << " microseconds each), "
+	    << prefetched.failed << " failed; " << prefetched.useful << " later requested, "
+	    << prefetched.wasted << " never requested; " << prefetched.warming << " queued to warm images" << endl;
+  }
+
+  if( BioFormatsPool::enabled() ){
+    BioFormatsPool::Statistics bioformats = BioFormatsPool::statistics();
+    if( bioformats.jobs > 0 ){
+      logfile << "BioFormats pool: " << bioformats.jobs << " reads, " << bioformats.opened << " readers opened, "
+	      << bioformats.closed << " closed to make room, " << bioformats.waited << " reads waited for the queue" << endl;
+    }
+  }
+
+  // How much tile buffer allocation the pool absorbed and what is still allocated
+  if( server.tile_pool ){
+    TilePool::Statistics pool = TilePool::statistics();
+    logfile << "Tile buffer pool: " << pool.allocations << " buffers allocated, "
+	    << pool.fallbacks << " from the heap, "
+	    << pool.reserved / (1024*1024) << "MB reserved" << endl;
+  }
+  logfile << "Memory: tile cache " << server.tileCache->getMemorySize() << "MB, image cache "
+	  << server.imageCache->getMemorySize() << "MB; live " << Allocations::summary() << endl;
+}
+
+
+
+/* Handle a signal - print out some stats, close the log and exit
  */
 void IIPSignalHandler( int signal )
 {
@@ -123,391 +225,253 @@ void IIPSignalHandler( int signal )
     logfile.close();
   }
 
+#ifndef WIN32
+  // Worker threads are still running, so leave without the static destructors
+  // tearing down caches and pools they may be using
+  _exit( 1 );
+#else
   exit( 1 );
+#endif
 }
 
 
 
-
-
-int main( int argc, char *argv[] )
+#ifndef WIN32
+/* Wait for one of our termination signals. These are blocked in every other
+   thread, so we take them here, outside of any signal handler, where we can
+   safely take the locks needed to report our statistics before exiting
+ */
+void IIPSignalWaiter( const ServerContext& server, sigset_t signals )
 {
+  int signal;
+  while( sigwait( &signals, &signal ) != 0 );
 
-  IIPcount = 0;
-  int i;
-
+  if( loglevel >= 1 ) logfile.open( server.logfile_path.c_str(), ios::app );
+  IIPStatistics( server );
+  IIPSignalHandler( signal );
+}
+#endif
 
-  // Define ourselves a version
-  string version = string( VERSION );
 
 
 
-  /*************************************************
-    Initialise some variables from our environment
-  *************************************************/
 
+/* Open the images listed in a manifest, one path per line as given to FIF, so
+   that they are cached and warming before the first request for them. Blank
+   lines and lines starting with # are ignored
+ */
+static void preloadImages( const ServerContext& server, const string& manifest )
+{
+  ifstream list( manifest.c_str() );
+  if( !list ){
+    if( loglevel >= 1 ) logfile << "Unable to open preload manifest '" << manifest << "'" << endl;
+    return;
+  }
 
-  //  Check for a verbosity env variable and open an appendable logfile
-  //  if we want logging ie loglevel >= 0
+  // FIF only needs enough of a session to open and cache the image
+  JPEGCompressor jpeg( server.jpeg_quality );
+  View view;
+  if( server.max_layers != 0 ) view.setMaxLayers( server.max_layers );
+  IIPResponse response;
+
+  Session session;
+  session.response = &response;
+  session.view = &view;
+  session.jpeg = &jpeg;
+  session.loglevel = loglevel;
+  session.logfile = &logfile;
+  session.imageCache = server.imageCache;
+  session.tileCache = server.tileCache;
+  session.prefetcher = server.prefetcher;
+  session.out = NULL;
+  session.watermark = server.watermark;
+
+  unsigned int opened = 0, failed = 0;
+  string path;
+
+  while( getline( list, path ) ){
+
+    size_t start = path.find_first_not_of( " \t\r" );
+    if( start == string::npos || path[start] == '#' ) continue;
+    path = path.substr( start, path.find_last_not_of( " \t\r" ) - start + 1 );
 
-  loglevel = Environment::getVerbosity();
+    try{
+      FIF fif;
+      fif.run( &session, path );
+      opened++;
+    }
+    catch( const file_error& error ){
+      if( loglevel >= 1 ) logfile << "Unable to preload '" << path << "': " << error.what() << endl;
+      failed++;
+    }
+    catch( const string& error ){
+      if( loglevel >= 1 ) logfile << "Unable to preload '" << path << "': " << error << endl;
+      failed++;
+    }
+  }
 
   if( loglevel >= 1 ){
+    logfile << "Preloaded " << opened << " images from '" << manifest << "'";
+    if( failed ) logfile << ", " << failed << " could not be opened";
+    logfile << endl;
+  }
+}
 
-    // Check for the requested log file path
-    string lf = Environment::getLogFile();
 
-    logfile.open( lf.c_str(), ios::app );
-    // If we cannot open this, set the loglevel to 0
-    if( !logfile ){
-      loglevel = 0;
-    }
 
-    // Put a header marker and credit in the file
-    else{
 
-      // Get current time
-      time_t current_time = time( NULL );
-      char *date = ctime( &current_time );
 
-      logfile << "<----------------------------------->" << endl
-	      << date << endl
-	      << "IIPImage Server. Version " << version << endl
-	      << "*** Ruven Pillay <ruven@users.sourceforge.net> ***" << endl << endl
-	      << "Verbosity level set to " << loglevel << endl;
-    }
+/* Worker thread - accept and process requests until our FCGI socket is closed.
+   Each thread has its own FCGI request, log stream and per-request objects,
+   while the image and tile caches are shared by all threads
+ */
+void IIPWorker( const ServerContext& server, unsigned int id )
+{
+  int i;
 
+  // The main thread has already opened its log stream
+  if( loglevel >= 1 && !logfile.is_open() ){
+    logfile.open( server.logfile_path.c_str(), ios::app );
   }
 
+  // Set up our request timer
+  Timer request_timer;
+  Task* task = NULL;
 
-  // Set our environment to UTC as all file modification times are GMT,
-  // but save our current state to allow us to reset before quitting
-  tz = getenv("TZ");
-  setenv("TZ","",1);
-  tzset();
-
-
-
-  // Set up some FCGI items and make sure we are in FCGI mode
 
 #ifndef DEBUG
 
   FCGX_Request request;
-  int listen_socket = 0;
-  bool standalone = false;
-
-  if( argv[1] && (string(argv[1]) == "--bind") ){
-    string socket = argv[2];
-    if( !socket.length() ){
-      logfile << "No socket specified" << endl << endl;
-      exit(1);
-    }
-    listen_socket = FCGX_OpenSocket( socket.c_str(), 10 );
-    if( listen_socket < 0 ){
-      logfile << "Unable to open socket '" << socket << "'" << endl << endl;
-      exit(1);
-    }
-    standalone = true;
-    logfile << "Running in standalone mode on socket: " << socket << endl << endl;
+  if( FCGX_InitRequest( &request, server.listen_socket, 0 ) ){
+    if( loglevel >= 1 ) logfile << "Worker thread " << id << ": unable to initialise FCGI request" << endl;
+    return;
   }
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+#ifdef HAVE_MEMCACHED
 
-  // Check whether we are really in FCGI mode - only if we are not in standalone mode
-  if( FCGX_IsCGI() ){
-    if( !standalone ){
-      if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
-      return( 1 );
+  // libmemcached handles cannot be shared between threads, so create one per thread
+  Memcache memcached( server.memcached_servers, server.memcached_timeout );
+  if( loglevel >= 1 && id == 0 ){
+    if( memcached.connected() ){
+      logfile << "Memcached support enabled. Connected to servers: '" << server.memcached_servers
+	      << "' with timeout " << server.memcached_timeout << endl;
     }
-  }
-  else{
-    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
+    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
   }
 
+#endif
 #endif
 
 
-  // Set our maximum image cache size
-	int max_image_cache_size = Environment::getMaxImageCacheSize();
-  float max_tile_cache_size = Environment::getMaxTileCacheSize();
-
+  /****************
+    Main FCGI loop
+  ****************/
 
-	imageCacheMapType imageCache(max_image_cache_size);
+#ifdef DEBUG
+    for (int ii = 0; ii < 1000; ++ii) {
 
+            server.tileCache->clear();
 
-  // Get our image pattern variable
-  string filename_pattern = Environment::getFileNamePattern();
+    FILE *f = fopen( "test.jpg", "w" );
+    FileWriter writer( f );
 
+#else
 
-  // Get our default quality variable
-  int jpeg_quality = Environment::getJPEGQuality();
+  while( true ){
 
+    {
+      lock_guard<mutex> guard( accept_mutex );
+      if( FCGX_Accept_r( &request ) < 0 ) break;
+    }
 
-  // Get our max CVT size
-  int max_CVT = Environment::getMaxCVT();
+    FCGIWriter writer( request.out );
 
+#endif
 
-  // Get the default number of quality layers to decode
-  int max_layers = Environment::getMaxLayers();
+    // Keep the prefetcher off while every worker is busy
+    if( server.prefetcher ) server.prefetcher->requestStarted();
 
 
-  // Get the filesystem prefix if any
-  string filesystem_prefix = Environment::getFileSystemPrefix();
+    // Time each request
+    if( loglevel >= 2 ) request_timer.start();
 
 
-  // Set up our watermark object
-  Watermark watermark( Environment::getWatermark(),
-		       Environment::getWatermarkOpacity(),
-		       Environment::getWatermarkProbability() );
+    // Declare our image pointer here outside of the try scope
+    //  so that we can close the image on exceptions
+      Session session;  // putting session object out here does the same thing.
+//			IIPImagePtr image;
+    JPEGCompressor jpeg( server.jpeg_quality );
 
 
-  // Get the CORS setting
-  string cors = Environment::getCORS();
+    // View object for use with the CVT command etc
+    View view;
+    if( server.max_CVT != -1 ) view.setMaxSize( server.max_CVT );
+    if( server.max_layers != 0 ) view.setMaxLayers( server.max_layers );
 
 
-  // Get any Base URL setting
-  string base_url = Environment::getBaseURL();
 
+    // Create an IIPResponse object - we use this for the OBJ requests.
+    // As the commands return images etc, they handle their own responses.
+    IIPResponse response;
+    response.setCORS( server.cors );
 
-  // Print out some information
-  if( loglevel >= 1 ){
-		logfile << "Setting maximum image cache size to " << max_image_cache_size << endl;
-    logfile << "Setting maximum tile cache size to " << max_tile_cache_size << "MB" << endl;
-    logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
-    logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
-    logfile << "Setting maximum CVT size to " << max_CVT << endl;
-    logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
-    if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
-    if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
-    if( max_layers != 0 ){
-      logfile << "Setting max quality layers (for supported file formats) to ";
-      if( max_layers < 0 ) logfile << "all layers" << endl;
-      else logfile << max_layers << endl;
-    }
-#ifdef HAVE_KAKADU
-    logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
+    try{
+      
+      // Get the query into a string
+#ifdef DEBUG
+      const string request_string = server.query;
+#else
+      const string request_string = FCGX_GetParam( "QUERY_STRING", request.envp );
 #endif
-  }
-
 
-  // Try to load our watermark
-  if( watermark.getImage().length() > 0 ){
-    watermark.init();
-    if( loglevel >= 1 ){
-      if( watermark.isSet() ){
-	logfile << "Loaded watermark image '" << watermark.getImage()
-		<< "': setting probability to " << watermark.getProbability()
-		<< " and opacity to " << watermark.getOpacity() << endl;
+      // Check that we actually have a request string
+      if( request_string.length() == 0 ) {
+	throw string( "QUERY_STRING not set" );
       }
-      else{
-	logfile << "Unable to load watermark image '" << watermark.getImage() << "'" << endl;
+
+      if( loglevel >=2 ){
+	logfile << "Full Request is " << request_string << endl;
       }
-    }
-  }
 
-#ifndef DEBUG
-#ifdef HAVE_MEMCACHED
+      
 
-  // Get our list of memcached servers if we have any and the timeout
-  string memcached_servers = Environment::getMemcachedServers();
-  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
+      // Set up our session data object
+				//session.image = image;
+      session.response = &response;
+      session.view = &view;
+      session.jpeg = &jpeg;
+      session.loglevel = loglevel;
+      session.logfile = &logfile;
+      session.imageCache = server.imageCache;
+      session.tileCache = server.tileCache;
+      session.prefetcher = server.prefetcher;
+      session.out = &writer;
+      session.watermark = server.watermark;
+      session.headers.empty();
 
-  // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
-  if( loglevel >= 1 ){
-    if( memcached.connected() ){
-      logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
-	      << "' with timeout " << memcached_timeout << endl;
-    }
-    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
-  }
+      // Get certain HTTP headers, such as if_modified_since and the query_string
+#ifndef DEBUG
 
+      char* header = NULL;
+      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
+	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
+	if( loglevel >= 2 ){
+	  logfile << "HTTP Header: If-Modified-Since: " << session.headers["HTTP_IF_MODIFIED_SINCE"] << endl;
+	}
+      }
 #endif
-#endif
-
-
-  // Add a new line
-  if( loglevel >= 1 ) logfile << endl;
+      session.headers["QUERY_STRING"] = request_string;
 
+#ifndef DEBUG
+      session.headers["SERVER_PROTOCOL"] =  FCGX_GetParam("SERVER_PROTOCOL", request.envp);
+      session.headers["HTTP_HOST"] = FCGX_GetParam("HTTP_HOST", request.envp);
+      session.headers["REQUEST_URI"] = FCGX_GetParam("REQUEST_URI", request.envp);
+      if( (header = FCGX_GetParam("REMOTE_ADDR", request.envp)) ) session.headers["REMOTE_ADDR"] = header;
+#endif
+      session.headers["BASE_URL"] = server.base_url;
 
-  /***********************************************************
-    Check for loadable modules - only if enabled by configure
-  ***********************************************************/
 
-#ifdef ENABLE_DL
-
-  map <string, string> moduleList;
-  string modulePath;
-  char* envpara = getenv( "DECODER_MODULES" );
-
-  if( envpara ){
-
-    modulePath = string( envpara );
-
-    // Try to open the module
-
-    Tokenizer izer( modulePath, "," );
-  
-    while( izer.hasMoreTokens() ){
-      
-      try{
-	string token = izer.nextToken();
-	DSOImage module;
-	module.Load( token );
-	string type = module.getImageType();
-	if( loglevel >= 1 ){
-	  logfile << "Loading external module: " << module.getDescription() << endl;
-	}
-	moduleList[ type ] = token;
-      }
-      catch( const string& error ){
-	if( loglevel >= 1 ) logfile << error << endl;
-      }
-
-    }
-    
-    // Tell us what's happened
-    if( loglevel >= 1 ) logfile << moduleList.size() << " external modules loaded" << endl;
-
-  }
-
-#endif
-
-
-
-  /***********************************************************
-    Set up a signal handler for USR1, TERM, HUP and INT signals
-    - to simplify things, they can all just shutdown the
-      server. We can rely on mod_fastcgi to restart us.
-    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
-  ***********************************************************/
-
-#ifndef WIN32
-  signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPSignalHandler );
-#endif
-
-  signal( SIGTERM, IIPSignalHandler );
-  signal( SIGINT, IIPSignalHandler );
-
-
-
-  if( loglevel >= 1 ){
-    logfile << endl << "Initialisation Complete." << endl
-	    << "<----------------------------------->"
-	    << endl << endl;
-  }
-
-
-  // Set up our request timers and seed our random number generator with the millisecond count from it
-  Timer request_timer;
-  srand( request_timer.getTime() );
-
-  // Create our tile cache
-	TileCache tileCache( max_tile_cache_size );
-  Task* task = NULL;
-
-
-
-  /****************
-    Main FCGI loop
-  ****************/
-
-#ifdef DEBUG
-    for (int ii = 0; ii < 1000; ++ii) {
-
-            tileCache.clear();
-
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-
-#else
-
-  while( FCGX_Accept_r( &request ) >= 0 ){
-
-    FCGIWriter writer( request.out );
-
-#endif
-
-
-    // Time each request
-    if( loglevel >= 2 ) request_timer.start();
-
-
-    // Declare our image pointer here outside of the try scope
-    //  so that we can close the image on exceptions
-      Session session;  // putting session object out here does the same thing.
-//			IIPImagePtr image;
-    JPEGCompressor jpeg( jpeg_quality );
-
-
-    // View object for use with the CVT command etc
-    View view;
-    if( max_CVT != -1 ) view.setMaxSize( max_CVT );
-    if( max_layers != 0 ) view.setMaxLayers( max_layers );
-
-
-
-    // Create an IIPResponse object - we use this for the OBJ requests.
-    // As the commands return images etc, they handle their own responses.
-    IIPResponse response;
-    response.setCORS( cors );
-
-    try{
-      
-      // Get the query into a string
-#ifdef DEBUG
-      const string request_string = argv[1];
-#else
-      const string request_string = FCGX_GetParam( "QUERY_STRING", request.envp );
-#endif
-
-      // Check that we actually have a request string
-      if( request_string.length() == 0 ) {
-	throw string( "QUERY_STRING not set" );
-      }
-
-      if( loglevel >=2 ){
-	logfile << "Full Request is " << request_string << endl;
-      }
-
-      
-
-      // Set up our session data object
-				//session.image = image;
-      session.response = &response;
-      session.view = &view;
-      session.jpeg = &jpeg;
-      session.loglevel = loglevel;
-      session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
-      session.out = &writer;
-      session.watermark = &watermark;
-      session.headers.empty();
-
-      // Get certain HTTP headers, such as if_modified_since and the query_string
-#ifndef DEBUG
-
-      char* header = NULL;
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << session.headers["HTTP_IF_MODIFIED_SINCE"] << endl;
-	}
-      }
-#endif
-      session.headers["QUERY_STRING"] = request_string;
-
-#ifndef DEBUG
-      session.headers["SERVER_PROTOCOL"] =  FCGX_GetParam("SERVER_PROTOCOL", request.envp);
-      session.headers["HTTP_HOST"] = FCGX_GetParam("HTTP_HOST", request.envp);
-      session.headers["REQUEST_URI"] = FCGX_GetParam("REQUEST_URI", request.envp);
-#endif
-      session.headers["BASE_URL"] = base_url;
-
-
-#ifndef DEBUG
+#ifndef DEBUG
 
 #ifdef HAVE_MEMCACHED
       // Check whether this exists in memcached, but only if we haven't had an if_modified_since
@@ -634,7 +598,7 @@ int main( int argc, char *argv[] )
       switch( code ){
 
         case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
+	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + server.version + "\r\n\r\n";
 	  writer.printf( status.c_str() );
 	  writer.flush();
           if( loglevel >= 2 ){
@@ -676,14 +640,14 @@ int main( int argc, char *argv[] )
       else{
 	/* Display our advertising banner ;-)
 	 */
-	writer.printf( response.getAdvert( version ).c_str() );
+	writer.printf( response.getAdvert( server.version ).c_str() );
       }
 
     }
 
     // Image file errors
     catch( const file_error& error ){
-      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
+      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + server.version + "\r\n\r\n" + error.what();
       writer.printf( status.c_str() );
       writer.flush();
       if( loglevel >= 2 ){
@@ -693,7 +657,7 @@ int main( int argc, char *argv[] )
 
     // Parameter errors
     catch( const invalid_argument& error ){
-      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
+      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + server.version + "\r\n\r\n" + error.what();
       writer.printf( status.c_str() );
       writer.flush();
       if( loglevel >= 2 ){
@@ -711,7 +675,7 @@ int main( int argc, char *argv[] )
 
       /* Display our advertising banner ;-)
        */
-      writer.printf( response.getAdvert( version ).c_str() );
+      writer.printf( response.getAdvert( server.version ).c_str() );
 
     }
 
@@ -727,6 +691,8 @@ int main( int argc, char *argv[] )
 			//image = NULL;
     IIPcount ++;
 
+    if( server.prefetcher ) server.prefetcher->requestFinished();
+
 #ifdef DEBUG
     fclose( f );
 #endif
@@ -740,16 +706,514 @@ int main( int argc, char *argv[] )
 
 
     if( loglevel >= 2 ){
-				logfile << "image cache size is " << imageCache.getNumElements() << endl
+				logfile << "image cache size is " << server.imageCache->getNumElements() << endl
 	      << "Server count is " << IIPcount << endl << endl;
       
     }
 
+    // Live memory by use, to help size the server's memory limits
+    if( loglevel >= 3 ){
+      logfile << "Memory: tile cache " << server.tileCache->getMemorySize() << "MB, image cache "
+	      << server.imageCache->getMemorySize() << "MB; live " << Allocations::summary() << endl;
+    }
+
 
 
     ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
   }
 
+#ifndef DEBUG
+  FCGX_Finish_r( &request );
+#endif
+
+}
+
+
+
+int main( int argc, char *argv[] )
+{
+
+  IIPcount = 0;
+
+
+  // Define ourselves a version
+  string version = string( VERSION );
+
+
+
+  /*************************************************
+    Initialise some variables from our environment
+  *************************************************/
+
+
+  //  Check for a verbosity env variable and open an appendable logfile
+  //  if we want logging ie loglevel >= 0
+
+  loglevel = Environment::getVerbosity();
+
+  if( loglevel >= 1 ){
+
+    // Check for the requested log file path
+    string lf = Environment::getLogFile();
+
+    logfile.open( lf.c_str(), ios::app );
+    // If we cannot open this, set the loglevel to 0
+    if( !logfile ){
+      loglevel = 0;
+    }
+
+    // Put a header marker and credit in the file
+    else{
+
+      // Get current time
+      time_t current_time = time( NULL );
+      char *date = ctime( &current_time );
+
+      logfile << "<----------------------------------->" << endl
+	      << date << endl
+	      << "IIPImage Server. Version " << version << endl
+	      << "*** Ruven Pillay <ruven@users.sourceforge.net> ***" << endl << endl
+	      << "Verbosity level set to " << loglevel << endl;
+    }
+
+  }
+
+
+  // Set our environment to UTC as all file modification times are GMT,
+  // but save our current state to allow us to reset before quitting
+  tz = getenv("TZ");
+  setenv("TZ","",1);
+  tzset();
+
+
+
+  // Set up some FCGI items and make sure we are in FCGI mode
+
+#ifndef DEBUG
+
+  int listen_socket = 0;
+  bool standalone = false;
+
+  if( argv[1] && (string(argv[1]) == "--bind") ){
+    string socket = argv[2];
+    if( !socket.length() ){
+      logfile << "No socket specified" << endl << endl;
+      exit(1);
+    }
+    listen_socket = FCGX_OpenSocket( socket.c_str(), 10 );
+    if( listen_socket < 0 ){
+      logfile << "Unable to open socket '" << socket << "'" << endl << endl;
+      exit(1);
+    }
+    standalone = true;
+    logfile << "Running in standalone mode on socket: " << socket << endl << endl;
+  }
+
+  // Initialise the FCGI library before starting any threads
+  if( FCGX_Init() ) return(1);
+
+  // Check whether we are really in FCGI mode - only if we are not in standalone mode
+  if( FCGX_IsCGI() ){
+    if( !standalone ){
+      if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
+      return( 1 );
+    }
+  }
+  else{
+    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
+  }
+
+#endif
+
+
+  // Set our maximum image cache size
+	int max_image_cache_size = Environment::getMaxImageCacheSize();
+  float max_tile_cache_size = Environment::getMaxTileCacheSize();
+
+  // Limit the memory and file descriptors held by open images. By default leave
+  // half of our descriptors for sockets, the on-disk tile cache etc.
+  float max_image_cache_memory = Environment::getMaxImageCacheMemory();
+  unsigned int max_image_cache_files = Environment::getMaxImageCacheFiles();
+  if( max_image_cache_files == 0 ){
+    struct rlimit limit;
+    if( getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur != RLIM_INFINITY ){
+      max_image_cache_files = limit.rlim_cur / 2;
+    }
+  }
+
+	imageCacheMapType imageCache( max_image_cache_size, max_image_cache_memory, max_image_cache_files );
+
+
+  // Get our image pattern variable
+  string filename_pattern = Environment::getFileNamePattern();
+
+
+  // Get our default quality variable
+  int jpeg_quality = Environment::getJPEGQuality();
+
+  // Whether JPEG tiles stored in image files are sent without compressing them again
+  TileManager::passthrough = Environment::getJPEGPassthrough();
+  TileManager::passthroughQuality = jpeg_quality;
+
+
+  // Get our max CVT size
+  int max_CVT = Environment::getMaxCVT();
+
+
+  // Get the default number of quality layers to decode
+  int max_layers = Environment::getMaxLayers();
+
+
+  // Get the filesystem prefix if any
+  string filesystem_prefix = Environment::getFileSystemPrefix();
+
+
+  // Set up our watermark object
+  Watermark watermark( Environment::getWatermark(),
+		       Environment::getWatermarkOpacity(),
+		       Environment::getWatermarkProbability() );
+
+
+  // Get the CORS setting
+  string cors = Environment::getCORS();
+
+
+  // Get any Base URL setting
+  string base_url = Environment::getBaseURL();
+
+
+  // Get the number of threads serving requests - only one in debug mode
+#ifdef DEBUG
+  unsigned int worker_threads = 1;
+#else
+  unsigned int worker_threads = Environment::getWorkerThreads();
+#endif
+
+
+  // Get the number of threads prefetching likely next tiles and how many to predict
+  unsigned int prefetch_threads = Environment::getPrefetchThreads();
+  unsigned int prefetch_depth = Environment::getPrefetchDepth();
+  unsigned int prefetch_queue = Environment::getPrefetchQueue();
+
+  // Read BioFormats images from a pool of threads attached to the JVM, each with readers of its own
+  BioFormatsPool::configure( Environment::getBioFormatsThreads(), Environment::getBioFormatsQueue(),
+			     Environment::getBioFormatsReaders() );
+
+  // Get the number of resolutions to warm when an image is opened and any images to open at startup
+  unsigned int warm_levels = Environment::getWarmLevels();
+  string preload_manifest = Environment::getPreloadManifest();
+
+
+  // Get the number of tile cache shards. By default use several per thread
+  // but keep at least MIN_SHARD_SIZE MB in each shard
+  unsigned int tile_cache_shards = Environment::getTileCacheShards();
+  if( tile_cache_shards == 0 ) tile_cache_shards = (worker_threads > 1) ? 4 * worker_threads : 1;
+  if( tile_cache_shards > max_tile_cache_size / MIN_SHARD_SIZE ){
+    tile_cache_shards = (unsigned int) ( max_tile_cache_size / MIN_SHARD_SIZE );
+    if( tile_cache_shards < 1 ) tile_cache_shards = 1;
+  }
+
+
+  // Get the tile cache admission policy: plain LRU or TinyLFU
+  string tile_cache_admission = Environment::getTileCacheAdmission();
+  bool tinylfu = ( tile_cache_admission == "tinylfu" );
+
+  // Get the tile cache eviction policy: LRU or GreedyDual-Size and any per-image quota
+  string tile_cache_eviction = Environment::getTileCacheEviction();
+  bool gds = ( tile_cache_eviction == "gds" );
+  float tile_cache_image_quota = Environment::getTileCacheImageQuota();
+
+  // Get the size of the compressed cold tier of the tile cache
+  float tile_cache_cold = max_tile_cache_size * Environment::getTileCacheCold() / 100.0;
+  if( MemoryTileCache::coldTierSize( tile_cache_cold ) == 0 ) tile_cache_cold = 0;
+
+  // Get the name of any shared memory tile cache
+  string tile_cache_shm = Environment::getTileCacheSHM();
+
+  // Get any persistent on-disk second level tile cache
+  string tile_cache_disk = Environment::getTileCacheDisk();
+  float tile_cache_disk_size = Environment::getTileCacheDiskSize();
+
+  // Set up the pool of tile buffers before any tiles are allocated
+  float tile_pool_size = Environment::getTilePoolSize();
+  bool tile_pool_hugepages = Environment::getTilePoolHugePages();
+  TilePool::configure( (size_t) ( tile_pool_size * 1024.0 * 1024.0 ), tile_pool_hugepages );
+  tile_pool_size = TilePool::statistics().capacity / (1024.0 * 1024.0);
+
+
+  // Print out some information
+  if( loglevel >= 1 ){
+		logfile << "Setting maximum image cache size to " << max_image_cache_size << endl;
+    logfile << "Setting maximum image cache memory to ";
+    if( max_image_cache_memory > 0 ) logfile << max_image_cache_memory << "MB" << endl;
+    else logfile << "unlimited" << endl;
+    logfile << "Setting maximum image cache open files to ";
+    if( max_image_cache_files > 0 ) logfile << max_image_cache_files << endl;
+    else logfile << "unlimited" << endl;
+    logfile << "Setting maximum tile cache size to " << max_tile_cache_size << "MB" << endl;
+    logfile << "Setting number of worker threads to " << worker_threads << endl;
+    if( prefetch_threads > 0 ){
+      logfile << "Prefetching " << prefetch_depth << " tiles per request with " << prefetch_threads
+	      << " threads and a queue of " << prefetch_queue << endl;
+    }
+    if( BioFormatsPool::enabled() ){
+      logfile << "Reading BioFormats images with " << BioFormatsPool::size() << " threads" << endl;
+    }
+    if( warm_levels > 0 ) logfile << "Warming " << warm_levels << " lowest resolutions of newly opened images" << endl;
+    if( !preload_manifest.empty() ) logfile << "Preloading images listed in '" << preload_manifest << "'" << endl;
+    if( tile_cache_shards > 1 ) logfile << "Splitting tile cache into " << tile_cache_shards << " shards" << endl;
+    logfile << "Setting tile cache admission policy to " << (tinylfu ? "TinyLFU" : "LRU") << endl;
+    logfile << "Setting tile cache eviction policy to " << (gds ? "GreedyDual-Size" : "LRU") << endl;
+    if( tile_cache_image_quota > 0 ){
+      logfile << "Setting tile cache quota per image to " << tile_cache_image_quota << "MB" << endl;
+    }
+    if( tile_cache_cold > 0 ){
+      logfile << "Setting compressed cold tier of tile cache to " << tile_cache_cold << "MB" << endl;
+    }
+    if( tile_pool_size > 0 ){
+      logfile << "Setting tile buffer pool to " << tile_pool_size << "MB"
+	      << ( tile_pool_hugepages ? " using huge pages" : "" ) << endl;
+    }
+    logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
+    logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
+    if( TileManager::passthrough ) logfile << "Sending JPEG tiles stored in image files without compressing them again"
+					       << " to requests at the default quality" << endl;
+    logfile << "Setting maximum CVT size to " << max_CVT << endl;
+    logfile << "Using " << PixelKernels::name( PixelKernels::level() ) << " pixel kernels" << endl;
+    logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
+    if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
+    if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
+    if( max_layers != 0 ){
+      logfile << "Setting max quality layers (for supported file formats) to ";
+      if( max_layers < 0 ) logfile << "all layers" << endl;
+      else logfile << max_layers << endl;
+    }
+#ifdef HAVE_KAKADU
+    logfile << "Setting up JPEG2000 support via Kakadu SDK" << endl;
+#endif
+  }
+
+
+  // Try to load our watermark
+  if( watermark.getImage().length() > 0 ){
+    watermark.init();
+    if( loglevel >= 1 ){
+      if( watermark.isSet() ){
+	logfile << "Loaded watermark image '" << watermark.getImage()
+		<< "': setting probability to " << watermark.getProbability()
+		<< " and opacity to " << watermark.getOpacity() << endl;
+      }
+      else{
+	logfile << "Unable to load watermark image '" << watermark.getImage() << "'" << endl;
+      }
+    }
+  }
+
+#ifndef DEBUG
+#ifdef HAVE_MEMCACHED
+
+  // Get our list of memcached servers if we have any and the timeout
+  string memcached_servers = Environment::getMemcachedServers();
+  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
+
+  // Each worker thread creates its own memcached object
+
+#endif
+#endif
+
+
+  // Add a new line
+  if( loglevel >= 1 ) logfile << endl;
+
+
+  /***********************************************************
+    Check for loadable modules - only if enabled by configure
+  ***********************************************************/
+
+#ifdef ENABLE_DL
+
+  map <string, string> moduleList;
+  string modulePath;
+  char* envpara = getenv( "DECODER_MODULES" );
+
+  if( envpara ){
+
+    modulePath = string( envpara );
+
+    // Try to open the module
+
+    Tokenizer izer( modulePath, "," );
+  
+    while( izer.hasMoreTokens() ){
+      
+      try{
+	string token = izer.nextToken();
+	DSOImage module;
+	module.Load( token );
+	string type = module.getImageType();
+	if( loglevel >= 1 ){
+	  logfile << "Loading external module: " << module.getDescription() << endl;
+	}
+	moduleList[ type ] = token;
+      }
+      catch( const string& error ){
+	if( loglevel >= 1 ) logfile << error << endl;
+      }
+
+    }
+    
+    // Tell us what's happened
+    if( loglevel >= 1 ) logfile << moduleList.size() << " external modules loaded" << endl;
+
+  }
+
+#endif
+
+
+
+  /***********************************************************
+    Set up a signal handler for USR1, TERM, HUP and INT signals
+    - to simplify things, they can all just shutdown the
+      server. We can rely on mod_fastcgi to restart us.
+    - SIGUSR1 and SIGHUP don't exist on Windows, though. 
+    - elsewhere, block them here before we start any threads
+      and take them in a thread of their own - see IIPSignalWaiter
+  ***********************************************************/
+
+#ifndef WIN32
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGUSR1 );
+  sigaddset( &signals, SIGHUP );
+  sigaddset( &signals, SIGTERM );
+  sigaddset( &signals, SIGINT );
+  pthread_sigmask( SIG_BLOCK, &signals, NULL );
+#else
+  signal( SIGTERM, IIPSignalHandler );
+  signal( SIGINT, IIPSignalHandler );
+#endif
+
+
+
+  if( loglevel >= 1 ){
+    logfile << endl << "Initialisation Complete." << endl
+	    << "<----------------------------------->"
+	    << endl << endl;
+  }
+
+
+  // Seed our random number generator with the millisecond count from a timer
+  Timer seed_timer;
+  srand( seed_timer.getTime() );
+
+
+
+  // Create our tile cache - shared by all threads. When several threads use it,
+  // split it into independently locked shards so that lookups don't serialise
+  // If a shared memory name is set, share the cache with the other iipsrv processes on this host instead
+  TileCache* tileCache = NULL;
+  if( !tile_cache_shm.empty() && max_tile_cache_size > 0 ){
+    SharedTileCache* shared = new SharedTileCache( tile_cache_shm, max_tile_cache_size );
+    if( shared->ready() ){
+      if( loglevel >= 1 ) logfile << "Sharing tile cache between processes in shared memory '"
+				  << tile_cache_shm << "'" << endl;
+      tileCache = shared;
+    }
+    else{
+      if( loglevel >= 1 ) logfile << "Unable to use shared memory tile cache: " << shared->error() << endl;
+      delete shared;
+    }
+  }
+
+  if( !tileCache ){
+    if( tile_cache_shards > 1 ){
+      tileCache = new ShardedTileCache( max_tile_cache_size, tile_cache_shards, tinylfu, gds,
+					tile_cache_image_quota, tile_cache_cold );
+    }
+    else tileCache = new MemoryTileCache( max_tile_cache_size, tinylfu, gds, tile_cache_image_quota, tile_cache_cold );
+  }
+
+  // Back the tile cache with a file, which keeps its tiles across restarts
+  TileStore* tileDisk = NULL;
+  if( !tile_cache_disk.empty() ){
+    tileDisk = new TileStore;
+    if( tileDisk->openFile( tile_cache_disk, (size_t) ceil( tile_cache_disk_size * 1024.0 * 1024.0 ) ) ){
+      tileCache->setSecondLevel( tileDisk );
+      if( loglevel >= 1 ) logfile << "Using " << tile_cache_disk_size << "MB on-disk tile cache '"
+				  << tile_cache_disk << "' holding " << tileDisk->statistics().entries
+				  << " tiles" << endl;
+    }
+    else{
+      if( loglevel >= 1 ) logfile << "Unable to use on-disk tile cache: " << tileDisk->error() << endl;
+      delete tileDisk;
+      tileDisk = NULL;
+    }
+  }
+
+
+  // Prefetch likely next tiles into the tile cache while workers are idle.
+  // Warming images needs a prefetch thread even if prediction is disabled
+  Prefetcher* prefetcher = NULL;
+  if( ( prefetch_threads > 0 || warm_levels > 0 ) && max_tile_cache_size > 0 ){
+    prefetcher = new Prefetcher( tileCache, &watermark, prefetch_threads > 0 ? prefetch_threads : 1,
+				 prefetch_threads > 0 ? prefetch_depth : 0, prefetch_queue, worker_threads );
+  }
+
+
+  // Start our worker threads. The main thread serves requests as well
+  ServerContext server;
+  server.version = version;
+  server.logfile_path = Environment::getLogFile();
+  server.jpeg_quality = jpeg_quality;
+  server.max_CVT = max_CVT;
+  server.max_layers = max_layers;
+  server.cors = cors;
+  server.base_url = base_url;
+  server.watermark = &watermark;
+  server.imageCache = &imageCache;
+  server.tileCache = tileCache;
+  server.prefetcher = prefetcher;
+  server.tile_cache_cold = ( tile_cache_cold > 0 );
+  server.tile_cache_disk = ( tileDisk != NULL );
+  server.tile_pool = ( tile_pool_size > 0 );
+#ifdef DEBUG
+  server.query = argv[1];
+#else
+  server.listen_socket = listen_socket;
+#ifdef HAVE_MEMCACHED
+  server.memcached_servers = memcached_servers;
+  server.memcached_timeout = memcached_timeout;
+#endif
+#endif
+
+#ifndef WIN32
+  // Report our statistics when we are signalled to stop, which is how we usually stop
+  thread( IIPSignalWaiter, std::cref(server), signals ).detach();
+#endif
+
+  // Open the images we expect to be asked for before accepting any requests
+  if( !preload_manifest.empty() ) preloadImages( server, preload_manifest );
+
+  vector<thread> workers;
+  for( unsigned int n = 1; n < worker_threads; n++ ){
+    workers.push_back( thread( IIPWorker, std::cref(server), n ) );
+  }
+
+  IIPWorker( server, 0 );
+
+  for( unsigned int n = 0; n < workers.size(); n++ ) workers[n].join();
+
+  // Report how our caches, prefetcher and pools performed
+  IIPStatistics( server );
+
+  // Stop prefetching, then stop reading BioFormats images once nothing else can ask for a tile
+  delete prefetcher;
+  if( BioFormatsPool::enabled() ) BioFormatsPool::shutdown();
+
+  delete tileCache;
+  delete tileDisk;
+
+
 
 		// cleanup.
 		// ImageCache should clean up automatically.
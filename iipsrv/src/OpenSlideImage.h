@@ -11,7 +11,8 @@
 #ifndef OPENSLIDEIMAGE_H
 #define	OPENSLIDEIMAGE_H
 
-#include "IIPImage.h"
+#include "VirtualPyramidImage.h"
+#include "TIFFJPEGTiles.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -19,7 +20,7 @@
 #include <inttypes.h>
 #include <iostream>
 #include <fstream>
-#include "Cache.h"  // for local cache of raw tiles.
+#include <memory>
 
 
 extern "C" {
@@ -31,22 +32,27 @@ extern "C" {
 #define OPENSLIDE_TILESIZE 256
 #define OPENSLIDE_TILE_CACHE_SIZE 32
 
-/// Image class for OpenSlide supported Images: Inherits from IIPImage. Uses the OpenSlide library.
+/// Size of the tile cache OpenSlide keeps for each open slide
+#define OPENSLIDE_CACHE_SIZE (32*1024*1024)
 
-class OpenSlideImage : public IIPImage {
+/// Minimum width in our tiles of the blocks read from levels whose native tiles do not align with ours
+#define OPENSLIDE_UNALIGNED_BLOCK 4
+
+/// Image class for OpenSlide supported Images: Inherits from VirtualPyramidImage. Uses the OpenSlide library.
+
+class OpenSlideImage : public VirtualPyramidImage {
 private:
     openslide_t* osr; //the openslide reader
     /// Tile data buffer pointer
 
-    TileCache *tileCache;
-    int milliseconds = 0;
+    /// native tile size of each openslide level, 0 if untiled or unknown
+    std::vector<size_t> openslide_tile_widths, openslide_tile_heights;
+
+    /// JPEG tiles of the levels of TIFF based slides which can be sent without decoding, shared by copies
+    std::shared_ptr<TIFFJPEGTiles> jpegTiles;
  
     //uint32_t *osr_buf;
     // tdata_t tile_buf;
-
-    std::vector<size_t> numTilesX, numTilesY;
-    std::vector<size_t> lastTileXDim, lastTileYDim;
-    std::vector<uint32_t> openslide_level_to_use, openslide_downsample_in_level;
  
 //    /// get a region from file - downsample_region. color convert
 //    void read(const uint32_t zoom, const uint32_t w, const uint32_t h, const uint64_t x, const uint64_t y, void* data);
@@ -54,66 +60,39 @@ private:
 //    /// downsample  - read from file region, downsample
 //    void downsample_region(uint32_t *buf, const uint64_t x, const uint64_t y, const int32_t z, const uint32_t w, const uint32_t h);
 
-    /**
-     * @brief get cached tile.
-     * @detail  return from the local cache a tile.
-     *          The tile may be native (directly from file),
-     *                previously cached,
-     *                or downsampled (recursively called.
-     *  note that tilex and tiley can be found by multiplying by 2 raised to power of the difference in levels.
-     *  2 versions - direct and recursive.  direct should have slightly lower latency.
-     *
-     * @param tilex
-     * @param tiley
-     * @param res
-     * @return
-     */
-    /// check if cache has tile.  if yes, return it.  if not, and is a native layer, getNativeTile, else call halfsampleAndComposeTile
-    RawTilePtr getCachedTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+    /// read from file, color convert, and return tile.
+    virtual RawTilePtr getNativeTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+
+    /// read a region of a native level in one call, and color convert.
+    virtual void readNativeRegion(uint32_t level, size_t x, size_t y, size_t w, size_t h, uint8_t* buffer);
+
+    /// decode JPEG levels of TIFF based slides reduced by up to 8 with a scaled inverse DCT.
+    virtual size_t nativeScale(uint32_t level, size_t downsample);
 
-    /// read from file, color convert, store in cache, and return tile.
-    RawTilePtr getNativeTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+    /// read a region of a JPEG level reduced in size, without going through openslide.
+    virtual void readScaledRegion(uint32_t level, size_t scale, size_t x, size_t y, size_t w, size_t h, uint8_t* buffer);
 
-    /// call 4x (getCachedTile at next res, downsample, compose), store in cache, and return tile.  (causes recursion, stops at native layer or in cache.)
-    RawTilePtr halfsampleAndComposeTile(const size_t tilex, const size_t tiley, const uint32_t iipres);
+    /// read levels in blocks aligned to the native tiles, so each native tile is decoded once.
+    virtual void nativeBlockTiles(uint32_t level, size_t& bw, size_t& bh);
 
+    /// our tiles per block in one direction, given the native tile size in that direction
+    static size_t blockTilesFor(size_t native_tile, size_t tile);
+
+    /// return a numeric openslide.level[N] property, 0 if absent
+    size_t getLevelProperty(int32_t level, const char* name);
 
 
-    inline uint32_t bgra2rgb_kernel(const uint32_t& bgra) {
-      uint32_t t = bgra;
-      t = (t & 0x000000ff)<<24 | (t & 0x0000ff00)<<8 | (t & 0x00ff0000)>>8 | (t & 0xff000000)>>24;
-      return t >> 8;
-    }
 
     /**
      * @brief in place bgra to rgb conversion.
-     * @details  relies on compiler to generate bswap code.  uses endian conversion to swap bgra to argb, then bit shift by 8 to get rid of a.
+     * @details  uses the widest SIMD kernel the CPU supports, see PixelKernels.
      *
      * @param data
      */
     void bgra2rgb(uint8_t* data, const size_t w, const size_t h);
 
-    /// average 2 rows, then average 2 pixels
-    inline uint32_t halfsample_kernel_3(const uint8_t *r1, const uint8_t *r2) {
-    	uint64_t a = *(reinterpret_cast<const uint64_t*>(r1));
-    	uint64_t c = *(reinterpret_cast<const uint64_t*>(r2));
-    	uint64_t t1 = (((a ^ c) & 0xFEFEFEFEFEFEFEFE) >> 1) + (a & c);
-    	uint32_t t2 = t1 & 0x0000000000FFFFFF;
-    	uint32_t t3 = (t1 >> 24) & 0x0000000000FFFFFF;
-    	return (((t3 ^ t2) & 0xFEFEFEFE) >> 1) + (t3 & t2);
-    }
-
-    /// downsample by 2
-    void halfsample_3(const uint8_t* in, const size_t in_w, const size_t in_h,
-                     uint8_t* out, size_t& out_w, size_t& out_h);
-
-
-    void compose(const uint8_t *in, const size_t in_w, const size_t in_h,
-    		const size_t& xoffset, const size_t& yoffset,
-    		uint8_t* out, const size_t& out_w, const size_t& out_h);
-
     /// Constructor
-    OpenSlideImage() : IIPImage() {
+    OpenSlideImage() : VirtualPyramidImage() {
         fprintf(stderr, "New thread\n\n");
 
         tile_width = OPENSLIDE_TILESIZE;
@@ -127,7 +106,7 @@ public:
     /// Constructor
     /** \param path image path
      */
-    OpenSlideImage(const std::string& path, TileCache* tile_cache) : IIPImage(path), tileCache(tile_cache) {
+    OpenSlideImage(const std::string& path, TileCache* tile_cache) : VirtualPyramidImage(path, tile_cache) {
         fprintf(stderr, "New thread\n\n");
 
         tile_width = OPENSLIDE_TILESIZE;
@@ -139,7 +118,7 @@ public:
 
     /** \param image IIPImage object
      */
-    OpenSlideImage(const IIPImage& image, TileCache* tile_cache) : IIPImage(image), tileCache(tile_cache) {
+    OpenSlideImage(const IIPImage& image, TileCache* tile_cache) : VirtualPyramidImage(image, tile_cache) {
         fprintf(stderr, "New thread\n\n");
 
         osr = NULL;
@@ -148,14 +127,11 @@ public:
 
     /** \param image IIPImage object
      */
-    explicit OpenSlideImage(const OpenSlideImage& image) : IIPImage(image),
-    		osr(image.osr), tileCache(image.tileCache),
-    		numTilesX(image.numTilesX),
-    		numTilesY(image.numTilesY),
-    		lastTileXDim(image.lastTileXDim),
-    		lastTileYDim(image.lastTileYDim),
-    		openslide_level_to_use(image.openslide_level_to_use),
-    		openslide_downsample_in_level(image.openslide_downsample_in_level)
+    explicit OpenSlideImage(const OpenSlideImage& image) : VirtualPyramidImage(image),
+    		osr(image.osr),
+    		openslide_tile_widths(image.openslide_tile_widths),
+    		openslide_tile_heights(image.openslide_tile_heights),
+    		jpegTiles(image.jpegTiles)
 	{};
     /// Destructor
 
@@ -177,15 +153,29 @@ public:
     /// Overloaded function for closing a TIFF image
     virtual void closeImage();
 
+    /// Add OpenSlide's own tile cache and our level tables to the memory usage
+    virtual size_t getMemoryUsage();
+
+    /// Count one descriptor for an open slide and one for our JPEG tile reader
+    virtual unsigned int getDescriptorUsage();
+
+
+    /// Return codec description
+    virtual const std::string getDescription() { return std::string( "OpenSlide" ); };
+
+    /// OpenSlide handles may be read from several threads at once
+    virtual bool concurrentDecoding(){ return true; };
 
-    /// Overloaded function for getting a particular tile
+    /// Return a tile of a TIFF based slide's native level exactly as stored, if it is JPEG at our tile size
     /** \param x horizontal sequence angle
         \param y vertical sequence angle
         \param r resolution
-        \param l number of quality layers to decode
+        \param l number of quality layers (ignored)
         \param t tile number
+        \param c compression type wanted: only JPEG tiles are passed through
+        \return the JPEG tile, or an empty pointer if it must be decoded
      */
-	virtual RawTilePtr getTile(int x, int y, unsigned int r, int l, unsigned int t) throw (file_error);
+    virtual RawTilePtr getCompressedTile(int x, int y, unsigned int r, int l, unsigned int t, CompressionType c);
 
 //    // TCP: turn on region decoding.  problem is that this bypasses tile caching, so overall it's not faster.
 //    /// Return whether this image type directly handles region decoding
@@ -0,0 +1,163 @@
+/*
+    IIP Pixel Kernel Benchmark
+
+    Measures the throughput of each pixel kernel with every instruction set
+    the CPU supports, and checks that each gives the same output as the
+    scalar version: converting OpenSlide BGRA pixels to RGB, halfsampling
+    RGB rows, and summing rows for larger box filter downsamples.
+
+    Build with "make pixelbench" and run as:
+
+      pixelbench [image width] [image height] [repetitions]
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "PixelKernels.h"
+#include "Timer.h"
+
+
+using namespace std;
+
+
+// Channels of the halfsampled images
+#define CHANNELS 3
+
+
+
+/// Fill a buffer with reproducible noise
+static void fill( vector<uint8_t>& buffer ){
+  unsigned long long s = 88172645463325252ULL;
+  for( size_t i = 0; i < buffer.size(); i++ ){
+    s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+    buffer[i] = (uint8_t) s;
+  }
+}
+
+
+/// Convert an image from BGRA to RGB, returning MB of input per second
+static double bgra2rgb( const vector<uint8_t>& image, vector<uint8_t>& work, size_t pixels, unsigned int reps ){
+  double seconds = 0;
+  for( unsigned int r = 0; r < reps; r++ ){
+    // Conversion is in place, so restore the input each time without timing it
+    memcpy( &work[0], &image[0], pixels * 4 );
+    Timer timer;
+    timer.start();
+    PixelKernels::bgra2rgb( &work[0], pixels );
+    seconds += timer.getTime() / 1000000.0;
+  }
+  return ( pixels * 4.0 * reps ) / ( seconds * 1024 * 1024 );
+}
+
+
+/// Halfsample an image, returning MB of input per second
+static double halfsample( const vector<uint8_t>& image, vector<uint8_t>& out, size_t w, size_t h, unsigned int reps ){
+  size_t stride = w * CHANNELS;
+  Timer timer;
+  timer.start();
+  for( unsigned int r = 0; r < reps; r++ ){
+    for( size_t y = 0; y + 1 < h; y += 2 ){
+      PixelKernels::halfsample( &image[ y * stride ], &image[ (y+1) * stride ], &out[ (y/2) * (w/2) * CHANNELS ], w / 2, CHANNELS );
+    }
+  }
+  double seconds = timer.getTime() / 1000000.0;
+  return ( (double) stride * h * reps ) / ( seconds * 1024 * 1024 );
+}
+
+
+/// Sum each group of 8 rows of an image, as for a downsample of 8, returning MB of input per second
+static double accumulate( const vector<uint8_t>& image, vector<uint16_t>& sums, size_t w, size_t h, unsigned int reps ){
+  size_t stride = w * CHANNELS;
+  Timer timer;
+  timer.start();
+  for( unsigned int r = 0; r < reps; r++ ){
+    for( size_t y = 0; y < h; y++ ){
+      if( y % 8 == 0 ) memset( &sums[0], 0, stride * sizeof(uint16_t) );
+      PixelKernels::accumulate( &image[ y * stride ], &sums[0], stride );
+    }
+  }
+  double seconds = timer.getTime() / 1000000.0;
+  return ( (double) stride * h * reps ) / ( seconds * 1024 * 1024 );
+}
+
+
+
+int main( int argc, char *argv[] )
+{
+  size_t w = (argc > 1) ? atol( argv[1] ) : 2048;
+  size_t h = (argc > 2) ? atol( argv[2] ) : 2048;
+  unsigned int reps = (argc > 3) ? atoi( argv[3] ) : 20;
+
+  if( w < 2 ) w = 2;
+  if( h < 2 ) h = 2;
+  if( reps < 1 ) reps = 1;
+
+  vector<uint8_t> bgra( w * h * 4 ), rgb( w * h * CHANNELS );
+  fill( bgra );
+  fill( rgb );
+
+  vector<uint8_t> work( w * h * 4 ), half( (w/2) * (h/2) * CHANNELS );
+  vector<uint16_t> sums( w * CHANNELS );
+
+  // Reference outputs from the scalar kernels
+  PixelKernels::Level chosen = PixelKernels::level();
+  PixelKernels::select( PixelKernels::SCALAR );
+  vector<uint8_t> ref_rgb( bgra );
+  PixelKernels::bgra2rgb( &ref_rgb[0], w * h );
+  vector<uint8_t> ref_half( half.size() );
+  halfsample( rgb, ref_half, w, h, 1 );
+  vector<uint16_t> ref_sums( sums.size(), 0 );
+  for( size_t y = 0; y < h; y++ ) PixelKernels::accumulate( &rgb[ y * w * CHANNELS ], &ref_sums[0], w * CHANNELS );
+
+  printf( "Pixel kernel benchmark: %lux%lu image, %u repetitions, %s chosen for this CPU\n\n",
+	  (unsigned long) w, (unsigned long) h, reps, PixelKernels::name( chosen ) );
+  printf( "%10s %16s %16s %16s %8s\n", "kernels", "bgra2rgb MB/s", "halfsample MB/s", "accumulate MB/s", "output" );
+
+  double scalar[3] = { 0, 0, 0 };
+
+  for( int l = PixelKernels::SCALAR; l < PixelKernels::LEVELS; l++ ){
+
+    if( !PixelKernels::select( (PixelKernels::Level) l ) ){
+      printf( "%10s %16s\n", PixelKernels::name( (PixelKernels::Level) l ), "unsupported" );
+      continue;
+    }
+
+    double rates[3];
+    rates[0] = bgra2rgb( bgra, work, w * h, reps );
+    bool same = ( memcmp( &work[0], &ref_rgb[0], w * h * CHANNELS ) == 0 );
+
+    rates[1] = halfsample( rgb, half, w, h, reps );
+    same = same && ( half == ref_half );
+
+    rates[2] = accumulate( rgb, sums, w, h, reps );
+    fill( sums.begin(), sums.end(), 0 );
+    for( size_t y = 0; y < h; y++ ) PixelKernels::accumulate( &rgb[ y * w * CHANNELS ], &sums[0], w * CHANNELS );
+    same = same && ( sums == ref_sums );
+
+    if( l == PixelKernels::SCALAR ) for( int k = 0; k < 3; k++ ) scalar[k] = rates[k];
+
+    printf( "%10s %10.0f %4.1fx %10.0f %4.1fx %10.0f %4.1fx %8s\n", PixelKernels::name( (PixelKernels::Level) l ),
+	    rates[0], rates[0] / scalar[0], rates[1], rates[1] / scalar[1], rates[2], rates[2] / scalar[2],
+	    same ? "same" : "DIFFERS" );
+  }
+
+  return 0;
+}
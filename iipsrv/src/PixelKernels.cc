@@ -0,0 +1,422 @@
+// Member functions for PixelKernels.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "PixelKernels.h"
+
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+
+#if ( defined(__x86_64__) || defined(__i386__) ) && defined(__GNUC__)
+#define PIXEL_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+
+using namespace std;
+
+
+// Output pixels downsampled per pass through our stack buffer
+#define HALFSAMPLE_CHUNK 256
+
+// Most channels handled by the vector halfsample kernels
+#define HALFSAMPLE_CHANNELS 4
+
+
+
+/*************************** Scalar kernels ***************************/
+
+
+// Convert pixels from in to out, which may be the same or behind. OpenSlide
+// pixels are native endian 32 bit ARGB, so BGRA in memory on little endian CPUs
+static void bgra2rgb_scalar( const uint8_t* in, uint8_t* out, size_t pixels ){
+  for( size_t i = 0; i < pixels; i++, in += 4, out += 3 ){
+    uint32_t argb;
+    memcpy( &argb, in, 4 );
+    out[0] = (uint8_t) ( argb >> 16 );
+    out[1] = (uint8_t) ( argb >> 8 );
+    out[2] = (uint8_t) argb;
+  }
+}
+
+
+static void bgra2rgb_scalar( uint8_t* data, size_t pixels ){
+  bgra2rgb_scalar( data, data, pixels );
+}
+
+
+// Rounded 2x2 means of samples from j onwards, each taken with the sample channels to its right
+static void halfsample_sums_scalar( const uint8_t* row1, const uint8_t* row2, uint8_t* t,
+				    size_t j, size_t n, unsigned int channels ){
+  for( ; j < n; j++ ){
+    t[j] = (uint8_t) ( ( row1[j] + row1[j+channels] + row2[j] + row2[j+channels] + 2 ) >> 2 );
+  }
+}
+
+
+// Keep the means of the left pixel of each pair from b onwards
+static void halfsample_compact_scalar( const uint8_t* t, uint8_t* out, size_t b, size_t n, unsigned int channels ){
+  for( ; b < n; b++ ) out[b] = t[ ( b / channels ) * 2 * channels + b % channels ];
+}
+
+
+static void halfsample_scalar( const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels ){
+  for( size_t i = 0; i < w; i++ ){
+    for( unsigned int c = 0; c < channels; c++ ){
+      size_t j = 2 * i * channels + c;
+      out[ i * channels + c ] = (uint8_t) ( ( row1[j] + row1[j+channels] + row2[j] + row2[j+channels] + 2 ) >> 2 );
+    }
+  }
+}
+
+
+static void accumulate_scalar( const uint8_t* row, uint16_t* sums, size_t n ){
+  for( size_t i = 0; i < n; i++ ) sums[i] += row[i];
+}
+
+
+
+/*************************** Vector kernels ***************************/
+
+#ifdef PIXEL_KERNELS_X86
+
+
+// Computes t[j] for j from 0 to n - channels, returning the first j not yet computed
+typedef size_t (*HalfsampleSums)( const uint8_t*, const uint8_t*, uint8_t*, size_t, unsigned int );
+
+
+// Halfsample through a stack buffer: first the rounded 2x2 mean at every
+// sample as if it belonged to the left pixel of a pair, which vectorises
+// whatever the number of channels, then keep those of the left pixels
+static void halfsample_chunked( HalfsampleSums sums, size_t (*compact)( const uint8_t*, uint8_t*, size_t, unsigned int ),
+				const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels ){
+
+  if( channels > HALFSAMPLE_CHANNELS ){
+    halfsample_scalar( row1, row2, out, w, channels );
+    return;
+  }
+
+  // Room for the chunk and for whole vector reads past its end
+  uint8_t t[ 2 * HALFSAMPLE_CHUNK * HALFSAMPLE_CHANNELS + 64 ];
+
+  for( size_t x = 0; x < w; x += HALFSAMPLE_CHUNK ){
+    size_t m = std::min( (size_t) HALFSAMPLE_CHUNK, w - x );
+    size_t n = 2 * m * channels;
+    const uint8_t* r1 = row1 + 2 * x * channels;
+    const uint8_t* r2 = row2 + 2 * x * channels;
+    uint8_t* o = out + x * channels;
+
+    size_t j = sums( r1, r2, t, n, channels );
+    halfsample_sums_scalar( r1, r2, t, j, n - channels, channels );
+
+    size_t b = compact( t, o, m * channels, channels );
+    halfsample_compact_scalar( t, o, b, m * channels, channels );
+  }
+}
+
+
+__attribute__(( target( "sse4.1" ) ))
+static void bgra2rgb_sse41( uint8_t* data, size_t pixels ){
+  const __m128i mask = _mm_setr_epi8( 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1 );
+  uint8_t* in = data;
+  uint8_t* out = data;
+  size_t i = 0;
+  // The 4 spare bytes of each store land on input already read
+  for( ; i + 4 <= pixels; i += 4, in += 16, out += 12 ){
+    __m128i v = _mm_loadu_si128( (const __m128i*) in );
+    _mm_storeu_si128( (__m128i*) out, _mm_shuffle_epi8( v, mask ) );
+  }
+  bgra2rgb_scalar( in, out, pixels - i );
+}
+
+
+__attribute__(( target( "sse4.1" ) ))
+static size_t halfsample_sums_sse41( const uint8_t* row1, const uint8_t* row2, uint8_t* t, size_t n, unsigned int channels ){
+  const __m128i two = _mm_set1_epi16( 2 );
+  size_t j = 0;
+  for( ; j + channels + 16 <= n; j += 16 ){
+    __m128i a = _mm_loadu_si128( (const __m128i*) ( row1 + j ) );
+    __m128i b = _mm_loadu_si128( (const __m128i*) ( row1 + j + channels ) );
+    __m128i c = _mm_loadu_si128( (const __m128i*) ( row2 + j ) );
+    __m128i d = _mm_loadu_si128( (const __m128i*) ( row2 + j + channels ) );
+    __m128i lo = _mm_add_epi16( _mm_add_epi16( _mm_cvtepu8_epi16( a ), _mm_cvtepu8_epi16( b ) ),
+				_mm_add_epi16( _mm_cvtepu8_epi16( c ), _mm_cvtepu8_epi16( d ) ) );
+    __m128i hi = _mm_add_epi16( _mm_add_epi16( _mm_cvtepu8_epi16( _mm_srli_si128( a, 8 ) ), _mm_cvtepu8_epi16( _mm_srli_si128( b, 8 ) ) ),
+				_mm_add_epi16( _mm_cvtepu8_epi16( _mm_srli_si128( c, 8 ) ), _mm_cvtepu8_epi16( _mm_srli_si128( d, 8 ) ) ) );
+    lo = _mm_srli_epi16( _mm_add_epi16( lo, two ), 2 );
+    hi = _mm_srli_epi16( _mm_add_epi16( hi, two ), 2 );
+    _mm_storeu_si128( (__m128i*) ( t + j ), _mm_packus_epi16( lo, hi ) );
+  }
+  return j;
+}
+
+
+// Gather the left pixel of each pair: whole pairs of pixels from up to 16
+// bytes of t at a time, storing 8 bytes of which the spare ones are overwritten next
+__attribute__(( target( "sse4.1" ) ))
+static size_t halfsample_compact_sse41( const uint8_t* t, uint8_t* out, size_t n, unsigned int channels ){
+  size_t step = ( 16 / ( 2 * channels ) ) * channels;
+  int8_t m[16];
+  for( int b = 0; b < 16; b++ ){
+    m[b] = ( (size_t) b < step ) ? (int8_t) ( ( b / channels ) * 2 * channels + b % channels ) : -1;
+  }
+  const __m128i mask = _mm_loadu_si128( (const __m128i*) m );
+  size_t b = 0;
+  for( ; b + 8 <= n; b += step, t += 2 * step ){
+    _mm_storel_epi64( (__m128i*) ( out + b ), _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*) t ), mask ) );
+  }
+  return b;
+}
+
+
+__attribute__(( target( "sse4.1" ) ))
+static void halfsample_sse41( const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels ){
+  halfsample_chunked( halfsample_sums_sse41, halfsample_compact_sse41, row1, row2, out, w, channels );
+}
+
+
+__attribute__(( target( "sse4.1" ) ))
+static void accumulate_sse41( const uint8_t* row, uint16_t* sums, size_t n ){
+  size_t i = 0;
+  for( ; i + 16 <= n; i += 16 ){
+    __m128i v = _mm_loadu_si128( (const __m128i*) ( row + i ) );
+    __m128i lo = _mm_loadu_si128( (const __m128i*) ( sums + i ) );
+    __m128i hi = _mm_loadu_si128( (const __m128i*) ( sums + i + 8 ) );
+    _mm_storeu_si128( (__m128i*) ( sums + i ), _mm_add_epi16( lo, _mm_cvtepu8_epi16( v ) ) );
+    _mm_storeu_si128( (__m128i*) ( sums + i + 8 ), _mm_add_epi16( hi, _mm_cvtepu8_epi16( _mm_srli_si128( v, 8 ) ) ) );
+  }
+  accumulate_scalar( row + i, sums + i, n - i );
+}
+
+
+__attribute__(( target( "avx2" ) ))
+static void bgra2rgb_avx2( uint8_t* data, size_t pixels ){
+  const __m256i mask = _mm256_setr_epi8( 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+					 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1 );
+  // Bring the 12 bytes of each lane together
+  const __m256i pack = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 3, 7 );
+  uint8_t* in = data;
+  uint8_t* out = data;
+  size_t i = 0;
+  for( ; i + 8 <= pixels; i += 8, in += 32, out += 24 ){
+    __m256i v = _mm256_loadu_si256( (const __m256i*) in );
+    v = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( v, mask ), pack );
+    _mm256_storeu_si256( (__m256i*) out, v );
+  }
+  bgra2rgb_scalar( in, out, pixels - i );
+}
+
+
+__attribute__(( target( "avx2" ) ))
+static size_t halfsample_sums_avx2( const uint8_t* row1, const uint8_t* row2, uint8_t* t, size_t n, unsigned int channels ){
+  const __m256i two = _mm256_set1_epi16( 2 );
+  size_t j = 0;
+  for( ; j + channels + 32 <= n; j += 32 ){
+    __m256i a = _mm256_loadu_si256( (const __m256i*) ( row1 + j ) );
+    __m256i b = _mm256_loadu_si256( (const __m256i*) ( row1 + j + channels ) );
+    __m256i c = _mm256_loadu_si256( (const __m256i*) ( row2 + j ) );
+    __m256i d = _mm256_loadu_si256( (const __m256i*) ( row2 + j + channels ) );
+    __m256i zero = _mm256_setzero_si256();
+    // Unpacking works within lanes, and packing below undoes it
+    __m256i lo = _mm256_add_epi16( _mm256_add_epi16( _mm256_unpacklo_epi8( a, zero ), _mm256_unpacklo_epi8( b, zero ) ),
+				   _mm256_add_epi16( _mm256_unpacklo_epi8( c, zero ), _mm256_unpacklo_epi8( d, zero ) ) );
+    __m256i hi = _mm256_add_epi16( _mm256_add_epi16( _mm256_unpackhi_epi8( a, zero ), _mm256_unpackhi_epi8( b, zero ) ),
+				   _mm256_add_epi16( _mm256_unpackhi_epi8( c, zero ), _mm256_unpackhi_epi8( d, zero ) ) );
+    lo = _mm256_srli_epi16( _mm256_add_epi16( lo, two ), 2 );
+    hi = _mm256_srli_epi16( _mm256_add_epi16( hi, two ), 2 );
+    _mm256_storeu_si256( (__m256i*) ( t + j ), _mm256_packus_epi16( lo, hi ) );
+  }
+  return j;
+}
+
+
+__attribute__(( target( "avx2" ) ))
+static void halfsample_avx2( const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels ){
+  halfsample_chunked( halfsample_sums_avx2, halfsample_compact_sse41, row1, row2, out, w, channels );
+}
+
+
+__attribute__(( target( "avx2" ) ))
+static void accumulate_avx2( const uint8_t* row, uint16_t* sums, size_t n ){
+  size_t i = 0;
+  for( ; i + 16 <= n; i += 16 ){
+    __m256i v = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i*) ( row + i ) ) );
+    __m256i s = _mm256_loadu_si256( (const __m256i*) ( sums + i ) );
+    _mm256_storeu_si256( (__m256i*) ( sums + i ), _mm256_add_epi16( s, v ) );
+  }
+  accumulate_scalar( row + i, sums + i, n - i );
+}
+
+
+__attribute__(( target( "avx512f,avx512bw" ) ))
+static void bgra2rgb_avx512( uint8_t* data, size_t pixels ){
+  const __m512i mask = _mm512_broadcast_i32x4( _mm_setr_epi8( 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1 ) );
+  const __m512i pack = _mm512_setr_epi32( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 3, 7, 11, 15 );
+  uint8_t* in = data;
+  uint8_t* out = data;
+  size_t i = 0;
+  for( ; i + 16 <= pixels; i += 16, in += 64, out += 48 ){
+    __m512i v = _mm512_loadu_si512( (const void*) in );
+    v = _mm512_permutexvar_epi32( pack, _mm512_shuffle_epi8( v, mask ) );
+    _mm512_storeu_si512( (void*) out, v );
+  }
+  bgra2rgb_scalar( in, out, pixels - i );
+}
+
+
+__attribute__(( target( "avx512f,avx512bw" ) ))
+static size_t halfsample_sums_avx512( const uint8_t* row1, const uint8_t* row2, uint8_t* t, size_t n, unsigned int channels ){
+  const __m512i two = _mm512_set1_epi16( 2 );
+  const __m512i zero = _mm512_setzero_si512();
+  size_t j = 0;
+  for( ; j + channels + 64 <= n; j += 64 ){
+    __m512i a = _mm512_loadu_si512( (const void*) ( row1 + j ) );
+    __m512i b = _mm512_loadu_si512( (const void*) ( row1 + j + channels ) );
+    __m512i c = _mm512_loadu_si512( (const void*) ( row2 + j ) );
+    __m512i d = _mm512_loadu_si512( (const void*) ( row2 + j + channels ) );
+    __m512i lo = _mm512_add_epi16( _mm512_add_epi16( _mm512_unpacklo_epi8( a, zero ), _mm512_unpacklo_epi8( b, zero ) ),
+				   _mm512_add_epi16( _mm512_unpacklo_epi8( c, zero ), _mm512_unpacklo_epi8( d, zero ) ) );
+    __m512i hi = _mm512_add_epi16( _mm512_add_epi16( _mm512_unpackhi_epi8( a, zero ), _mm512_unpackhi_epi8( b, zero ) ),
+				   _mm512_add_epi16( _mm512_unpackhi_epi8( c, zero ), _mm512_unpackhi_epi8( d, zero ) ) );
+    lo = _mm512_srli_epi16( _mm512_add_epi16( lo, two ), 2 );
+    hi = _mm512_srli_epi16( _mm512_add_epi16( hi, two ), 2 );
+    _mm512_storeu_si512( (void*) ( t + j ), _mm512_packus_epi16( lo, hi ) );
+  }
+  return j;
+}
+
+
+__attribute__(( target( "avx512f,avx512bw" ) ))
+static void halfsample_avx512( const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels ){
+  halfsample_chunked( halfsample_sums_avx512, halfsample_compact_sse41, row1, row2, out, w, channels );
+}
+
+
+__attribute__(( target( "avx512f,avx512bw" ) ))
+static void accumulate_avx512( const uint8_t* row, uint16_t* sums, size_t n ){
+  size_t i = 0;
+  for( ; i + 32 <= n; i += 32 ){
+    __m512i v = _mm512_cvtepu8_epi16( _mm256_loadu_si256( (const __m256i*) ( row + i ) ) );
+    __m512i s = _mm512_loadu_si512( (const void*) ( sums + i ) );
+    _mm512_storeu_si512( (void*) ( sums + i ), _mm512_add_epi16( s, v ) );
+  }
+  accumulate_scalar( row + i, sums + i, n - i );
+}
+
+#endif
+
+
+
+/*************************** Dispatch ***************************/
+
+
+namespace {
+
+  struct Kernels {
+    void (*bgra2rgb)( uint8_t*, size_t );
+    void (*halfsample)( const uint8_t*, const uint8_t*, uint8_t*, size_t, unsigned int );
+    void (*accumulate)( const uint8_t*, uint16_t*, size_t );
+  };
+
+  const Kernels kernels[PixelKernels::LEVELS] = {
+    { bgra2rgb_scalar, halfsample_scalar, accumulate_scalar },
+#ifdef PIXEL_KERNELS_X86
+    { bgra2rgb_sse41, halfsample_sse41, accumulate_sse41 },
+    { bgra2rgb_avx2, halfsample_avx2, accumulate_avx2 },
+    { bgra2rgb_avx512, halfsample_avx512, accumulate_avx512 }
+#else
+    { bgra2rgb_scalar, halfsample_scalar, accumulate_scalar },
+    { bgra2rgb_scalar, halfsample_scalar, accumulate_scalar },
+    { bgra2rgb_scalar, halfsample_scalar, accumulate_scalar }
+#endif
+  };
+
+
+  /// The widest instruction set supported
+  PixelKernels::Level best(){
+#ifdef PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+#endif
+    for( int l = PixelKernels::LEVELS - 1; l > PixelKernels::SCALAR; l-- ){
+      if( PixelKernels::supported( (PixelKernels::Level) l ) ) return (PixelKernels::Level) l;
+    }
+    return PixelKernels::SCALAR;
+  }
+
+
+  /// The instruction set in use, chosen on first use
+  std::atomic<int>& active(){
+    static std::atomic<int> level( best() );
+    return level;
+  }
+
+}
+
+
+
+void PixelKernels::bgra2rgb( uint8_t* data, size_t pixels ){
+  kernels[ active().load( memory_order_relaxed ) ].bgra2rgb( data, pixels );
+}
+
+
+void PixelKernels::halfsample( const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels ){
+  kernels[ active().load( memory_order_relaxed ) ].halfsample( row1, row2, out, w, channels );
+}
+
+
+void PixelKernels::accumulate( const uint8_t* row, uint16_t* sums, size_t n ){
+  kernels[ active().load( memory_order_relaxed ) ].accumulate( row, sums, n );
+}
+
+
+PixelKernels::Level PixelKernels::level(){
+  return (Level) active().load();
+}
+
+
+bool PixelKernels::supported( Level l ){
+  switch( l ){
+  case SCALAR:
+    return true;
+#ifdef PIXEL_KERNELS_X86
+  case SSE41:
+    return __builtin_cpu_supports( "sse4.1" );
+  case AVX2:
+    return __builtin_cpu_supports( "avx2" );
+  case AVX512:
+    return __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" );
+#endif
+  default:
+    return false;
+  }
+}
+
+
+bool PixelKernels::select( Level l ){
+  if( !supported( l ) ) return false;
+  active().store( l );
+  return true;
+}
+
+
+const char* PixelKernels::name( Level l ){
+  const char* names[LEVELS] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+  return ( l >= SCALAR && l < LEVELS ) ? names[l] : "unknown";
+}
@@ -0,0 +1,89 @@
+// Pixel Conversion and Downsampling Kernels
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PIXELKERNELS_H
+#define _PIXELKERNELS_H
+
+
+#include <cstddef>
+#include <inttypes.h>
+
+
+
+/// Inner loops for converting and downsampling slide pixels
+/** Each kernel has a portable scalar version and, on x86 with GCC or clang,
+    SSE4.1, AVX2 and AVX-512 versions compiled with target attributes, so no
+    special compiler flags are needed. The widest instruction set the CPU
+    supports is chosen when a kernel is first used. The server never calls
+    select(): it exists so that benchmarks can compare instruction sets.
+
+    All versions produce identical output.
+ */
+class PixelKernels {
+
+ public:
+
+  /// Instruction sets, narrowest first
+  enum Level { SCALAR, SSE41, AVX2, AVX512, LEVELS };
+
+
+  /// Convert 32 bit BGRA pixels, as returned by OpenSlide, to packed RGB in place
+  /** @param data pixels, overwritten from the start with 3 bytes per pixel
+      @param pixels number of pixels
+   */
+  static void bgra2rgb( uint8_t* data, size_t pixels );
+
+  /// Downsample two rows of pixels by 2 in each direction
+  /** Each output sample is the rounded mean of a 2x2 square of input samples
+      @param row1 first row of 2 * w pixels
+      @param row2 second row of 2 * w pixels
+      @param out output row of w pixels
+      @param w output width in pixels
+      @param channels samples per pixel
+   */
+  static void halfsample( const uint8_t* row1, const uint8_t* row2, uint8_t* out, size_t w, unsigned int channels );
+
+  /// Add a row of samples to 16 bit running sums
+  /** @param row samples to add
+      @param sums sums, one per sample
+      @param n number of samples
+   */
+  static void accumulate( const uint8_t* row, uint16_t* sums, size_t n );
+
+
+  /// Return the instruction set in use
+  static Level level();
+
+  /// Return whether the CPU supports an instruction set
+  static bool supported( Level l );
+
+  /// Use a particular instruction set
+  /** @param l instruction set
+      @return false, leaving the current one in use, if the CPU does not support it
+   */
+  static bool select( Level l );
+
+  /// Return the name of an instruction set
+  static const char* name( Level l );
+
+};
+
+
+#endif
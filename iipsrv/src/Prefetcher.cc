@@ -0,0 +1,282 @@
+// Member functions for Prefetcher.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Prefetcher.h"
+#include "TileManager.h"
+#include "Timer.h"
+
+#include <cmath>
+#include <chrono>
+#include <fstream>
+
+
+using namespace std;
+
+
+// Number of built tiles remembered to measure prefetch accuracy
+#define PREFETCH_REMEMBER 4096
+
+// Number of client and image positions remembered before we start afresh
+#define PREFETCH_CLIENTS 4096
+
+// Milliseconds a prefetch thread waits before checking again whether workers are idle
+#define PREFETCH_POLL 10
+
+
+
+Prefetcher::Prefetcher( TileCache* tc, Watermark* w, unsigned int n,
+			unsigned int d, unsigned int q, unsigned int workers ) :
+  tileCache( tc ), watermark( w ), depth( d ), maxQueue( q ), idleThreshold( workers ),
+  stopping( false ), active( 0 ),
+  queued( 0 ), dropped( 0 ), cached( 0 ), builds( 0 ), failed( 0 ), useful( 0 ), wasted( 0 ), buildTime( 0 ), warmed( 0 )
+{
+  for( unsigned int i = 0; i < n; i++ ) threads.push_back( thread( &Prefetcher::run, this ) );
+}
+
+
+
+Prefetcher::~Prefetcher(){
+  {
+    lock_guard<mutex> guard( queueLock );
+    stopping = true;
+    queue.clear();
+    warming.clear();
+  }
+  ready.notify_all();
+  for( unsigned int i = 0; i < threads.size(); i++ ) threads[i].join();
+}
+
+
+
+void Prefetcher::predict( const Job& job, int resolution, int x, int y, vector<Job>& jobs ){
+
+  IIPImagePtr image = job.image;
+  int num_res = image->getNumResolutions();
+  if( resolution < 0 || resolution >= num_res || x < 0 || y < 0 ) return;
+
+  int ntlx = (int) ceil( (double) image->image_widths[num_res-resolution-1] / image->getTileWidth() );
+  int ntly = (int) ceil( (double) image->image_heights[num_res-resolution-1] / image->getTileHeight() );
+  if( x >= ntlx || y >= ntly ) return;
+
+  Job next = job;
+  next.resolution = resolution;
+  next.tile = y * ntlx + x;
+
+  for( unsigned int i = 0; i < jobs.size(); i++ ){
+    if( jobs[i].resolution == next.resolution && jobs[i].tile == next.tile ) return;
+  }
+  jobs.push_back( next );
+}
+
+
+
+void Prefetcher::observe( IIPImagePtr image, const string& client, int resolution, int tile,
+			  int xangle, int yangle, int layers, CompressionType c, int quality ){
+
+  int num_res = image->getNumResolutions();
+  if( resolution < 0 || resolution >= num_res || tile < 0 ) return;
+
+  int ntlx = (int) ceil( (double) image->image_widths[num_res-resolution-1] / image->getTileWidth() );
+  int x = tile % ntlx;
+  int y = tile / ntlx;
+
+  Job job = { image, resolution, tile, xangle, yangle, layers, c, quality };
+  vector<Job> jobs;
+
+  lock_guard<mutex> guard( queueLock );
+
+  // Was this tile one of ours?
+  TileKey key = TileCache::getIndex( image->getImageId(), resolution, tile, xangle, yangle, c, quality );
+  if( remembered.erase( key ) ){
+    useful++;
+  }
+
+  // Compare with this client's previous request for the image
+  pair<uint32_t,string> viewer( key.image, client );
+  map< pair<uint32_t,string>, Position >::iterator previous = history.find( viewer );
+
+  if( previous != history.end() ){
+    const Position& p = previous->second;
+    if( p.resolution == resolution ){
+      // Continue a pan
+      int dx = (x > p.x) - (x < p.x);
+      int dy = (y > p.y) - (y < p.y);
+      if( dx || dy ) predict( job, resolution, x + dx, y + dy, jobs );
+    }
+    else if( p.resolution < resolution ){
+      // Continue zooming in
+      for( int j = 0; j < 2; j++ ){
+	for( int i = 0; i < 2; i++ ) predict( job, resolution + 1, 2*x + i, 2*y + j, jobs );
+      }
+    }
+    else predict( job, resolution - 1, x / 2, y / 2, jobs );
+  }
+  else if( history.size() >= PREFETCH_CLIENTS ) history.clear();
+
+  Position position = { resolution, x, y };
+  history[ viewer ] = position;
+
+  // Then the neighbours and the parent
+  predict( job, resolution, x + 1, y, jobs );
+  predict( job, resolution, x - 1, y, jobs );
+  predict( job, resolution, x, y + 1, jobs );
+  predict( job, resolution, x, y - 1, jobs );
+  predict( job, resolution - 1, x / 2, y / 2, jobs );
+
+  // Queue the most likely first. The queue is served newest first, so queue in reverse
+  unsigned int n = ( jobs.size() < depth ) ? jobs.size() : depth;
+  for( unsigned int i = n; i-- > 0; ){
+    if( queue.size() >= maxQueue ){
+      queue.pop_front();
+      dropped++;
+    }
+    queue.push_back( jobs[i] );
+    queued++;
+  }
+
+  if( n ) ready.notify_all();
+}
+
+
+
+void Prefetcher::run(){
+
+  JPEGCompressor jpeg( 75 );
+
+  unique_lock<mutex> lock( queueLock );
+  while( !stopping ){
+
+    // Only work while a worker thread is idle
+    if( ( queue.empty() && warming.empty() ) || active >= idleThreshold ){
+      ready.wait_for( lock, chrono::milliseconds( PREFETCH_POLL ) );
+      continue;
+    }
+
+    // Predictions follow a viewer, so they go before warming
+    bool predicted = !queue.empty();
+    Job job;
+    if( predicted ){
+      job = queue.back();
+      queue.pop_back();
+    }
+    else{
+      job = warming.front();
+      warming.pop_front();
+    }
+
+    lock.unlock();
+    build( job, jpeg, predicted );
+    lock.lock();
+  }
+}
+
+
+
+void Prefetcher::build( const Job& job, JPEGCompressor& jpeg, bool predicted ){
+
+  TileKey key = TileCache::getIndex( job.image->getImageId(), job.resolution, job.tile,
+				     job.xangle, job.yangle, job.compression, job.quality );
+
+  if( tileCache->getObject( key ) ){
+    cached++;
+    return;
+  }
+
+  // Remember the tile before building it, so that a request which arrives
+  // while we build it, and waits for our result, counts as useful
+  if( predicted ){
+    lock_guard<mutex> guard( queueLock );
+    remembered.insert( key );
+    rememberedOrder.push_back( key );
+    while( rememberedOrder.size() > PREFETCH_REMEMBER ){
+      if( remembered.erase( rememberedOrder.front() ) ) wasted++;
+      rememberedOrder.pop_front();
+    }
+  }
+
+  Timer timer;
+  timer.start();
+
+  try{
+    // Tiles are built silently
+    ofstream log;
+    if( job.compression == JPEG ) jpeg.setQuality( job.quality );
+    TileManager tilemanager( tileCache, job.image, watermark, &jpeg, &log, 0 );
+    tilemanager.getTile( job.resolution, job.tile, job.xangle, job.yangle, job.layers, job.compression );
+    builds++;
+    buildTime += timer.getTime();
+  }
+  catch( ... ){
+    failed++;
+    lock_guard<mutex> guard( queueLock );
+    if( predicted ) remembered.erase( key );
+  }
+}
+
+
+
+void Prefetcher::warm( IIPImagePtr image, unsigned int levels, int layers, int quality ){
+
+  CompressionType c;
+  if( image->getNumBitsPerPixel() > 8 || image->getColourSpace() == CIELAB
+      || image->getNumChannels() == 2 || image->getNumChannels() > 3 ) c = UNCOMPRESSED;
+  else c = JPEG;
+
+  int num_res = image->getNumResolutions();
+  if( (int) levels > num_res ) levels = num_res;
+
+  lock_guard<mutex> guard( queueLock );
+
+  // Smallest first: these are requested first, and building them through a
+  // virtual pyramid caches the larger levels' tiles along the way. Each job
+  // holds its image open, so stop once the warming queue is as long as the
+  // prediction queue may be, and drop the tiles left over
+  for( int r = 0; r < (int) levels; r++ ){
+    int ntlx = (int) ceil( (double) image->image_widths[num_res-r-1] / image->getTileWidth() );
+    int ntly = (int) ceil( (double) image->image_heights[num_res-r-1] / image->getTileHeight() );
+    for( int t = 0; t < ntlx * ntly; t++ ){
+      if( warming.size() >= maxQueue ){
+        dropped += ntlx * ntly - t;
+        break;
+      }
+      Job job = { image, r, t, 0, 90, layers, c, (c == JPEG) ? quality : 0 };
+      warming.push_back( job );
+      warmed++;
+    }
+  }
+
+  ready.notify_all();
+}
+
+
+
+Prefetcher::Statistics Prefetcher::statistics(){
+  Statistics s;
+  s.queued = queued;
+  s.dropped = dropped;
+  s.cached = cached;
+  s.built = builds;
+  s.failed = failed;
+  s.useful = useful;
+  s.wasted = wasted;
+  s.buildTime = buildTime;
+  s.warming = warmed;
+  return s;
+}
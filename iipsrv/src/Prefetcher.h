@@ -0,0 +1,198 @@
+// Background Tile Prefetcher
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PREFETCHER_H
+#define _PREFETCHER_H
+
+
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <inttypes.h>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "Watermark.h"
+#include "JPEGCompressor.h"
+
+
+
+/// Decode and encode the tiles a viewer is likely to ask for next
+/** Each tile request served is passed to observe(), which compares it with the
+    previous request from the same client for the same image and queues the
+    tiles most likely to follow: the next tile in the direction of a pan, the
+    children of the tile after zooming in or its parent after zooming out, then
+    the remaining neighbours. Background threads build queued tiles into the
+    tile cache through a TileManager, so concurrent requests for a tile being
+    prefetched wait for it rather than building it again.
+
+    Prefetching only runs while at least one worker thread is idle, so it uses
+    spare capacity rather than competing with requests. The queue is bounded:
+    when full, the oldest predictions are dropped as the viewer has moved on.
+
+    Prefetched tiles are remembered for a while so that accuracy can be
+    measured: a prefetch is useful if the tile is later requested, and wasted
+    if it is forgotten before that.
+
+    The same threads warm newly opened images: warm() queues every tile of the
+    lowest resolutions, which every viewer asks for first and which are the most
+    expensive to build from virtual pyramid levels. These are built whenever no
+    predictions are waiting.
+ */
+class Prefetcher {
+
+ public:
+
+  /// Prefetch statistics
+  struct Statistics {
+    uint64_t queued;       // Predictions queued
+    uint64_t dropped;      // Predictions and warming tiles dropped from a full queue
+    uint64_t cached;       // Predictions already in the cache when their turn came
+    uint64_t built;        // Tiles built into the cache
+    uint64_t failed;       // Tiles which could not be built
+    uint64_t useful;       // Built tiles later requested
+    uint64_t wasted;       // Built tiles not requested while remembered
+    uint64_t buildTime;    // Microseconds spent building tiles
+    uint64_t warming;      // Tiles queued to warm newly opened images
+  };
+
+
+ private:
+
+  /// A tile to prefetch
+  struct Job {
+    IIPImagePtr image;
+    int resolution;
+    int tile;
+    int xangle, yangle;
+    int layers;
+    CompressionType compression;
+    int quality;
+  };
+
+  /// The last tile requested by a client for an image
+  struct Position {
+    int resolution;
+    int x, y;
+  };
+
+  TileCache* tileCache;
+  Watermark* watermark;
+  unsigned int depth;
+  unsigned int maxQueue;
+  unsigned int idleThreshold;
+
+  std::vector<std::thread> threads;
+  std::mutex queueLock;
+  std::condition_variable ready;
+  bool stopping;
+
+  /// Queued predictions, oldest first
+  std::deque<Job> queue;
+
+  /// Queued tiles to warm, in the order to build them
+  std::deque<Job> warming;
+
+  /// Last position of each client in each image
+  std::map< std::pair<uint32_t,std::string>, Position > history;
+
+  /// Recently built tiles and their build order, to measure accuracy
+  std::set<TileKey> remembered;
+  std::deque<TileKey> rememberedOrder;
+
+  /// Requests currently being served
+  std::atomic<unsigned int> active;
+
+  std::atomic<uint64_t> queued, dropped, cached, builds, failed, useful, wasted, buildTime, warmed;
+
+
+  /// Add a tile to a list of predictions unless it is off the image or already listed
+  void predict( const Job& job, int resolution, int x, int y, std::vector<Job>& jobs );
+
+  /// Prefetch thread loop
+  void run();
+
+  /// Build a tile into the cache
+  /** @param job tile to build
+      @param jpeg compressor owned by the calling thread
+      @param predicted whether the tile was predicted, and so counts towards accuracy
+   */
+  void build( const Job& job, JPEGCompressor& jpeg, bool predicted );
+
+
+ public:
+
+  /// Constructor
+  /** @param tileCache tile cache to prefetch into
+      @param watermark watermark applied to tiles, or NULL
+      @param threads number of prefetch threads
+      @param depth number of tiles to predict after each request, 0 to only warm images
+      @param maxQueue maximum number of queued predictions
+      @param workers number of worker threads: prefetching runs while fewer requests are active
+   */
+  Prefetcher( TileCache* tileCache, Watermark* watermark, unsigned int threads,
+	      unsigned int depth, unsigned int maxQueue, unsigned int workers );
+
+  /// Destructor - stops our threads, abandoning queued predictions
+  ~Prefetcher();
+
+  /// Record a tile request and queue the tiles likely to follow it
+  /** @param image image requested
+      @param client identifies the viewer, such as its address
+      @param resolution resolution number
+      @param tile tile number
+      @param xangle horizontal sequence number
+      @param yangle vertical sequence number
+      @param layers number of quality layers
+      @param c compression type requested
+      @param quality compression quality requested
+   */
+  void observe( IIPImagePtr image, const std::string& client, int resolution, int tile,
+		int xangle, int yangle, int layers, CompressionType c, int quality );
+
+  /// Queue the tiles of the lowest resolutions of an image to be built
+  /** Tiles are built as JTL serves them without any view adjustments:
+      JPEG compressed where the image allows and uncompressed otherwise
+      @param image image to warm
+      @param levels number of resolutions to warm, starting from the smallest
+      @param layers number of quality layers
+      @param quality JPEG quality
+   */
+  void warm( IIPImagePtr image, unsigned int levels, int layers, int quality );
+
+  /// Record the start of a request
+  void requestStarted(){ active++; };
+
+  /// Record the end of a request
+  void requestFinished(){ active--; ready.notify_one(); };
+
+  /// Return our statistics
+  Statistics statistics();
+
+};
+
+
+#endif
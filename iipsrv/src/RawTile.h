@@ -39,6 +39,7 @@
 #include <cstdlib>
 #include <ctime>
 #include "Timer.h"
+#include "Allocations.h"
 
 //#define DEBUG_RT 1
 
@@ -48,7 +49,7 @@
 #include <iostream>
 #include <fstream>
 
-extern std::ofstream logfile;
+extern thread_local std::ofstream logfile;
 #endif
 
 /// Colour spaces - GREYSCALE, sRGB and CIELAB
@@ -91,6 +92,9 @@ class RawTile{
   /// Tile timestamp
   time_t timestamp;
 
+  /// Time taken to produce this tile in microseconds - used for cost-aware cache eviction
+  unsigned int cost;
+
   /// Pointer to the image data
   void *data;
 
@@ -120,6 +124,9 @@ class RawTile{
   /// Padded
   bool padded;
 
+  /// What our data is used for, for allocation accounting
+  AllocationCategory category;
+
 
   /// Main constructor
   /** @param tn tile number
@@ -136,70 +143,32 @@ class RawTile{
     width = w; height = h; bpc = b; dataLength = 0; data = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
     memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
-    timestamp = 0; sampleType = FIXEDPOINT; padded = false;
+    timestamp = 0; cost = 0; sampleType = FIXEDPOINT; padded = false;
+    category = ALLOC_TILES;
   };
 
 
   /// Destructor to free the data array if is has previously be allocated locally
   ~RawTile() {
-    if( data && memoryManaged ){
-      switch( bpc ){
-      case 32:
-        if( sampleType == FLOATINGPOINT ) delete[] (float*) data;
-        else delete[] (unsigned int*) data;
-        break;
-      case 16:
-	delete[] (unsigned short*) data;
-        break;
-      default:
-	delete[] (unsigned char*) data;
-        break;
-      }
-    }
+    freeData();
   }
 
 
   /// Copy constructor - handles copying of data buffer
   RawTile( const RawTile& tile ) {
 
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
-
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new unsigned int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
+    copyInfo( tile );
+    data = NULL;
+    memoryManaged = 1;
 
 #ifdef DEBUG_RT
     Timer timer;
     timer.start();
 #endif
 
-
-    if( data && (dataLength > 0) && tile.data ){
+    if( (dataLength > 0) && tile.data ){
+      data = allocate( dataLength );
       memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
     }
 #ifdef DEBUG_RT
     logfile << "RawTile :: copy ctor :: memcpy :: " << timer.getTime() << " microseconds" << std::endl << std::flush;
@@ -211,43 +180,19 @@ class RawTile{
   /// Copy assignment constructor
   RawTile& operator= ( const RawTile& tile ) {
 
-    dataLength = tile.dataLength;
-    width = tile.width;
-    height = tile.height;
-    channels = tile.channels;
-    bpc = tile.bpc;
-    tileNum = tile.tileNum;
-    resolution = tile.resolution;
-    hSequence = tile.hSequence;
-    vSequence = tile.vSequence;
-    compressionType = tile.compressionType;
-    quality = tile.quality;
-    filename = tile.filename;
-    timestamp = tile.timestamp;
-    sampleType = tile.sampleType;
-    padded = tile.padded;
+    if( this == &tile ) return *this;
 
-    switch( bpc ){
-      case 32:
-	if( sampleType == FLOATINGPOINT ) data = new float[dataLength/4];
-	else data = new int[dataLength/4];
-	break;
-      case 16:
-	data = new unsigned short[dataLength/2];
-	break;
-      default:
-	data = new unsigned char[dataLength];
-	break;
-    }
+    freeData();
+    copyInfo( tile );
 
 #ifdef DEBUG_RT
     Timer timer;
     timer.start();
 #endif
 
-    if( data && (dataLength > 0) && tile.data ){
+    if( (dataLength > 0) && tile.data ){
+      data = allocate( dataLength );
       memcpy( data, tile.data, dataLength );
-      memoryManaged = 1;
     }
 #ifdef DEBUG_RT
     logfile << "RawTile :: copy assign :: memcpy :: " << timer.getTime() << " microseconds" << std::endl << std::flush;
@@ -257,6 +202,141 @@ class RawTile{
   }
 
 
+  /// Allocate a data buffer which freeData() can free
+  /** Tile sized buffers come from the TilePool, others from the heap with
+      the type the destructor expects for the given bpc and sample type
+      @param bytes buffer size in bytes
+      @param b bits per channel the buffer will hold
+      @param type sample type the buffer will hold
+      @param c category the buffer is accounted to
+      @return new buffer, which becomes ours once assigned to data with memoryManaged set
+  */
+  static void* allocate( size_t bytes, int b, SampleType type, AllocationCategory c = ALLOC_TILES ) {
+    void* buffer = TilePool::allocate( bytes );
+    if( !buffer ){
+      switch( b ){
+        case 32:
+          if( type == FLOATINGPOINT ) buffer = new float[(bytes+3)/4];
+          else buffer = new unsigned int[(bytes+3)/4];
+          break;
+        case 16:
+          buffer = new unsigned short[(bytes+1)/2];
+          break;
+        default:
+          buffer = new unsigned char[bytes];
+          break;
+      }
+    }
+    Allocations::allocated( c, buffer );
+    return buffer;
+  }
+
+
+  /// Allocate a data buffer for our current bpc, sample type and category
+  void* allocate( size_t bytes ) const {
+    return allocate( bytes, bpc, sampleType, category );
+  }
+
+
+  /// Free a buffer from allocate()
+  static void deallocate( void* buffer, int b, SampleType type, AllocationCategory c = ALLOC_TILES ) {
+    if( !buffer ) return;
+    Allocations::freed( c, buffer );
+    if( TilePool::release( buffer ) ) return;
+    switch( b ){
+      case 32:
+        if( type == FLOATINGPOINT ) delete[] (float*) buffer;
+        else delete[] (unsigned int*) buffer;
+        break;
+      case 16:
+        delete[] (unsigned short*) buffer;
+        break;
+      default:
+        delete[] (unsigned char*) buffer;
+        break;
+    }
+  }
+
+
+  /// Return the number of bytes actually allocated for our data, or 0 if we do not own it
+  size_t allocatedSize() const {
+    if( !data || !memoryManaged ) return 0;
+    size_t size = Allocations::usableSize( data );
+    return size ? size : dataLength;
+  }
+
+
+  /// Move our data into a smaller buffer if most of its buffer is unused
+  /** Compressed tiles are written into buffers sized for the raw tile, which
+      would otherwise be held at full size while cached
+  */
+  void trim() {
+    size_t size = allocatedSize();
+    if( size <= 2 * (size_t) dataLength ) return;
+    void* smaller = allocate( dataLength );
+    memcpy( smaller, data, dataLength );
+    freeData();
+    data = smaller;
+  }
+
+
+  /// Free our data if we own it, or release the tile we are viewing
+  /** Must be called before bpc or sampleType change if data is to be replaced */
+  void freeData() {
+    if( data && memoryManaged ) deallocate( data, bpc, sampleType, category );
+    data = NULL;
+    memoryManaged = 1;
+#if defined(HAS_SHARED_PTR)
+    source.reset();
+#endif
+  }
+
+
+  /// Make sure we own our data before modifying it in place
+  /** Copies the data if it belongs to another tile, such as a cached tile we
+      are a view of, or to a decoder's internal buffer
+  */
+  void makeWritable() {
+    if( !data || memoryManaged ) return;
+    void* copy = allocate( dataLength );
+    memcpy( copy, data, dataLength );
+    data = copy;
+    memoryManaged = 1;
+#if defined(HAS_SHARED_PTR)
+    source.reset();
+#endif
+  }
+
+
+#if defined(HAS_SHARED_PTR)
+
+  /// Whether our data belongs to another tile
+  bool isShared() const { return (bool) source; }
+
+
+  /// Return a read-only view of a tile without copying its data
+  /** The view keeps the tile's data alive and copies it on the first in-place
+      modification - see makeWritable(). Tiles in the cache are never modified
+      once inserted, so views of them can be handed out freely.
+      @param tile tile to view
+      @return new tile sharing its data with tile
+  */
+  static std::shared_ptr<RawTile> share( const std::shared_ptr<RawTile>& tile ) {
+    std::shared_ptr<RawTile> view( new RawTile() );
+    view->copyInfo( *tile );
+    view->data = tile->data;
+    view->memoryManaged = 0;
+    view->source = tile->source ? tile->source : std::shared_ptr<const RawTile>( tile );
+    return view;
+  }
+
+#else
+
+  bool isShared() const { return false; }
+
+#endif
+
+
   /// Return the size of the data
   int size() { return dataLength; }
 
@@ -291,6 +371,35 @@ class RawTile{
   }
 
 
+ private:
+
+#if defined(HAS_SHARED_PTR)
+  /// Tile whose data we are viewing, if any - see share()
+  std::shared_ptr<const RawTile> source;
+#endif
+
+  /// Copy everything except the data
+  void copyInfo( const RawTile& tile ) {
+    dataLength = tile.dataLength;
+    width = tile.width;
+    height = tile.height;
+    channels = tile.channels;
+    bpc = tile.bpc;
+    tileNum = tile.tileNum;
+    resolution = tile.resolution;
+    hSequence = tile.hSequence;
+    vSequence = tile.vSequence;
+    compressionType = tile.compressionType;
+    quality = tile.quality;
+    filename = tile.filename;
+    timestamp = tile.timestamp;
+    cost = tile.cost;
+    sampleType = tile.sampleType;
+    padded = tile.padded;
+    category = tile.category;
+  }
+
+
 };
 
 // pointer type definition belongs here.
@@ -0,0 +1,115 @@
+// Shared Memory Tile Cache
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SHAREDTILECACHE_H
+#define _SHAREDTILECACHE_H
+
+
+#include "Cache.h"
+#include "TileStore.h"
+
+
+
+/// Tile cache held in POSIX shared memory
+/** All iipsrv processes on a host started with the same TILE_CACHE_SHM name
+    share one cache, so a tile decoded or encoded by one process is available
+    to all of them. The cache is a TileStore: eviction is first in, first out
+    and the byte budget is shared. Tiles returned are private copies.
+ */
+class SharedTileCache : public TileCache {
+
+ private:
+
+  /// Our shared store
+  TileStore store;
+
+  /// Optional second level store. Not owned by us
+  TileStore* secondLevel;
+
+
+ public:
+
+  /// Constructor
+  /** @param name shared memory object name
+      @param max cache size in MBs if we create the shared memory
+   */
+  SharedTileCache( const std::string& name, float max ) : secondLevel( NULL ) {
+    store.openShared( name, (size_t) ceil( max * 1024.0 * 1024.0 ) );
+  };
+
+  /// Whether the shared memory was attached - see error() otherwise
+  bool ready(){ return store.ready(); };
+
+  /// Return the error message if the shared memory could not be attached
+  const std::string& error(){ return store.error(); };
+
+  /// Return usage statistics for the shared store
+  TileStore::Statistics statistics(){ return store.statistics(); };
+
+
+  virtual void setSecondLevel( TileStore* s ) { secondLevel = s; }
+
+  /// Nothing is held in this process - see clearStores()
+  virtual void clear() {}
+
+  virtual void clearStores() {
+    store.clear();
+    if( secondLevel ) secondLevel->clear();
+  }
+
+  virtual void insert( const RawTilePtr r ) {
+    if( !r ) return;
+    const TileKey::Image* image = TileKey::intern( r->filename );
+    store.put( *image, *r );
+    // Our store gives no notice of evictions, so compressed tiles are written through
+    if( secondLevel && r->compressionType != UNCOMPRESSED ) secondLevel->put( *image, *r );
+  }
+
+  virtual RawTilePtr getObject( const TileKey &key ) {
+    if( !key.source ) return RawTilePtr();
+    const TileKey::Image& image = *key.source;
+    RawTilePtr r = store.get( image, key );
+    if( !r && secondLevel ){
+      r = secondLevel->get( image, key );
+      if( r ) store.put( image, *r );
+    }
+    if( r ) r->filename = image.path;
+    return r;
+  }
+
+  virtual void evict( const RawTilePtr r ) {
+    if( !r ) return;
+    TileKey key = getIndex( *r );
+    store.remove( *key.source, key, r->timestamp );
+    if( secondLevel ) secondLevel->remove( *key.source, key, r->timestamp );
+  }
+
+  virtual unsigned int getNumElements() {
+    return store.statistics().entries;
+  }
+
+  virtual float getMemorySize() {
+    return store.statistics().bytes / (1024.0 * 1024.0);
+  }
+
+};
+
+
+#endif
@@ -0,0 +1,134 @@
+// Single-Flight Call Coalescing
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SINGLEFLIGHT_H
+#define _SINGLEFLIGHT_H
+
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+
+
+/// Coalesce concurrent calls for the same key
+/** The first thread to ask for a key runs the call. Threads asking for the
+    same key while it is running wait and receive its result, or its exception,
+    rather than repeating the work. Once the call has finished, the next request
+    for the key runs it again, so results are not cached here.
+
+    The map of running calls is only locked briefly, so Key only needs to be
+    ordered, and calls for different keys run concurrently.
+ */
+template <typename Key, typename Value>
+class SingleFlight {
+
+ private:
+
+  /// A running call
+  struct Call {
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done;
+    Value value;
+    std::exception_ptr error;
+    Call() : done( false ) {};
+  };
+
+  /// Running calls
+  std::map< Key, std::shared_ptr<Call> > calls;
+
+  /// Mutex protecting the map
+  std::mutex mutex;
+
+
+ public:
+
+  /// Run a call unless one is already running for this key, and return its result
+  /** @param key key identifying the call
+      @param function function or lambda taking no arguments and returning a Value
+      @param shared set to whether we received the result of another thread's call
+      @return result of the call
+   */
+  template <typename Function>
+  Value run( const Key& key, Function function, bool* shared = NULL ) {
+
+    std::shared_ptr<Call> call;
+    bool leader = false;
+    {
+      std::lock_guard<std::mutex> guard( mutex );
+      typename std::map< Key, std::shared_ptr<Call> >::iterator i = calls.find( key );
+      if( i != calls.end() ) call = i->second;
+      else {
+        call = std::make_shared<Call>();
+        calls[ key ] = call;
+        leader = true;
+      }
+    }
+
+    if( shared ) *shared = !leader;
+
+    if( !leader ){
+      std::unique_lock<std::mutex> lock( call->mutex );
+      while( !call->done ) call->finished.wait( lock );
+      if( call->error ) std::rethrow_exception( call->error );
+      return call->value;
+    }
+
+    Value value = Value();
+    std::exception_ptr error;
+    try{
+      value = function();
+    }
+    catch( ... ){
+      error = std::current_exception();
+    }
+
+    // Later requests start a new call from here on
+    {
+      std::lock_guard<std::mutex> guard( mutex );
+      calls.erase( key );
+    }
+
+    {
+      std::lock_guard<std::mutex> guard( call->mutex );
+      call->value = value;
+      call->error = error;
+      call->done = true;
+    }
+    call->finished.notify_all();
+
+    if( error ) std::rethrow_exception( error );
+    return value;
+  }
+
+
+  /// Return the number of calls running
+  unsigned int size() {
+    std::lock_guard<std::mutex> guard( mutex );
+    return calls.size();
+  }
+
+};
+
+
+#endif
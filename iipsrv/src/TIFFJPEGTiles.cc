@@ -0,0 +1,316 @@
+// JPEG Compressed TIFF Tile Reader
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TIFFJPEGTiles.h"
+#include "JPEGDecoder.h"
+
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+using namespace std;
+
+
+// Adobe APP14 marker declaring that the 3 components are RGB rather than YCbCr
+static const uint8_t adobe_rgb[] = { 0xFF, 0xEE, 0x00, 0x0E, 'A', 'd', 'o', 'b', 'e',
+				     0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+
+
+bool TIFFJPEGTiles::jpeg( TIFF* tiff )
+{
+  uint32 w = 0, h = 0;
+  uint16 compression = 0, bitspersample = 0, samplesperpixel = 0, photometric = 0, planar = 0;
+
+  if( !TIFFIsTiled( tiff ) ) return false;
+
+  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &w );
+  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &h );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_BITSPERSAMPLE, &bitspersample );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  if( !TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &photometric ) ) return false;
+
+  // Only new style JPEG: old style JPEG and JPEG2000 compressed tiles are not complete JPEG streams
+  if( compression != COMPRESSION_JPEG || bitspersample != 8 || planar != PLANARCONFIG_CONTIG ) return false;
+  if( w == 0 || h == 0 || w % 8 || h % 8 ) return false;
+
+  if( samplesperpixel == 1 ) return photometric == PHOTOMETRIC_MINISBLACK;
+  if( samplesperpixel == 3 ) return photometric == PHOTOMETRIC_YCBCR || photometric == PHOTOMETRIC_RGB;
+  return false;
+}
+
+
+
+bool TIFFJPEGTiles::passthrough( TIFF* tiff, uint32 tw, uint32 th )
+{
+  uint32 w = 0, h = 0;
+  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &w );
+  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &h );
+  return w == tw && h == th && jpeg( tiff );
+}
+
+
+
+vector<uint8_t> TIFFJPEGTiles::header( TIFF* tiff )
+{
+  uint16 photometric = 0;
+  uint32 count = 0;
+  uint8_t* tables = NULL;
+
+  vector<uint8_t> bytes;
+  bytes.push_back( 0xFF );
+  bytes.push_back( 0xD8 );
+
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &photometric );
+  if( photometric == PHOTOMETRIC_RGB ) bytes.insert( bytes.end(), adobe_rgb, adobe_rgb + sizeof(adobe_rgb) );
+
+  // The tables are themselves a JPEG stream: drop its start and end of image markers
+  if( TIFFGetField( tiff, TIFFTAG_JPEGTABLES, &count, &tables ) && tables && count > 4 &&
+      tables[0] == 0xFF && tables[1] == 0xD8 ){
+    uint32 end = count;
+    if( tables[count-2] == 0xFF && tables[count-1] == 0xD9 ) end -= 2;
+    bytes.insert( bytes.end(), tables + 2, tables + end );
+  }
+
+  return bytes;
+}
+
+
+
+bool TIFFJPEGTiles::complete( uint8_t* buffer, const vector<uint8_t>& header, size_t length, RawTile& rawtile )
+{
+  size_t h = header.size();
+
+  // The tile must begin with a start of image marker, which the header replaces
+  if( length < 2 || buffer[h-2] != 0xFF || buffer[h-1] != 0xD8 ){
+    RawTile::deallocate( buffer, 8, FIXEDPOINT, rawtile.category );
+    return false;
+  }
+  memcpy( buffer, &header[0], h );
+
+  rawtile.freeData();
+  rawtile.data = buffer;
+  rawtile.dataLength = h + length - 2;
+  rawtile.memoryManaged = 1;
+  rawtile.compressionType = JPEG;
+  rawtile.padded = false;
+  return true;
+}
+
+
+
+bool TIFFJPEGTiles::read( TIFF* tiff, ttile_t tile, RawTile& rawtile )
+{
+  toff_t* bytecounts = NULL;
+
+  if( tile >= TIFFNumberOfTiles( tiff ) ) return false;
+  if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &bytecounts ) || !bytecounts ) return false;
+
+  size_t length = bytecounts[tile];
+  if( length < 4 ) return false;
+
+  vector<uint8_t> bytes = header( tiff );
+  size_t h = bytes.size();
+
+  // Read the tile so that its start of image marker is where the header ends
+  uint8_t* buffer = (uint8_t*) RawTile::allocate( h + length - 2, 8, FIXEDPOINT, rawtile.category );
+  tsize_t n = TIFFReadRawTile( tiff, tile, buffer + h - 2, length );
+  if( n <= 0 ){
+    RawTile::deallocate( buffer, 8, FIXEDPOINT, rawtile.category );
+    return false;
+  }
+
+  return complete( buffer, bytes, n, rawtile );
+}
+
+
+
+bool TIFFJPEGTiles::open( const string& path, const vector<int64_t>& widths, const vector<int64_t>& heights,
+			  uint32 tw, uint32 th )
+{
+  close();
+
+  TIFF* tiff = TIFFOpen( path.c_str(), "r" );
+  if( !tiff ) return false;
+
+  levels.assign( widths.size(), Level() );
+  bool any = false;
+
+  // Match each level to the first tiled directory of its size
+  do {
+    uint32 w = 0, h = 0;
+    TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
+    TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
+
+    for( size_t l = 0; l < levels.size(); l++ ){
+      if( widths[l] != w || heights[l] != h || !levels[l].offsets.empty() ) continue;
+      if( !jpeg( tiff ) ) continue;
+
+      toff_t *offsets = NULL, *bytecounts = NULL;
+      ttile_t n = TIFFNumberOfTiles( tiff );
+      if( !TIFFGetField( tiff, TIFFTAG_TILEOFFSETS, &offsets ) || !offsets ) continue;
+      if( !TIFFGetField( tiff, TIFFTAG_TILEBYTECOUNTS, &bytecounts ) || !bytecounts ) continue;
+
+      Level& level = levels[l];
+      uint16 samplesperpixel = 0;
+      TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &level.tile_width );
+      TIFFGetField( tiff, TIFFTAG_TILELENGTH, &level.tile_height );
+      TIFFGetFieldDefaulted( tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel );
+      level.width = w;
+      level.height = h;
+      level.tiles_across = ( w + level.tile_width - 1 ) / level.tile_width;
+      level.channels = samplesperpixel;
+      level.served = ( level.tile_width == tw && level.tile_height == th );
+      level.offsets.assign( offsets, offsets + n );
+      level.lengths.assign( bytecounts, bytecounts + n );
+      level.header = header( tiff );
+      any = true;
+    }
+  } while( TIFFReadDirectory( tiff ) );
+
+  TIFFClose( tiff );
+
+  if( any ) fd = ::open( path.c_str(), O_RDONLY );
+  if( fd < 0 ){
+    levels.clear();
+    return false;
+  }
+  return true;
+}
+
+
+
+void TIFFJPEGTiles::close()
+{
+  if( fd >= 0 ){
+    ::close( fd );
+    fd = -1;
+  }
+  levels.clear();
+}
+
+
+
+bool TIFFJPEGTiles::read( size_t level, size_t tilex, size_t tiley, RawTile& rawtile ) const
+{
+  if( !available( level ) ) return false;
+
+  const Level& lv = levels[level];
+  if( tilex >= lv.tiles_across ) return false;
+  if( ( tilex + 1 ) * lv.tile_width > lv.width || ( tiley + 1 ) * lv.tile_height > lv.height ) return false;
+
+  size_t tile = tiley * lv.tiles_across + tilex;
+  if( tile >= lv.offsets.size() ) return false;
+
+  size_t length = lv.lengths[tile];
+  if( length < 4 ) return false;
+
+  size_t h = lv.header.size();
+
+  uint8_t* buffer = (uint8_t*) RawTile::allocate( h + length - 2, 8, FIXEDPOINT, rawtile.category );
+  ssize_t n = pread( fd, buffer + h - 2, length, (off_t) lv.offsets[tile] );
+  if( n != (ssize_t) length ){
+    RawTile::deallocate( buffer, 8, FIXEDPOINT, rawtile.category );
+    return false;
+  }
+
+  return complete( buffer, lv.header, length, rawtile );
+}
+
+
+
+bool TIFFJPEGTiles::fetch( const Level& level, size_t tile, vector<uint8_t>& bytes ) const
+{
+  if( tile >= level.offsets.size() ) return false;
+
+  size_t length = level.lengths[tile];
+  if( length < 4 ) return false;
+
+  size_t h = level.header.size();
+  bytes.resize( h + length - 2 );
+  ssize_t n = pread( fd, &bytes[h-2], length, (off_t) level.offsets[tile] );
+  if( n != (ssize_t) length || bytes[h-2] != 0xFF || bytes[h-1] != 0xD8 ) return false;
+
+  memcpy( &bytes[0], &level.header[0], h );
+  return true;
+}
+
+
+
+void TIFFJPEGTiles::readScaled( size_t l, unsigned int scale, size_t x, size_t y, size_t w, size_t h,
+				uint8_t* buffer ) const throw (string)
+{
+  if( !indexed( l ) ) throw string( "TIFFJPEGTiles: level is not JPEG compressed" );
+
+  const Level& level = levels[l];
+  size_t channels = level.channels;
+  size_t stride = w * channels;
+
+  // Tile size in the reduced level: JPEG tiles are multiples of 8 pixels
+  size_t tw = level.tile_width / scale;
+  size_t th = level.tile_height / scale;
+  size_t tiles_down = level.offsets.size() / level.tiles_across;
+
+  vector<uint8_t> bytes, pixels;
+
+  for( size_t ty = y / th; ty * th < y + h && ty < tiles_down; ty++ ){
+    for( size_t tx = x / tw; tx * tw < x + w && tx < level.tiles_across; tx++ ){
+
+      size_t left = std::max( x, tx * tw );
+      size_t right = std::min( x + w, ( tx + 1 ) * tw );
+      size_t top = std::max( y, ty * th );
+      size_t bottom = std::min( y + h, ( ty + 1 ) * th );
+
+      // Tiles missing from sparse files are left black
+      if( !fetch( level, ty * level.tiles_across + tx, bytes ) ){
+	for( size_t row = top; row < bottom; row++ ){
+	  memset( buffer + ( row - y ) * stride + ( left - x ) * channels, 0, ( right - left ) * channels );
+	}
+	continue;
+      }
+
+      unsigned int dw, dh;
+      JPEGDecoder::decode( &bytes[0], bytes.size(), scale, level.channels, pixels, dw, dh );
+      if( dw < tw || dh < th ) throw string( "TIFFJPEGTiles: tile smaller than the level's tile size" );
+
+      for( size_t row = top; row < bottom; row++ ){
+	memcpy( buffer + ( row - y ) * stride + ( left - x ) * channels,
+		&pixels[ ( ( row - ty * th ) * dw + ( left - tx * tw ) ) * channels ],
+		( right - left ) * channels );
+      }
+    }
+  }
+}
+
+
+
+size_t TIFFJPEGTiles::getMemoryUsage() const
+{
+  size_t size = sizeof( TIFFJPEGTiles ) + levels.capacity() * sizeof( Level );
+  for( size_t l = 0; l < levels.size(); l++ ){
+    size += ( levels[l].offsets.capacity() + levels[l].lengths.capacity() ) * sizeof( uint64_t );
+    size += levels[l].header.capacity();
+  }
+  return size;
+}
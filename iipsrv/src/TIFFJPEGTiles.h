@@ -0,0 +1,199 @@
+// JPEG Compressed TIFF Tile Reader
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TIFFJPEGTILES_H
+#define _TIFFJPEGTILES_H
+
+
+#include <string>
+#include <vector>
+#include <inttypes.h>
+#include <tiff.h>
+#include <tiffio.h>
+
+#include "RawTile.h"
+
+
+
+/// Reads the JPEG compressed tiles of tiled TIFF files as complete JPEG images
+/** TIFF files hold each JPEG tile as an abbreviated stream, whose quantization
+    and Huffman tables are stored once for the whole directory in the
+    JPEGTables tag. Joining the tables to the bytes of a tile gives a JPEG any
+    client can decode, so a tile already stored as JPEG at our tile size can be
+    sent without being decoded and compressed again. This saves the DCT work
+    and avoids losing quality a second time.
+
+    The static functions read the current directory of a TIFF opened by the
+    caller, as TPTImage does. An instance instead indexes the levels of a TIFF
+    based slide, such as an Aperio SVS read through OpenSlide, when it is
+    opened. It then reads tiles with pread(), so it needs no lock and never
+    changes libtiff directory.
+ */
+class TIFFJPEGTiles {
+
+ private:
+
+  /// What we need to read the tiles of a level
+  struct Level {
+    /// Offset and length in the file of each tile, empty if the level's tiles are not JPEG
+    std::vector<uint64_t> offsets, lengths;
+    /// Bytes preceding each tile's data after its start of image marker
+    std::vector<uint8_t> header;
+    /// Size of the directory in the file
+    uint32 width, height;
+
+    /// Tile size in the file, and the number of tiles across
+    uint32 tile_width, tile_height, tiles_across;
+    /// Samples per pixel
+    unsigned int channels;
+    /// Whether the tiles are the size we serve, so that they can be sent as they are
+    bool served;
+  };
+
+  /// Our levels, largest first
+  std::vector<Level> levels;
+
+  /// File descriptor of the open file, or -1
+  int fd;
+
+
+  /// Return the bytes to put in front of a tile, replacing its start of image marker
+  /** These are a start of image marker, an Adobe marker if the samples are RGB
+      rather than the YCbCr a decoder otherwise assumes, and the directory's tables
+      @param tiff open TIFF positioned at the directory
+   */
+  static std::vector<uint8_t> header( TIFF* tiff );
+
+  /// Read a tile of a level as a complete JPEG into a buffer of our own
+  bool fetch( const Level& level, size_t tile, std::vector<uint8_t>& bytes ) const;
+
+  /// Complete a tile read into a buffer
+  /** @param buffer buffer holding the header followed by the tile, whose data was read to follow the header less 2 bytes
+      @param header header for the tile's directory
+      @param length length of the tile's data
+      @param rawtile tile to which the buffer is given
+      @return false, freeing the buffer, if the data is not a JPEG stream
+   */
+  static bool complete( uint8_t* buffer, const std::vector<uint8_t>& header, size_t length, RawTile& rawtile );
+
+  /// Not copyable, as we own a file descriptor
+  TIFFJPEGTiles( const TIFFJPEGTiles& );
+  TIFFJPEGTiles& operator = ( const TIFFJPEGTiles& );
+
+
+ public:
+
+  /// Constructor
+  TIFFJPEGTiles() : fd( -1 ) {};
+
+  /// Destructor
+  ~TIFFJPEGTiles(){ close(); };
+
+  /// Return whether the tiles of a TIFF's current directory are complete JPEG streams once joined to their tables
+  /** They must be 8 bit JPEG, with 1 greyscale or 3 colour samples per pixel,
+      and tiled in multiples of 8 pixels so that they can be decoded reduced
+      @param tiff open TIFF
+   */
+  static bool jpeg( TIFF* tiff );
+
+  /// Return whether the tiles of a TIFF's current directory can be sent as JPEG without decoding
+  /** They must be JPEG as for jpeg() and the size we serve
+      @param tiff open TIFF
+      @param tw tile width we serve
+      @param th tile height we serve
+   */
+  static bool passthrough( TIFF* tiff, uint32 tw, uint32 th );
+
+  /// Read a tile of a TIFF's current directory as a complete JPEG
+  /** @param tiff open TIFF whose current directory passthrough() accepts
+      @param tile TIFF tile number
+      @param rawtile tile to which the JPEG data is given, with its compression type set to JPEG
+      @return false if the tile could not be read
+   */
+  static bool read( TIFF* tiff, ttile_t tile, RawTile& rawtile );
+
+
+  /// Open a file and index the tiles of those levels which are JPEG compressed
+  /** Each level is matched to the tiled directory of the same size
+      @param path file path
+      @param widths level widths, largest first
+      @param heights level heights, largest first
+      @param tw tile width we serve
+      @param th tile height we serve
+      @return false, leaving the file closed, if no level is JPEG compressed
+   */
+  bool open( const std::string& path, const std::vector<int64_t>& widths, const std::vector<int64_t>& heights,
+	     uint32 tw, uint32 th );
+
+  /// Close the file
+  void close();
+
+  /// Return whether the tiles of a level are JPEG, so that they can be decoded with readScaled()
+  bool indexed( size_t level ) const {
+    return fd >= 0 && level < levels.size() && !levels[level].offsets.empty();
+  };
+
+  /// Return whether the tiles of a level can be sent without decoding
+  bool available( size_t level ) const {
+    return indexed( level ) && levels[level].served;
+  };
+
+  /// Return the samples per pixel of a level for which indexed() is true
+  unsigned int getChannels( size_t level ) const { return levels[level].channels; };
+
+  /// Return the width in the file of a level for which indexed() is true
+  uint32 getWidth( size_t level ) const { return levels[level].width; };
+
+  /// Return the height in the file of a level for which indexed() is true
+  uint32 getHeight( size_t level ) const { return levels[level].height; };
+
+  /// Read a tile of a level as a complete JPEG. May be called from several threads at once
+  /** Edge tiles are padded in the file, so only tiles wholly within the level are read
+      @param level level for which available() is true
+      @param tilex tile column in the file's grid of tiles
+      @param tiley tile row in the file's grid of tiles
+      @param rawtile tile to which the JPEG data is given, with its compression type set to JPEG
+      @return false if the tile could not be read
+   */
+  bool read( size_t level, size_t tilex, size_t tiley, RawTile& rawtile ) const;
+
+  /// Decode a region of a level reduced in size in the DCT domain. May be called from several threads at once
+  /** Tiles missing from the file are left black
+      @param level level for which indexed() is true
+      @param scale reduction in each direction: 1, 2, 4 or 8
+      @param x left of the region in pixels of the reduced level
+      @param y top of the region in pixels of the reduced level
+      @param w region width
+      @param h region height
+      @param buffer output of w * h pixels, each of the level's number of channels
+   */
+  void readScaled( size_t level, unsigned int scale, size_t x, size_t y, size_t w, size_t h,
+		   uint8_t* buffer ) const throw (std::string);
+
+  /// Return the memory in bytes held by our tile index
+  size_t getMemoryUsage() const;
+
+  /// Return the number of file descriptors we hold open
+  unsigned int getDescriptorUsage() const { return fd >= 0 ? 1 : 0; };
+
+};
+
+
+#endif
@@ -22,12 +22,13 @@
 
 
 #include "TPTImage.h"
+#include "TIFFJPEGTiles.h"
 #include <sstream>
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <cstdio>
-extern std::ofstream logfile;
+extern thread_local std::ofstream logfile;
 
 #include "TileManager.h"
 
@@ -205,11 +206,16 @@ void TPTImage::closeImage()
 }
 
 
-RawTilePtr TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+size_t TPTImage::getMemoryUsage()
+{
+  size_t size = IIPImage::getMemoryUsage() + sizeof( TPTImage ) - sizeof( IIPImage );
+  if( tiff && tile_buf ) size += TIFFTileSize( tiff );
+  return size;
+}
+
+
+void TPTImage::setDirectory( int seq, int ang, unsigned int res ) throw (file_error)
 {
-  uint32 im_width, im_height, tw, th, ntlx, ntly;
-  uint32 rem_x, rem_y;
-  uint16 colour;
   string filename;
 
 
@@ -254,6 +260,20 @@ RawTilePtr TPTImage::getTile( int seq, int ang, unsigned int res, int layers, un
     throw file_error( "TIFFSetDirectory failed" );
   }
 
+}
+
+
+RawTilePtr TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+{
+  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint32 rem_x, rem_y;
+  uint16 colour;
+  string filename;
+
+
+  // Open the image and move to the directory for this resolution
+  setDirectory( seq, ang, res );
+
 
   // Check that a valid tile number was given  
   if( tile >= TIFFNumberOfTiles( tiff ) ) {
@@ -347,3 +367,36 @@ RawTilePtr TPTImage::getTile( int seq, int ang, unsigned int res, int layers, un
 
 }
 
+
+
+
+RawTilePtr TPTImage::getCompressedTile( int seq, int ang, unsigned int res, int layers, unsigned int tile, CompressionType c ) throw (file_error)
+{
+  uint32 im_width, im_height;
+
+  if( c != JPEG ) return RawTilePtr();
+
+  setDirectory( seq, ang, res );
+
+  if( tile >= TIFFNumberOfTiles( tiff ) ) return RawTilePtr();
+
+  // Only tiles stored as JPEG at our tile size
+  if( !TIFFJPEGTiles::passthrough( tiff, tile_width, tile_height ) ) return RawTilePtr();
+
+  // Edge tiles are padded in the file, and JPEG cannot be cropped without decoding
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+  uint32 ntlx = (im_width + tile_width - 1) / tile_width;
+  if( ( (tile % ntlx) + 1 ) * tile_width > im_width ) return RawTilePtr();
+  if( ( (tile / ntlx) + 1 ) * tile_height > im_height ) return RawTilePtr();
+
+  RawTilePtr rawtile( new RawTile( tile, res, seq, ang, tile_width, tile_height, channels, bpc ) );
+  if( !TIFFJPEGTiles::read( tiff, (ttile_t) tile, *rawtile ) ) return RawTilePtr();
+
+  rawtile->filename = getImagePath();
+  rawtile->timestamp = timestamp;
+  rawtile->sampleType = sampleType;
+
+  return( rawtile );
+
+}
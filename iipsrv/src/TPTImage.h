@@ -42,6 +42,13 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Open the image if necessary and move to the directory of a resolution
+  /** @param x horizontal sequence angle
+      @param y vertical sequence angle
+      @param r resolution
+   */
+  void setDirectory( int x, int y, unsigned int r ) throw (file_error);
+
 
  public:
 
@@ -93,6 +100,12 @@ class TPTImage : public IIPImage {
   /// Overloaded function for closing a TIFF image
   void closeImage();
 
+  /// Add our tile buffer to the memory usage
+  size_t getMemoryUsage();
+
+  /// An open TIFF holds a single descriptor
+  unsigned int getDescriptorUsage(){ return tiff ? 1 : 0; };
+
   /// Overloaded function for getting a particular tile
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -102,6 +115,13 @@ class TPTImage : public IIPImage {
    */
   virtual RawTilePtr getTile( int x, int y, unsigned int r, int l, unsigned int t ) throw (file_error);
 
+  /// Return a tile stored as JPEG at our tile size without decoding it
+  /** Parameters as for getTile()
+      @param c compression type wanted: only JPEG tiles are passed through
+      @return the JPEG tile, or an empty pointer if it must be decoded
+   */
+  virtual RawTilePtr getCompressedTile( int x, int y, unsigned int r, int l, unsigned int t, CompressionType c ) throw (file_error);
+
 };
 
 
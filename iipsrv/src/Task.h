@@ -35,6 +35,7 @@
 #include "Writer.h"
 #include "Cache.h"
 #include "Watermark.h"
+#include "Prefetcher.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
 #endif
@@ -78,6 +79,7 @@ struct Session {
 
   imageCacheMapType *imageCache;
   TileCache* tileCache;
+  Prefetcher* prefetcher;
 
 #ifdef DEBUG
   FileWriter* out;
@@ -0,0 +1,226 @@
+// Tile Cache Key
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILEKEY_H
+#define _TILEKEY_H
+
+
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <inttypes.h>
+
+#include "RawTile.h"
+
+
+/// Fixed size key identifying a tile in the tile cache
+/** Image paths are interned to small integers so that keys can be built,
+    hashed and compared without any string handling or heap allocation.
+    The hash is computed once on construction.
+ */
+struct TileKey {
+
+  /// An interned image path
+  /** Entries are created by TileKey::intern() and never change or move, so
+      they can be read without taking the registry lock
+   */
+  struct Image {
+
+    /// Interned id, starting at 1
+    uint32_t id;
+
+    /// Hash of the path - see TileKey::hashPath()
+    uint64_t hash;
+
+    /// Second, independent hash of the path - see TileKey::checkPath()
+    uint64_t check;
+
+    /// Image path
+    std::string path;
+
+  };
+
+
+  /// Interned image id - see TileKey::intern()
+  uint32_t image;
+
+  /// Interned image entry, or 0 for keys not bound to an image
+  const Image* source;
+
+  /// Resolution number
+  int32_t resolution;
+
+  /// Tile number
+  int32_t tile;
+
+  /// Horizontal and vertical sequence numbers
+  int32_t hSequence, vSequence;
+
+  /// Compression type
+  uint8_t compression;
+
+  /// Compression quality
+  uint8_t quality;
+
+  /// Precomputed hash of the fields above
+  uint64_t hash;
+
+
+  /// Default constructor - an empty key matching no tile
+  TileKey() : image(0), source(0), resolution(0), tile(0), hSequence(0), vSequence(0),
+    compression(0), quality(0), hash(0) {};
+
+  /// Constructor
+  /** @param i interned image, or 0 for a key not bound to an image
+      @param r resolution number
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param c compression type
+      @param q compression quality
+   */
+  TileKey( const Image* i, int r, int t, int h, int v, CompressionType c, int q ) :
+    image(i ? i->id : 0), source(i), resolution(r), tile(t), hSequence(h), vSequence(v),
+    compression((uint8_t)c), quality((uint8_t)q)
+  {
+    uint64_t a = ((uint64_t)image << 32) | (uint32_t)tile;
+    uint64_t b = ((uint64_t)(uint16_t)resolution << 48) | ((uint64_t)(uint16_t)hSequence << 32) |
+      ((uint64_t)(uint16_t)vSequence << 16) | ((uint64_t)compression << 8) | quality;
+    hash = mix( a ^ mix( b ) );
+  };
+
+
+  bool operator == ( const TileKey& k ) const {
+    return hash == k.hash && image == k.image && tile == k.tile && resolution == k.resolution &&
+      hSequence == k.hSequence && vSequence == k.vSequence &&
+      compression == k.compression && quality == k.quality;
+  };
+
+  bool operator != ( const TileKey& k ) const { return !(*this == k); };
+
+  /// Arbitrary but consistent ordering for use in ordered containers
+  bool operator < ( const TileKey& k ) const {
+    if( hash != k.hash ) return hash < k.hash;
+    if( image != k.image ) return image < k.image;
+    if( tile != k.tile ) return tile < k.tile;
+    if( resolution != k.resolution ) return resolution < k.resolution;
+    if( hSequence != k.hSequence ) return hSequence < k.hSequence;
+    if( vSequence != k.vSequence ) return vSequence < k.vSequence;
+    if( compression != k.compression ) return compression < k.compression;
+    return quality < k.quality;
+  };
+
+
+  /// Return the interned entry of an image path, creating a new one if necessary
+  /** Ids start at 1 and entries are never released, so only paths of images
+      which have been opened should be interned. This takes a lock, so callers
+      should keep the entry rather than interning the same path repeatedly
+      @param path image path
+   */
+  static const Image* intern( const std::string& path ){
+    std::lock_guard<std::mutex> guard( registryMutex() );
+    std::unordered_map<std::string,const Image*>& ids = registry();
+    std::unordered_map<std::string,const Image*>::iterator i = ids.find( path );
+    if( i != ids.end() ) return i->second;
+    Image image;
+    image.id = entries().size() + 1;
+    image.hash = hashPath( path );
+    image.check = checkPath( path );
+    image.path = path;
+    entries().push_back( image );
+    ids[path] = &entries().back();
+    return &entries().back();
+  };
+
+
+  /// 64 bit FNV-1a hash of an image path
+  /** Interned ids are only meaningful within a process. Caches shared between
+      processes identify images by this hash of their path instead
+   */
+  static uint64_t hashPath( const std::string& path ){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for( size_t i = 0; i < path.size(); i++ ){
+      h ^= (unsigned char) path[i];
+      h *= 0x100000001b3ULL;
+    }
+    return h;
+  };
+
+
+  /// Second 64 bit hash of an image path, independent of hashPath()
+  /** Stored alongside the first so that two paths whose hashes collide are
+      still told apart
+   */
+  static uint64_t checkPath( const std::string& path ){
+    uint64_t h = path.size();
+    for( size_t i = 0; i < path.size(); i++ ){
+      h = mix( h ^ (unsigned char) path[i] ) + 0x9e3779b97f4a7c15ULL;
+    }
+    return mix( h );
+  };
+
+
+ private:
+
+  /// 64 bit finaliser from MurmurHash3
+  static uint64_t mix( uint64_t k ){
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  };
+
+  static std::unordered_map<std::string,const Image*>& registry(){
+    static std::unordered_map<std::string,const Image*> ids;
+    return ids;
+  };
+
+  /// A deque, as its elements stay in place as it grows
+  static std::deque<Image>& entries(){
+    static std::deque<Image> e;
+    return e;
+  };
+
+  static std::mutex& registryMutex(){
+    static std::mutex m;
+    return m;
+  };
+
+};
+
+
+/// Hash functor returning the precomputed key hash
+struct TileKeyHash {
+  size_t operator() ( const TileKey& k ) const { return (size_t) k.hash; };
+};
+
+
+namespace std {
+  template <>
+    struct hash<TileKey> {
+      size_t operator() ( const TileKey& k ) const { return (size_t) k.hash; };
+    };
+}
+
+
+#endif
@@ -25,11 +25,27 @@
 
 #include <cmath>
 #include "TileManager.h"
+#include "SingleFlight.h"
+#include "Environment.h"
 
 
 using namespace std;
 
 
+/// Tiles being built, shared by all worker threads so that concurrent requests
+/// for the same tile decode and encode it only once
+static SingleFlight<TileKey, RawTilePtr> tileFlights;
+
+
+bool TileManager::passthrough = false;
+int TileManager::passthroughQuality = JPEG_QUALITY;
+
+
+/// Quality filed against tiles sent as stored in the image file, whose own
+/// quality is unknown, so that no request for a given quality finds them
+static const int STORED_QUALITY = -1;
+
+
 
 RawTilePtr TileManager::getNewTile( int resolution, int tile, int xangle, int yangle, int layers ){
 
@@ -40,8 +56,20 @@ RawTilePtr TileManager::getNewTile( int resolution, int tile, int xangle, int ya
 
   RawTilePtr ttt;
 
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Get our raw tile from the IIPImage image object. Image objects are shared between
+  // worker threads, so serialise access to decoders that cannot run concurrently
+  {
+    unique_lock<mutex> lock( image->decoderMutex, defer_lock );
+    if( !image->concurrentDecoding() ) lock.lock();
+    Timer cost_timer;
+    cost_timer.start();
+    ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+    // Record the decode time for cost-aware cache eviction unless the image has already done so
+    if( ttt->cost == 0 ) ttt->cost = cost_timer.getTime();
+    // Decoders may return a view of an internal buffer which the next decode
+    // overwrites, so the tile must own its data before it is cached
+    ttt->makeWritable();
+  }
 
 
   // Apply the watermark if we have one.
@@ -77,6 +105,43 @@ RawTilePtr TileManager::getNewTile( int resolution, int tile, int xangle, int ya
 
 
 
+RawTilePtr TileManager::getStoredTile( int resolution, int tile, int xangle, int yangle, int layers ){
+
+  // Watermarks are applied to the decoded pixels, and a QLT asking for a
+  // quality other than the server's own must be compressed to that quality
+  if( !passthrough || jpeg->getQuality() != passthroughQuality ||
+      (watermark && watermark->isSet()) ) return RawTilePtr();
+
+  RawTilePtr ttt = tileCache->getObject( TileCache::getIndex( image->getImageId(), resolution, tile,
+							       xangle, yangle, JPEG, STORED_QUALITY ) );
+  if( ttt ) return ttt;
+
+  {
+    unique_lock<mutex> lock( image->decoderMutex, defer_lock );
+    if( !image->concurrentDecoding() ) lock.lock();
+    Timer cost_timer;
+    cost_timer.start();
+    ttt = image->getCompressedTile( xangle, yangle, resolution, layers, tile, JPEG );
+    if( !ttt ) return ttt;
+    if( ttt->cost == 0 ) ttt->cost = cost_timer.getTime();
+  }
+
+  // Cache the tile as stored rather than under the quality requested
+  ttt->quality = STORED_QUALITY;
+
+  if( loglevel >= 2 ) insert_timer.start();
+  tileCache->insert( ttt );
+  if( loglevel >= 2 ) *logfile << "TileManager :: JPEG tile sent as stored in the image file, "
+			       << ttt->dataLength << " bytes" << endl
+			       << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
+			       << " microseconds" << endl;
+
+  return ttt;
+
+}
+
+
+
 void TileManager::crop( RawTilePtr ttt ){
 
   int tw = image->getTileWidth();
@@ -90,6 +155,7 @@ void TileManager::crop( RawTilePtr ttt ){
 
   // Create a new buffer, fill it with the old data, then copy
   // back the cropped part into the RawTilePtr buffer
+  ttt->makeWritable();
   int len = tw * th * ttt->channels * ttt->bpc/8;
   unsigned char* buffer = (unsigned char*) malloc( len );
   unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
@@ -117,15 +183,43 @@ void TileManager::crop( RawTilePtr ttt ){
 // returns cache instance,  does not incur a copy.
 RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
 
+  // Time the tile retrieval
+  if( loglevel >= 2 ) tile_timer.start();
+
+  // Return the tile straight away if it is cached in the form requested
+  TileKey key = TileCache::getIndex( image->getImageId(), resolution, tile, xangle, yangle,
+				     c, (c == JPEG) ? jpeg->getQuality() : 0 );
+  RawTilePtr rawtile = tileCache->getObject( key );
+  if( rawtile && rawtile->timestamp >= image->timestamp ){
+    if( loglevel >= 2 ) *logfile << "TileManager :: Cache Hit for resolution: " << resolution
+				 << ", tile: " << tile << endl
+				 << "TileManager :: Total Tile Access Time: "
+				 << tile_timer.getTime() << " microseconds" << endl;
+    return rawtile;
+  }
+
+  // Otherwise build it. Requests for the same tile arriving while it is being
+  // built wait for the result rather than decoding the tile again
+  bool shared = false;
+  rawtile = tileFlights.run( key, [&](){ return this->buildTile( resolution, tile, xangle, yangle, layers, c ); }, &shared );
+
+  if( shared && loglevel >= 2 ){
+    *logfile << "TileManager :: Tile built by a concurrent request. Total Tile Access Time: "
+	     << tile_timer.getTime() << " microseconds" << endl;
+  }
+
+  return rawtile;
+}
+
+
+
+RawTilePtr TileManager::buildTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
+
   RawTilePtr rawtile;
   string tileCompression;
   string compName;
 
 
-  // Time the tile retrieval
-  if( loglevel >= 2 ) tile_timer.start();
-
-
   /* Try to get this tile from our cache first as a JPEG, then uncompressed
      Otherwise decode one from the source image and add it to the cache
    */
@@ -133,13 +227,15 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
     {
     // TCP: automatically fall through to the next case if not break.
     case JPEG:
-      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImageId(), resolution, tile,
                                          xangle, yangle, JPEG, jpeg->getQuality() ) ) ) ) break;
+      // A JPEG tile stored in the file is cheaper to send than a cached raw tile is to compress
+      if( (rawtile = this->getStoredTile( resolution, tile, xangle, yangle, layers )) ) break;
     case DEFLATE:
-      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImageId(), resolution, tile,
                                          xangle, yangle, DEFLATE, 0 ) ) ) ) break;
     case UNCOMPRESSED:
-      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImageId(), resolution, tile,
                                          xangle, yangle, UNCOMPRESSED, 0 ) ) ) ) break;
     default: 
       break;
@@ -186,14 +282,28 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
 			       << tileCache->getNumElements() << " tiles, "
 			       << tileCache->getMemorySize() << " MB" << endl;
 
+  // Report the hit ratio of each cache tier and the time spent retrieving tiles from the lower tiers
+  if( loglevel >= 3 ){
+    TileCache::TierStatistics stats = tileCache->getTierStatistics();
+    if( stats.lookups > 0 ){
+      *logfile << "TileManager :: Tile cache hit ratio: memory " << (float) stats.hotHits / stats.lookups
+	       << ", compressed " << (float) stats.coldHits / stats.lookups
+	       << ", disk " << (float) stats.diskHits / stats.lookups << endl
+	       << "TileManager :: Tile cache mean decompression time: "
+	       << ( stats.coldHits ? stats.coldTime / stats.coldHits : 0 ) << " microseconds, disk read time: "
+	       << ( stats.diskHits ? stats.diskTime / stats.diskHits : 0 ) << " microseconds" << endl;
+    }
+  }
+
 
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
   if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
 
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTilePtr ttt(new RawTile( *rawtile ));
+    // Rawtile is the cache's instance, so compress a view of it. Cropping copies the data,
+    // otherwise the compressor writes its output to a new buffer
+    RawTilePtr ttt = RawTile::share( rawtile );
 
     // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
     if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
@@ -204,9 +314,11 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
 	this->crop( ttt );
       }
 
-      if( loglevel >=2 ) compression_timer.start();
+      compression_timer.start();
       unsigned int oldlen = rawtile->dataLength;
       unsigned int newlen = jpeg->Compress( ttt );
+      // Rebuilding the compressed tile costs the compression as well as the raw tile
+      ttt->cost += compression_timer.getTime();
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl
@@ -215,6 +327,7 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
 
       // Add our compressed tile to the cache
       if( loglevel >= 2 ) insert_timer.start();
+      ttt->trim();
       tileCache->insert( ttt );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
@@ -239,7 +352,8 @@ RawTilePtr TileManager::getTile( int resolution, int tile, int xangle, int yangl
 //if( loglevel >= 2 ) *logfile << "TileManager :: getTile :: got it " << endl;
 
 
-  return RawTilePtr(new RawTile(*rawtile));  // returns copy of cache instance
+  // Return a view of the cache instance - the data is only copied if the caller modifies it
+  return RawTile::share( rawtile );
 
 }
 
@@ -251,6 +365,8 @@ RawTilePtr TileManager::getRegion( unsigned int res, int seq, int ang, int layer
     if( loglevel >= 3 ){
       *logfile << "TileManager getRegion :: requesting region directly from image" << endl;
     }
+    unique_lock<mutex> lock( image->decoderMutex, defer_lock );
+    if( !image->concurrentDecoding() ) lock.lock();
     return image->getRegion( seq, ang, res, layers, x, y, width, height );
   }
 
@@ -315,12 +431,10 @@ RawTilePtr TileManager::getRegion( unsigned int res, int seq, int ang, int layer
   RawTilePtr region(new RawTile( 0, res, seq, ang, width, height, channels, bpc ));
   region->dataLength = width * height * channels * bpc/8;
   region->sampleType = sampleType;
+  region->category = ALLOC_REGIONS;
 
   // Allocate memory for the region
-  if( bpc == 8 ) region->data = new unsigned char[width*height*channels];
-  else if( bpc == 16 ) region->data = new unsigned short[width*height*channels];
-  else if( bpc == 32 && sampleType == FIXEDPOINT ) region->data = new int[width*height*channels];
-  else if( bpc == 32 && sampleType == FLOATINGPOINT ) region->data = new float[width*height*channels];
+  region->data = region->allocate( region->dataLength );
 
   unsigned int current_height = 0;
 
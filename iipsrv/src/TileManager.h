@@ -65,6 +65,25 @@ class TileManager{
   RawTilePtr getNewTile( int resolution, int tile, int xangle, int yangle, int layers);
 
 
+  /// Build a tile which is not in the cache in the requested form
+  /**
+   *  Checks the cache again as the tile may have been added since our caller
+   *  looked. Only called by one thread at a time for each tile.
+   *  Parameters as for getTileInternal()
+   *  @return RawTile pointer, points to what's in CACHE
+   */
+  RawTilePtr buildTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
+
+
+  /// Return a tile as stored in the image file if it is already a JPEG we can send as is
+  /**
+   *  Only used for requests at the server's default quality, and the tile is cached as stored
+   *  rather than under that quality. Parameters as for getTileInternal()
+   *  @return RawTile pointer, points to what's in CACHE, or an empty pointer if the tile must be decoded
+   */
+  RawTilePtr getStoredTile( int resolution, int tile, int xangle, int yangle, int layers );
+
+
   /// Crop a tile to remove padding
   /** @param t pointer to tile to crop, no copy.
    */
@@ -74,6 +93,14 @@ class TileManager{
  public:
 
 
+  /// Whether JPEG tiles stored in image files are sent without decoding and compressing them again
+  static bool passthrough;
+
+
+  /// JPEG quality of the requests that may be sent stored tiles: the server's default
+  static int passthroughQuality;
+
+
   /// Constructor
   /**
    * @param tc pointer to tile cache object
@@ -121,7 +148,7 @@ class TileManager{
    *  @param yangle vertical sequence number
    *  @param layers number of quality layers within image to decode
    *  @param c CompressionType
-   *  @return RawTile pointer.  A COPY of what's in TileCache
+   *  @return RawTile pointer.  A read-only VIEW of what's in TileCache, copied on write
    */
   RawTilePtr getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
@@ -0,0 +1,238 @@
+// Member functions for TilePool.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TilePool.h"
+
+#include <atomic>
+#include <mutex>
+#include <sys/mman.h>
+
+
+using namespace std;
+
+
+// Slab size and alignment - the size of a transparent huge page on x86-64
+#define TILEPOOL_SLAB_SHIFT 21
+#define TILEPOOL_SLAB ((size_t)1 << TILEPOOL_SLAB_SHIFT)
+
+// Smallest and largest size classes
+#define TILEPOOL_MIN 4096
+#define TILEPOOL_MAX (1024*1024)
+
+// Four classes for each doubling from TILEPOOL_MIN to TILEPOOL_MAX, plus TILEPOOL_MAX itself
+#define TILEPOOL_CLASSES 33
+
+
+
+/// A size class: its free buffers form a list linked through the buffers themselves
+struct PoolClass {
+  size_t size;
+  mutex lock;
+  void* free;
+};
+
+
+static PoolClass classes[TILEPOOL_CLASSES];
+
+// Zero while the pool is disabled. Only written by configure()
+static size_t capacity = 0;
+static bool hugePages = false;
+
+// Slab registry: an insert-only hash table of slab number and class index + 1,
+// packed as (base >> TILEPOOL_SLAB_SHIFT) << 6 | class + 1. Zero is empty
+static atomic<uintptr_t>* registry = NULL;
+static size_t registryMask = 0;
+
+// Protects reservation of slabs and insertion into the registry
+static mutex slabLock;
+
+static atomic<size_t> reserved( 0 ), inUse( 0 );
+static atomic<uint64_t> allocations( 0 ), fallbacks( 0 );
+
+
+
+/// Return the class index for a buffer size or -1 if the size is not pooled.
+/// Buffers much smaller than our smallest class are left to the heap
+static int classFor( size_t bytes ){
+  if( bytes < TILEPOOL_MIN / 2 || bytes > TILEPOOL_MAX ) return -1;
+  int c = 0;
+  while( classes[c].size < bytes ) c++;
+  return c;
+}
+
+
+/// Return the first registry slot to probe for a slab
+static size_t registryHash( uintptr_t slab ){
+  return (size_t) ( ( (uint64_t) slab * 0x9E3779B97F4A7C15ULL ) >> 32 ) & registryMask;
+}
+
+
+/// Map a new slab aligned to its size, or return NULL
+static void* mapSlab(){
+
+  // Over-allocate then trim to get an aligned slab
+  size_t length = 2 * TILEPOOL_SLAB;
+  void* mapping = mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( mapping == MAP_FAILED ) return NULL;
+
+  uintptr_t start = (uintptr_t) mapping;
+  uintptr_t base = ( start + TILEPOOL_SLAB - 1 ) & ~( (uintptr_t) TILEPOOL_SLAB - 1 );
+  if( base > start ) munmap( mapping, base - start );
+  if( start + length > base + TILEPOOL_SLAB ) munmap( (void*) ( base + TILEPOOL_SLAB ), start + length - base - TILEPOOL_SLAB );
+
+#ifdef MADV_HUGEPAGE
+  if( hugePages ) madvise( (void*) base, TILEPOOL_SLAB, MADV_HUGEPAGE );
+#endif
+
+  return (void*) base;
+}
+
+
+
+void TilePool::configure( size_t maxBytes, bool huge ){
+
+  if( registry || maxBytes < TILEPOOL_SLAB ) return;
+
+  // Build the size classes
+  size_t step = TILEPOOL_MIN;
+  int c = 0;
+  while( step < TILEPOOL_MAX ){
+    for( int i = 4; i < 8; i++ ) classes[c++].size = step * i / 4;
+    step *= 2;
+  }
+  classes[c].size = TILEPOOL_MAX;
+  for( c = 0; c < TILEPOOL_CLASSES; c++ ) classes[c].free = NULL;
+
+  // Size the registry to stay at most half full
+  size_t slabs = maxBytes / TILEPOOL_SLAB;
+  size_t slots = 16;
+  while( slots < 2 * slabs ) slots *= 2;
+  registry = new atomic<uintptr_t>[slots];
+  for( size_t i = 0; i < slots; i++ ) registry[i] = 0;
+  registryMask = slots - 1;
+
+  hugePages = huge;
+  capacity = slabs * TILEPOOL_SLAB;
+}
+
+
+
+void* TilePool::allocate( size_t bytes ){
+
+  if( capacity == 0 ) return NULL;
+
+  int c = classFor( bytes );
+  if( c < 0 ){
+    fallbacks++;
+    return NULL;
+  }
+
+  PoolClass& pool = classes[c];
+  lock_guard<mutex> guard( pool.lock );
+
+  if( !pool.free ){
+
+    // Reserve and register a new slab for this class
+    void* slab = NULL;
+    {
+      lock_guard<mutex> slabGuard( slabLock );
+      if( reserved + TILEPOOL_SLAB <= capacity && (slab = mapSlab()) ){
+	uintptr_t number = (uintptr_t) slab >> TILEPOOL_SLAB_SHIFT;
+	size_t i = registryHash( number );
+	while( registry[i] != 0 ) i = ( i + 1 ) & registryMask;
+	registry[i] = ( number << 6 ) | (uintptr_t) ( c + 1 );
+	reserved += TILEPOOL_SLAB;
+      }
+    }
+    if( !slab ){
+      fallbacks++;
+      return NULL;
+    }
+
+    // Carve it into buffers
+    size_t n = TILEPOOL_SLAB / pool.size;
+    for( size_t i = n; i-- > 0; ){
+      void* buffer = (unsigned char*) slab + i * pool.size;
+      *(void**) buffer = pool.free;
+      pool.free = buffer;
+    }
+  }
+
+  void* buffer = pool.free;
+  pool.free = *(void**) buffer;
+
+  allocations++;
+  inUse += pool.size;
+  return buffer;
+}
+
+
+
+/// Return the class of the slab holding a buffer, or NULL if the buffer is not ours
+static PoolClass* slabClass( const void* buffer ){
+
+  if( !registry || !buffer ) return NULL;
+
+  uintptr_t number = (uintptr_t) buffer >> TILEPOOL_SLAB_SHIFT;
+  size_t i = registryHash( number );
+  uintptr_t entry;
+  while( (entry = registry[i]) != 0 && ( entry >> 6 ) != number ) i = ( i + 1 ) & registryMask;
+  if( entry == 0 ) return NULL;
+
+  return &classes[ ( entry & 63 ) - 1 ];
+}
+
+
+
+bool TilePool::release( void* buffer ){
+
+  PoolClass* found = slabClass( buffer );
+  if( !found ) return false;
+
+  PoolClass& pool = *found;
+  {
+    lock_guard<mutex> guard( pool.lock );
+    *(void**) buffer = pool.free;
+    pool.free = buffer;
+  }
+
+  inUse -= pool.size;
+  return true;
+}
+
+
+
+size_t TilePool::usableSize( const void* buffer ){
+  PoolClass* pool = slabClass( buffer );
+  return pool ? pool->size : 0;
+}
+
+
+
+TilePool::Statistics TilePool::statistics(){
+  Statistics s;
+  s.allocations = allocations;
+  s.fallbacks = fallbacks;
+  s.inUse = inUse;
+  s.reserved = reserved;
+  s.capacity = capacity;
+  s.hugePages = hugePages;
+  return s;
+}
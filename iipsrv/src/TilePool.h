@@ -0,0 +1,91 @@
+// Pooled Tile Buffer Allocator
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILEPOOL_H
+#define _TILEPOOL_H
+
+
+#include <cstddef>
+#include <inttypes.h>
+
+
+
+/// Pool of aligned buffers for tile data
+/** Tile sized buffers are carved from 2MB slabs, one set of slabs per size
+    class, and freed buffers go back to a free list for their class rather than
+    to the heap. Size classes run from 4kB to 1MB in quarter steps between
+    powers of two, so 256x256 RGB and RGBA tiles each have an exact class.
+    Buffers are aligned to 64 bytes, and slabs to their own size, so that they
+    may be backed by transparent huge pages.
+
+    Slabs are never returned to the system. Once the configured number of bytes
+    is reserved, or for sizes outside the classes, allocate() returns NULL and
+    the caller falls back to the heap. release() recognises pool buffers by
+    their slab, so buffers from either source can be passed to it.
+
+    The pool is disabled until configure() is called, which must happen before
+    any other threads start.
+ */
+class TilePool {
+
+ public:
+
+  /// Usage statistics
+  struct Statistics {
+    uint64_t allocations;    // Buffers served from the pool
+    uint64_t fallbacks;      // Requests the pool could not serve
+    size_t inUse;            // Bytes in buffers currently allocated from the pool
+    size_t reserved;         // Bytes in slabs
+    size_t capacity;         // Maximum bytes in slabs
+    bool hugePages;          // Whether slabs are advised to use huge pages
+  };
+
+
+  /// Enable the pool
+  /** @param maxBytes maximum number of bytes to reserve for slabs, 0 to disable the pool
+      @param hugePages whether to ask for slabs to be backed by transparent huge pages
+   */
+  static void configure( size_t maxBytes, bool hugePages );
+
+  /// Allocate a buffer from the pool
+  /** @param bytes buffer size
+      @return 64 byte aligned buffer, or NULL if the pool cannot serve this size
+   */
+  static void* allocate( size_t bytes );
+
+  /// Return a buffer to the pool
+  /** @param buffer buffer, which need not have come from the pool
+      @return true if the buffer belonged to the pool and has been freed
+   */
+  static bool release( void* buffer );
+
+  /// Return the number of bytes actually reserved for a pool buffer
+  /** @param buffer buffer, which need not have come from the pool
+      @return size of the buffer's class, or 0 if it does not belong to the pool
+   */
+  static size_t usableSize( const void* buffer );
+
+  /// Return usage statistics
+  static Statistics statistics();
+
+};
+
+
+#endif
@@ -0,0 +1,629 @@
+// Member functions for TileStore.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TileStore.h"
+
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+
+using namespace std;
+
+
+// Identifies an initialised store: "IIPTILE" plus a layout version
+#define TILESTORE_MAGIC 0x49495054494c4502ULL
+
+// Number of index slots probed for each key
+#define TILESTORE_PROBE 8
+
+// Average tile size used to size the index. We allocate two slots per tile
+#define TILESTORE_TILE_SIZE 8192
+
+// Alignment of the index, arena and records
+#define TILESTORE_ALIGN 64
+
+
+
+/// Store header at the start of the mapping
+struct TileStore::Header {
+  uint64_t magic;            // Set last once the store is initialised
+  uint64_t size;             // Size of the whole mapping
+  uint64_t slotCount;        // Number of index slots - a power of two
+  uint64_t arenaOffset;      // Offset of the arena from the start of the mapping
+  uint64_t arenaSize;        // Size of the arena
+  pthread_mutex_t mutex;     // Process-shared lock protecting everything below
+  uint64_t head;             // Where the next record is written
+  uint64_t tail;             // Oldest record
+  uint64_t end;              // End of the records at the top of the arena when wrapped
+  uint64_t wrapped;          // Whether the live records wrap around the end of the arena
+  uint64_t sequence;         // Last record sequence number handed out
+  uint64_t records;          // Records in the ring, including superseded ones
+  uint64_t entries;          // Records reachable from the index
+  uint64_t hits, misses, inserts, evictions;
+};
+
+
+/// Index slot. A slot is free if its sequence number is 0
+struct TileStore::Slot {
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t sequence;
+};
+
+
+/// Record header in the arena, followed by the tile data
+struct TileStore::Record {
+  uint64_t sequence;
+  uint64_t size;             // Size of the whole record including padding
+  uint64_t image;            // Path hashes of the image - see TileKey::Image
+  uint64_t check;
+  uint64_t slot;
+  int64_t timestamp;
+  int32_t resolution, tile, hSequence, vSequence;
+  int32_t compressionType, quality;
+  int32_t dataLength;
+  uint32_t width, height;
+  int32_t channels, bpc;
+  int32_t sampleType;
+  uint32_t cost;
+  uint32_t padded;
+};
+
+
+
+static inline uint64_t align( uint64_t n ){
+  return ( n + TILESTORE_ALIGN - 1 ) & ~((uint64_t) TILESTORE_ALIGN - 1);
+}
+
+
+/// Hash of the image path hash and the process independent parts of a tile key
+static inline uint64_t storeHash( const TileKey::Image& image, const TileKey& key ){
+  uint64_t k = image.hash ^ ( TileKey( 0, key.resolution, key.tile, key.hSequence, key.vSequence,
+				  (CompressionType) key.compression, key.quality ).hash * 0x9e3779b97f4a7c15ULL );
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  return k;
+}
+
+
+
+TileStore::~TileStore()
+{
+  if( mapping ){
+    // Start writing back a file store, though the kernel would do so anyway
+    if( lockFile >= 0 ) msync( mapping, mappingSize, MS_ASYNC );
+    munmap( mapping, mappingSize );
+  }
+  if( lockFile >= 0 ) close( lockFile );
+}
+
+
+
+bool TileStore::openShared( const string& name, size_t size )
+{
+#ifdef HAVE_SHM_OPEN
+
+  // Try to create the store. If it already exists, attach to it instead
+  bool create = true;
+  int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+  if( fd < 0 && errno == EEXIST ){
+    create = false;
+    fd = shm_open( name.c_str(), O_RDWR, 0600 );
+  }
+  if( fd < 0 ){
+    _error = "unable to open shared memory " + name + ": " + strerror( errno );
+    return false;
+  }
+
+  if( create ){
+    if( ftruncate( fd, size ) != 0 ){
+      _error = "unable to size shared memory " + name + ": " + strerror( errno );
+      close( fd );
+      shm_unlink( name.c_str() );
+      return false;
+    }
+  }
+  else{
+    // The creator may not have sized the object yet
+    struct stat st;
+    st.st_size = 0;
+    for( int i = 0; i < 2000; i++ ){
+      if( fstat( fd, &st ) == 0 && st.st_size > 0 ) break;
+      usleep( 1000 );
+    }
+    size = st.st_size;
+  }
+
+  bool ok = attach( fd, size, create );
+  close( fd );
+  return ok;
+
+#else
+  _error = "shared memory is not supported on this platform";
+  return false;
+#endif
+}
+
+
+
+bool TileStore::openFile( const string& path, size_t size )
+{
+  int fd = open( path.c_str(), O_RDWR | O_CREAT, 0600 );
+  if( fd < 0 ){
+    _error = "unable to open " + path + ": " + strerror( errno );
+    return false;
+  }
+
+  /* Every process using the store holds a shared lock on the file. If we can get
+     an exclusive lock, no other process is using it, so we may safely repair or
+     recreate it. Otherwise wait until any process setting it up has finished
+   */
+  bool alone = ( flock( fd, LOCK_EX | LOCK_NB ) == 0 );
+  if( !alone ) flock( fd, LOCK_SH );
+
+  // Reuse the existing store if it is intact and the same size
+  bool create = true;
+  struct stat st;
+  if( fstat( fd, &st ) == 0 && (size_t) st.st_size == size ){
+    Header h;
+    if( pread( fd, &h, sizeof(Header), 0 ) == (ssize_t) sizeof(Header) &&
+	h.magic == TILESTORE_MAGIC && h.size == size ) create = false;
+  }
+
+  if( create ){
+    if( !alone ){
+      _error = path + " is in use by another process with a different size";
+      close( fd );
+      return false;
+    }
+    // Clear the magic number first so that a partially initialised store is never reused
+    uint64_t zero = 0;
+    if( ftruncate( fd, 0 ) != 0 || ftruncate( fd, size ) != 0 ||
+	pwrite( fd, &zero, sizeof(zero), 0 ) != (ssize_t) sizeof(zero) ){
+      _error = "unable to size " + path + ": " + strerror( errno );
+      close( fd );
+      return false;
+    }
+  }
+
+  if( !attach( fd, size, create ) ){
+    close( fd );
+    return false;
+  }
+
+  // A lock left behind by a process which crashed cannot be trusted, so if the
+  // store is ours alone, reinitialise its lock and check the contents
+  if( alone && !create ){
+    initialiseLock();
+    verify();
+  }
+
+  // Keep the file open with a shared lock for as long as we use the store
+  if( alone ) flock( fd, LOCK_SH );
+  lockFile = fd;
+  return true;
+}
+
+
+
+void TileStore::unlinkShared( const string& name )
+{
+#ifdef HAVE_SHM_OPEN
+  shm_unlink( name.c_str() );
+#endif
+}
+
+
+
+bool TileStore::attach( int fd, size_t size, bool create )
+{
+  if( size < sizeof(Header) + TILESTORE_ALIGN * 1024 ){
+    _error = "tile store is too small";
+    return false;
+  }
+
+  void* m = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( m == MAP_FAILED ){
+    _error = string( "unable to map tile store: " ) + strerror( errno );
+    return false;
+  }
+  mapping = m;
+  mappingSize = size;
+  Header* h = (Header*) m;
+
+  if( create ) initialise( size );
+  else{
+    // Wait for the creating process to finish initialising the store
+    int i;
+    for( i = 0; i < 2000; i++ ){
+      if( __atomic_load_n( &h->magic, __ATOMIC_ACQUIRE ) == TILESTORE_MAGIC ) break;
+      usleep( 1000 );
+    }
+    if( i == 2000 || h->size != size ){
+      _error = "tile store is not initialised or has an incompatible layout";
+      munmap( m, size );
+      mapping = NULL;
+      return false;
+    }
+  }
+
+  header = h;
+  slots = (Slot*) ( (unsigned char*) m + align( sizeof(Header) ) );
+  arena = (unsigned char*) m + h->arenaOffset;
+  return true;
+}
+
+
+
+void TileStore::initialise( size_t size )
+{
+  Header* h = (Header*) mapping;
+  memset( h, 0, sizeof(Header) );
+
+  // Two slots per average tile, rounded down to a power of two
+  uint64_t n = 1024;
+  while( n * 2 * ( TILESTORE_TILE_SIZE / 2 ) <= size ) n *= 2;
+
+  h->size = size;
+  h->slotCount = n;
+  h->arenaOffset = align( align( sizeof(Header) ) + n * sizeof(Slot) );
+  h->arenaSize = ( size - h->arenaOffset ) & ~((uint64_t) TILESTORE_ALIGN - 1);
+
+  header = h;
+  initialiseLock();
+
+  memset( (unsigned char*) mapping + align( sizeof(Header) ), 0, n * sizeof(Slot) );
+
+  __atomic_store_n( &h->magic, TILESTORE_MAGIC, __ATOMIC_RELEASE );
+}
+
+
+
+void TileStore::initialiseLock()
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+#endif
+  pthread_mutex_init( &header->mutex, &attr );
+  pthread_mutexattr_destroy( &attr );
+}
+
+
+
+void TileStore::verify()
+{
+  Header* h = header;
+  bool ok = ( h->slotCount > 0 && (h->slotCount & (h->slotCount - 1)) == 0 &&
+	      h->arenaOffset + h->arenaSize <= h->size && h->head <= h->arenaSize &&
+	      h->tail <= h->arenaSize && h->end <= h->arenaSize );
+
+  // Walk the ring from the tail, checking that each record lies within the live region
+  uint64_t pos = h->tail;
+  bool wrapped = h->wrapped;
+  for( uint64_t n = 0; ok && n < h->records; n++ ){
+    if( wrapped && pos == h->end ){
+      pos = 0;
+      wrapped = false;
+    }
+    uint64_t limit = wrapped ? h->end : h->head;
+    if( pos + sizeof(Record) > limit ){
+      ok = false;
+      break;
+    }
+    Record* r = record( pos );
+    if( r->size < sizeof(Record) || (r->size % TILESTORE_ALIGN) != 0 || pos + r->size > limit ||
+	r->dataLength < 0 || sizeof(Record) + r->dataLength > r->size || r->slot >= h->slotCount ){
+      ok = false;
+      break;
+    }
+    pos += r->size;
+  }
+  if( ok && h->records > 0 ){
+    if( wrapped && pos == h->end ) pos = 0;
+    if( pos != h->head ) ok = false;
+  }
+
+  if( !ok ){
+    reset();
+    return;
+  }
+
+  // Drop any index slots that do not point back at a matching record
+  h->entries = 0;
+  for( uint64_t i = 0; i < h->slotCount; i++ ){
+    Slot* s = &slots[i];
+    if( s->sequence == 0 ) continue;
+    if( s->offset + sizeof(Record) > h->arenaSize || record( s->offset )->sequence != s->sequence ||
+	record( s->offset )->slot != i ){
+      s->sequence = 0;
+    }
+    else h->entries++;
+  }
+}
+
+
+
+void TileStore::reset()
+{
+  memset( slots, 0, header->slotCount * sizeof(Slot) );
+  header->head = header->tail = header->end = 0;
+  header->wrapped = 0;
+  header->records = header->entries = 0;
+}
+
+
+
+bool TileStore::lock()
+{
+  int rc = pthread_mutex_lock( &header->mutex );
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+  if( rc == EOWNERDEAD ){
+    // Another process died while holding the lock, so the index may be half
+    // updated. Start again with an empty store
+    reset();
+    pthread_mutex_consistent( &header->mutex );
+    return true;
+  }
+#endif
+  return rc == 0;
+}
+
+
+
+void TileStore::unlock()
+{
+  pthread_mutex_unlock( &header->mutex );
+}
+
+
+
+TileStore::Slot* TileStore::find( uint64_t hash, const TileKey::Image& image, const TileKey& key )
+{
+  uint64_t mask = header->slotCount - 1;
+  for( uint64_t i = 0; i < TILESTORE_PROBE; i++ ){
+    Slot* s = &slots[ (hash + i) & mask ];
+    if( s->sequence == 0 || s->hash != hash ) continue;
+    Record* r = record( s->offset );
+    if( r->sequence == s->sequence && r->image == image.hash && r->check == image.check &&
+	r->tile == key.tile && r->resolution == key.resolution &&
+	r->hSequence == key.hSequence && r->vSequence == key.vSequence &&
+	r->compressionType == key.compression && r->quality == key.quality ){
+      return s;
+    }
+  }
+  return NULL;
+}
+
+
+
+void TileStore::dropTail()
+{
+  Record* r = record( header->tail );
+  Slot* s = &slots[ r->slot ];
+  if( s->sequence == r->sequence ){
+    s->sequence = 0;
+    header->entries--;
+    header->evictions++;
+  }
+  header->records--;
+  header->tail += r->size;
+  if( header->wrapped && header->tail == header->end ){
+    header->tail = 0;
+    header->wrapped = 0;
+  }
+}
+
+
+
+uint64_t TileStore::append( uint64_t size )
+{
+  /* Unwrapped, the records lie in [tail,head) and we can write up to the end of
+     the arena. Once wrapped, they lie in [tail,end) and [0,head) and we can only
+     write up to the tail
+   */
+  while( true ){
+    if( header->records == 0 ){
+      header->head = header->tail = 0;
+      header->wrapped = 0;
+    }
+
+    if( !header->wrapped ){
+      if( header->arenaSize - header->head >= size ) break;
+      // No room at the top of the arena, so go back to the start
+      header->end = header->head;
+      header->head = 0;
+      header->wrapped = 1;
+    }
+    else{
+      if( header->tail - header->head >= size ) break;
+      dropTail();
+    }
+  }
+
+  uint64_t offset = header->head;
+  header->head += size;
+  header->records++;
+  return offset;
+}
+
+
+
+RawTilePtr TileStore::get( const TileKey::Image& image, const TileKey& key )
+{
+  if( !header ) return RawTilePtr();
+
+  uint64_t hash = storeHash( image, key );
+  if( !lock() ) return RawTilePtr();
+
+  Slot* s = find( hash, image, key );
+  if( !s ){
+    header->misses++;
+    unlock();
+    return RawTilePtr();
+  }
+
+  Record* r = record( s->offset );
+  RawTilePtr tile( new RawTile( r->tile, r->resolution, r->hSequence, r->vSequence,
+				r->width, r->height, r->channels, r->bpc ) );
+  tile->compressionType = (CompressionType) r->compressionType;
+  tile->quality = r->quality;
+  tile->timestamp = r->timestamp;
+  tile->cost = r->cost;
+  tile->sampleType = (SampleType) r->sampleType;
+  tile->padded = r->padded;
+  tile->dataLength = r->dataLength;
+
+  tile->data = tile->allocate( r->dataLength );
+  tile->memoryManaged = 1;
+  memcpy( tile->data, (unsigned char*) r + sizeof(Record), r->dataLength );
+
+  header->hits++;
+  unlock();
+  return tile;
+}
+
+
+
+void TileStore::put( const TileKey::Image& image, const RawTile& tile )
+{
+  if( !header || !tile.data || tile.dataLength <= 0 ) return;
+
+  // Don't let a single tile flush a large part of the store
+  uint64_t size = align( sizeof(Record) + tile.dataLength );
+  if( size > header->arenaSize / 8 ) return;
+
+  TileKey key( 0, tile.resolution, tile.tileNum, tile.hSequence, tile.vSequence,
+	       tile.compressionType, tile.quality );
+  uint64_t hash = storeHash( image, key );
+
+  if( !lock() ) return;
+
+  // If we already have this tile, replace it only if ours is newer
+  Slot* s = find( hash, image, key );
+  if( s ){
+    if( record( s->offset )->timestamp >= (int64_t) tile.timestamp ){
+      unlock();
+      return;
+    }
+    s->sequence = 0;
+    header->entries--;
+  }
+
+  uint64_t offset = append( size );
+
+  // Use a free slot in our probe window or else replace the oldest
+  uint64_t mask = header->slotCount - 1;
+  s = &slots[ hash & mask ];
+  for( uint64_t i = 0; i < TILESTORE_PROBE && s->sequence != 0; i++ ){
+    Slot* t = &slots[ (hash + i) & mask ];
+    if( t->sequence < s->sequence ) s = t;
+  }
+  if( s->sequence != 0 ){
+    header->entries--;
+    header->evictions++;
+  }
+
+  Record* r = record( offset );
+  r->sequence = ++header->sequence;
+  r->size = size;
+  r->image = image.hash;
+  r->check = image.check;
+  r->slot = s - slots;
+  r->timestamp = tile.timestamp;
+  r->resolution = tile.resolution;
+  r->tile = tile.tileNum;
+  r->hSequence = tile.hSequence;
+  r->vSequence = tile.vSequence;
+  r->compressionType = key.compression;
+  r->quality = key.quality;
+  r->dataLength = tile.dataLength;
+  r->width = tile.width;
+  r->height = tile.height;
+  r->channels = tile.channels;
+  r->bpc = tile.bpc;
+  r->sampleType = tile.sampleType;
+  r->cost = tile.cost;
+  r->padded = tile.padded;
+  memcpy( (unsigned char*) r + sizeof(Record), tile.data, tile.dataLength );
+
+  s->hash = hash;
+  s->offset = offset;
+  s->sequence = r->sequence;
+
+  header->entries++;
+  header->inserts++;
+  unlock();
+}
+
+
+
+void TileStore::remove( const TileKey::Image& image, const TileKey& key, time_t timestamp )
+{
+  if( !header ) return;
+  uint64_t hash = storeHash( image, key );
+  if( !lock() ) return;
+  Slot* s = find( hash, image, key );
+  if( s && record( s->offset )->timestamp <= (int64_t) timestamp ){
+    s->sequence = 0;
+    header->entries--;
+  }
+  unlock();
+}
+
+
+
+void TileStore::clear()
+{
+  if( !header || !lock() ) return;
+  reset();
+  unlock();
+}
+
+
+
+TileStore::Statistics TileStore::statistics()
+{
+  Statistics stats;
+  memset( &stats, 0, sizeof(stats) );
+  if( !header || !lock() ) return stats;
+
+  stats.hits = header->hits;
+  stats.misses = header->misses;
+  stats.inserts = header->inserts;
+  stats.evictions = header->evictions;
+  stats.entries = header->entries;
+  if( header->records == 0 ) stats.bytes = 0;
+  else if( header->wrapped ) stats.bytes = header->end - header->tail + header->head;
+  else stats.bytes = header->head - header->tail;
+  stats.capacity = header->arenaSize;
+
+  unlock();
+  return stats;
+}
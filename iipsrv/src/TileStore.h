@@ -0,0 +1,185 @@
+// Memory Mapped Tile Store
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILESTORE_H
+#define _TILESTORE_H
+
+
+#include <string>
+#include <inttypes.h>
+
+#include "RawTile.h"
+#include "TileKey.h"
+
+
+
+/// Tile store held in a memory mapping which can be shared between processes
+/** The mapping is either POSIX shared memory or a file, which lets the store
+    survive restarts. It holds a header, a fixed size hash index and a data
+    arena used as a ring buffer: tiles are appended at the head, and when the
+    arena is full the oldest tiles are dropped from the tail. Each index slot
+    points at a record in the arena, and each record names its slot, so that
+    dropping a record clears its slot. Lookups probe a fixed window of slots and
+    never need tombstones. All access is serialised by a process-shared mutex in
+    the header, which is robust where the platform supports it: if a process
+    dies while holding the lock, the next process to take it empties the store.
+
+    Images are identified by two independent hashes of their path (see
+    TileKey::Image) as interned image ids are private to each process. Tiles returned are
+    private copies, so the arena may be overwritten while they are in use.
+ */
+class TileStore {
+
+ public:
+
+  /// Usage statistics
+  struct Statistics {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    unsigned int entries;
+    size_t bytes;
+    size_t capacity;
+  };
+
+
+ private:
+
+  struct Header;
+  struct Slot;
+  struct Record;
+
+  /// Start and length of our mapping
+  void* mapping;
+  size_t mappingSize;
+
+  /// Pointers into the mapping
+  Header* header;
+  Slot* slots;
+  unsigned char* arena;
+
+  /// File descriptor holding our lock on a file store, or -1
+  int lockFile;
+
+  /// Error message from the last failed call
+  std::string _error;
+
+
+  /// Map a file descriptor and initialise the store or wait for another process to do so
+  bool attach( int fd, size_t size, bool create );
+
+  /// Lay out a new store in our mapping
+  void initialise( size_t size );
+
+  /// Initialise the process-shared lock
+  void initialiseLock();
+
+  /// Empty the store. Must be called with the lock held
+  void reset();
+
+  /// Check a reopened store for damage, emptying it if necessary
+  /** Must only be called while no other thread or process is using the store */
+  void verify();
+
+  /// Take and release the store lock
+  bool lock();
+  void unlock();
+
+  /// Find the index slot of a tile, or NULL
+  Slot* find( uint64_t hash, const TileKey::Image& image, const TileKey& key );
+
+  /// Reserve space for a record at the head of the ring, dropping old records as necessary
+  uint64_t append( uint64_t size );
+
+  /// Drop the oldest record in the ring
+  void dropTail();
+
+  Record* record( uint64_t offset ){ return (Record*) (arena + offset); };
+
+  /// Disallow copying
+  TileStore( const TileStore& );
+  TileStore& operator = ( const TileStore& );
+
+
+ public:
+
+  /// Constructor
+  TileStore() : mapping( NULL ), mappingSize( 0 ), header( NULL ), slots( NULL ), arena( NULL ), lockFile( -1 ) {};
+
+  /// Destructor - unmaps the store but leaves it in place for other processes
+  ~TileStore();
+
+  /// Create or attach to a POSIX shared memory store
+  /** @param name shared memory object name, which should start with a '/'
+      @param size size in bytes of a newly created store. An existing store keeps its size
+      @return false on error - see error()
+   */
+  bool openShared( const std::string& name, size_t size );
+
+  /// Create or reopen a store in a file, eg. on a local SSD
+  /** An intact store of the same size is reused, so its tiles survive restarts.
+      Several processes may open the same file and share the store
+      @param path file path
+      @param size size of the store in bytes
+      @return false on error - see error()
+   */
+  bool openFile( const std::string& path, size_t size );
+
+  /// Remove a POSIX shared memory store. Processes already attached keep their mapping
+  static void unlinkShared( const std::string& name );
+
+  /// Whether the store is mapped and usable
+  bool ready(){ return header != NULL; };
+
+  /// Return the error from the last failed call
+  const std::string& error(){ return _error; };
+
+  /// Return a copy of a tile
+  /** @param image interned image
+      @param key tile key. The key's interned image id is ignored
+      @return tile or an empty pointer if not found
+   */
+  RawTilePtr get( const TileKey::Image& image, const TileKey& key );
+
+  /// Store a copy of a tile, replacing any older version
+  /** @param image interned image
+      @param tile tile to store
+   */
+  void put( const TileKey::Image& image, const RawTile& tile );
+
+  /// Remove a tile unless it is newer than a given timestamp
+  /** @param image interned image
+      @param key tile key. The key's interned image id is ignored
+      @param timestamp timestamp of the out of date tile, so that a newer one stored
+                       in the meantime is kept
+   */
+  void remove( const TileKey::Image& image, const TileKey& key, time_t timestamp );
+
+  /// Remove all tiles
+  void clear();
+
+  /// Return usage statistics
+  Statistics statistics();
+
+};
+
+
+#endif
@@ -0,0 +1,135 @@
+// TinyLFU Frequency Sketch
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TINYLFU_H
+#define _TINYLFU_H
+
+
+#include <vector>
+#include <cstddef>
+#include <inttypes.h>
+
+
+/// Approximate access frequency counter used for cache admission
+/** A count-min sketch of 4 bit counters, 16 to a 64 bit word, with 4 counters
+    per key. Once the number of recorded accesses reaches 10 times the number of
+    counters, all counters are halved so that the sketch follows changes in
+    popularity rather than counting forever. Counts saturate at 15.
+
+    The sketch is not thread safe: callers must hold their own lock.
+ */
+class FrequencySketch {
+
+ private:
+
+  /// Counters, 16 per word
+  std::vector<uint64_t> table;
+
+  /// Mask selecting a counter
+  size_t counterMask;
+
+  /// Accesses recorded since the last halving
+  size_t additions;
+
+  /// Number of accesses after which we halve all counters
+  size_t sampleSize;
+
+
+  /// Return the counter index of a key hash for one of our 4 rows
+  size_t index( uint64_t hash, int row ) const {
+    static const uint64_t seeds[4] = { 0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+				       0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL };
+    uint64_t h = (hash + seeds[row]) * seeds[row];
+    h += h >> 32;
+    return h & counterMask;
+  };
+
+  uint32_t counter( size_t i ) const {
+    return (table[i >> 4] >> ((i & 15) << 2)) & 0xf;
+  };
+
+
+  /// Halve every counter
+  void reset(){
+    for( size_t i = 0; i < table.size(); i++ ){
+      table[i] = (table[i] >> 1) & 0x7777777777777777ULL;
+    }
+    additions /= 2;
+  };
+
+
+ public:
+
+  /// Constructor
+  /** @param n expected number of distinct items held in the cache */
+  explicit FrequencySketch( size_t n ) : additions( 0 ) {
+    size_t counters = 64;
+    while( counters < n ) counters <<= 1;
+    table.resize( counters / 16 );
+    counterMask = counters - 1;
+    sampleSize = 10 * counters;
+  };
+
+
+  /// Return the estimated access frequency of a key
+  /** @param hash key hash */
+  uint32_t frequency( uint64_t hash ) const {
+    uint32_t f = 15;
+    for( int row = 0; row < 4; row++ ){
+      uint32_t c = counter( index( hash, row ) );
+      if( c < f ) f = c;
+    }
+    return f;
+  };
+
+
+  /// Record an access to a key
+  /** Uses a conservative update: only the smallest counters are incremented
+      @param hash key hash
+   */
+  void increment( uint64_t hash ){
+    size_t i[4];
+    uint32_t f = 15;
+    for( int row = 0; row < 4; row++ ){
+      i[row] = index( hash, row );
+      uint32_t c = counter( i[row] );
+      if( c < f ) f = c;
+    }
+    if( f == 15 ) return;
+
+    for( int row = 0; row < 4; row++ ){
+      // Rows may share a counter, so only increment each one once
+      bool seen = false;
+      for( int r = 0; r < row; r++ ) if( i[r] == i[row] ) seen = true;
+      if( !seen && counter( i[row] ) == f ) table[i[row] >> 4] += 1ULL << ((i[row] & 15) << 2);
+    }
+    if( ++additions >= sampleSize ) reset();
+  };
+
+
+  void clear(){
+    for( size_t i = 0; i < table.size(); i++ ) table[i] = 0;
+    additions = 0;
+  };
+
+};
+
+
+#endif
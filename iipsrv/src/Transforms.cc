@@ -68,10 +68,11 @@ void filter_normalize( RawTilePtr in, vector<float>& max, vector<float>& min ) {
   unsigned char* ucptr; 
 
   if( in->bpc == 32 && in->sampleType == FLOATINGPOINT ) {
+    in->makeWritable();
     normdata = (float*)in->data;
   }
   else {
-    normdata = new float[np];
+    normdata = (float*) RawTile::allocate( np * sizeof(float), 32, FLOATINGPOINT, in->category );
   }
 
   for( unsigned int c = 0 ; c<nc ; c++){
@@ -116,14 +117,8 @@ void filter_normalize( RawTilePtr in, vector<float>& max, vector<float>& min ) {
   }
 
   // Delete our original buffers, unless we already had floats
-  if( in->bpc == 32 && in->sampleType == FIXEDPOINT ){
-    delete[] (unsigned int*) in->data;
-  }
-  else if( in->bpc == 16 ){
-    delete[] (unsigned short*) in->data;
-  }
-  else if( in->bpc == 8 ){
-    delete[] (unsigned char*) in->data;
+  if( !(in->bpc == 32 && in->sampleType == FLOATINGPOINT) ){
+    in->freeData();
   }
 
   // Assign our new buffer and modify some info
@@ -165,7 +160,7 @@ void filter_shade( RawTilePtr in, int h_angle, int v_angle ){
 
   infptr= (float*)in->data;
   // Create new (float) data buffer
-  buffer = new float[ndata];
+  buffer = (float*) RawTile::allocate( ndata * sizeof(float), 32, FLOATINGPOINT, in->category );
 
   for( unsigned int n=0; n<ndata; n+=3 ){
     if( infptr[n] == 0. && infptr[n+1] == 0. && infptr[n+2] == 0. ) {
@@ -190,7 +185,7 @@ void filter_shade( RawTilePtr in, int h_angle, int v_angle ){
 
 
   // Delete old data buffer
-  delete[] (float*) in->data;
+  in->freeData();
 
   in->data = buffer;
   in->channels = 1;
@@ -296,6 +291,9 @@ void filter_LAB2sRGB( RawTilePtr in ){
 
   unsigned long np = in->width * in->height * in->channels;
 
+  // Converted in place
+  in->makeWritable();
+
   // Parallelize code using OpenMP
   unsigned int nstep = in->channels;
 #pragma omp parallel for
@@ -322,7 +320,7 @@ void filter_cmap( RawTilePtr in, enum cmap_type cmap ){
   const float max8=1./8.;
 
   float *fptr = (float*)in->data;
-  float *outptr = new float[ndata*out_chan];
+  float *outptr = (float*) RawTile::allocate( ndata * out_chan * sizeof(float), 32, FLOATINGPOINT, in->category );
   float *outv = outptr;
 
   switch(cmap){
@@ -385,7 +383,7 @@ void filter_cmap( RawTilePtr in, enum cmap_type cmap ){
 
 
   // Delete old data buffer
-  delete[] (float*) in->data;
+  in->freeData();
   in->data = outptr;
   in->channels = out_chan;
   in->dataLength = ndata * out_chan * in->bpc / 8;
@@ -398,6 +396,7 @@ void filter_inv( RawTilePtr in ){
   float* infptr;
   unsigned int np = in->dataLength * 8 / in->bpc;
 
+  in->makeWritable();
   infptr = (float*) in->data;
 
   // Loop through our pixels for floating values 
@@ -427,9 +426,13 @@ void filter_interpolate_nearestneighbour( RawTilePtr in, unsigned int resampled_
   bool new_buffer = false;
   if( resampled_width*resampled_height > in->width*in->height ){
     new_buffer = true;
-    output = new unsigned char[resampled_width*resampled_height*in->channels];
+    output = (unsigned char*) in->allocate( resampled_width*resampled_height*in->channels );
+  }
+  else{
+    // Resample in place, so we need our own copy of the data
+    in->makeWritable();
+    input = output = (unsigned char*) in->data;
   }
-  else output = (unsigned char*) in->data;
 
   // Calculate our scale
   float xscale = (float)width / (float)resampled_width;
@@ -452,7 +455,7 @@ void filter_interpolate_nearestneighbour( RawTilePtr in, unsigned int resampled_
   }
 
   // Delete original buffer
-  if( new_buffer ) delete[] (unsigned char*) input;
+  if( new_buffer ) in->freeData();
 
   // Correctly set our Rawtile info
   in->width = resampled_width;
@@ -475,7 +478,7 @@ void filter_interpolate_bilinear( RawTilePtr in, unsigned int resampled_width, u
   unsigned int height = in->height;
 
   // Create new buffer and pointer for our output
-  unsigned char *output = new unsigned char[resampled_width*resampled_height*in->channels];
+  unsigned char *output = (unsigned char*) in->allocate( resampled_width*resampled_height*in->channels );
 
   // Calculate our scale
   float xscale = (float)(width-1) / (float)resampled_width;
@@ -521,7 +524,7 @@ void filter_interpolate_bilinear( RawTilePtr in, unsigned int resampled_width, u
   }
 
   // Delete original buffer
-  delete[] (unsigned char*) input;
+  in->freeData();
 
   // Correctly set our Rawtile info
   in->width = resampled_width;
@@ -537,7 +540,7 @@ void filter_contrast( RawTilePtr in, float c ){
 
   unsigned int np = in->dataLength * 8 / in->bpc;
 
-  unsigned char* buffer = new unsigned char[np];
+  unsigned char* buffer = (unsigned char*) RawTile::allocate( np, 8, FIXEDPOINT, in->category );
 
   float* infptr = (float*)in->data;
 
@@ -548,7 +551,7 @@ void filter_contrast( RawTilePtr in, float c ){
   }
 
   // Replace original buffer with new
-  delete[] (float*) in->data;
+  in->freeData();
   in->data = buffer;
   in->bpc = 8;
   in->dataLength = np * in->bpc/8;
@@ -564,6 +567,7 @@ void filter_gamma( RawTilePtr in, float g ){
 
   if( g == 1.0 ) return;
 
+  in->makeWritable();
   infptr = (float*)in->data;
 
   // Loop through our pixels for floating values 
@@ -586,7 +590,7 @@ void filter_rotate( RawTilePtr in, float angle=0.0 ){
     unsigned int n = 0;
 
     // Allocate memory for our temporary buffer - rotate function only ever operates on 8bit data
-    void *buffer = new unsigned char[in->width*in->height*in->channels];
+    void *buffer = in->allocate( in->width*in->height*in->channels );
 
     // Rotate 90
     if( (int) angle % 360 == 90 ){
@@ -623,7 +627,7 @@ void filter_rotate( RawTilePtr in, float angle=0.0 ){
     }
 
     // Delete old data buffer
-    delete[] (unsigned char*) in->data;
+    in->freeData();
 
     // Assign new data to Rawtile
     in->data = buffer;
@@ -647,7 +651,7 @@ void filter_greyscale( RawTilePtr rawtile ){
   if( rawtile->bpc != 8 || rawtile->channels != 3 ) return;
 
   unsigned int np = rawtile->width * rawtile->height;
-  unsigned char* buffer = new unsigned char[rawtile->width * rawtile->height];
+  unsigned char* buffer = (unsigned char*) rawtile->allocate( rawtile->width * rawtile->height );
 
   // Calculate using fixed-point arithmetic
   //  - benchmarks to around 25% faster than floating point
@@ -660,7 +664,7 @@ void filter_greyscale( RawTilePtr rawtile ){
   }
 
   // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) rawtile->data;
+  rawtile->freeData();
   rawtile->data = (void*) buffer;
 
   // Update our number of channels and data length
@@ -676,6 +680,9 @@ void filter_twist( RawTilePtr rawtile, const vector< vector<float> >& matrix ){
   unsigned long np = rawtile->width * rawtile->height;
   unsigned long n = 0;
 
+  // Twisted in place
+  rawtile->makeWritable();
+
   // Create temporary buffer for our calculated values
   float* pixel = new float[rawtile->channels];
 
@@ -726,6 +733,8 @@ void filter_flatten( RawTilePtr in, int bands ){
   unsigned long no = 0;
   unsigned int gap = in->channels - bands;
 
+  in->makeWritable();
+
   // Simply loop through assigning to the same buffer
   for( unsigned long i=0; i<np; i++ ){
     for( int k=0; k<bands; k++ ){
@@ -743,7 +752,7 @@ void filter_flatten( RawTilePtr in, int bands ){
 // Flip image in horizontal or vertical direction (0=horizontal,1=vertical)
 void filter_flip( RawTilePtr in, int orientation ){
 
-  unsigned char* buffer = new unsigned char[in->width * in->height * in->channels];
+  unsigned char* buffer = (unsigned char*) in->allocate( in->width * in->height * in->channels );
   unsigned long n = 0;
 
   // Vertical
@@ -770,6 +779,6 @@ void filter_flip( RawTilePtr in, int orientation ){
   }
 
   // Delete our old data buffer and instead point to our grayscale data
-  delete[] (unsigned char*) in->data;
+  in->freeData();
   in->data = (void*) buffer;
 }
@@ -0,0 +1,403 @@
+// Member functions for VirtualPyramidImage.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "VirtualPyramidImage.h"
+#include "Timer.h"
+#include "PixelKernels.h"
+
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+
+using namespace std;
+
+
+
+void VirtualPyramidImage::buildLevels( const vector<int64_t>& native_widths, const vector<int64_t>& native_heights,
+                                       unsigned int max_w, unsigned int max_h ){
+
+  // A zero sized sentinel stops us moving past the smallest native level
+  vector<int64_t> widths( native_widths ), heights( native_heights );
+  widths.push_back( 0 );
+  heights.push_back( 0 );
+
+  image_widths.clear();
+  image_heights.clear();
+  numTilesX.clear();
+  numTilesY.clear();
+  lastTileXDim.clear();
+  lastTileYDim.clear();
+  native_level_to_use.clear();
+  downsample_in_level.clear();
+
+  int64_t w = widths[0];
+  int64_t h = heights[0];
+  uint32_t native = 0;
+  uint32_t downsample = 1;
+
+  while( true ){
+
+    image_widths.push_back( w );
+    image_heights.push_back( h );
+    numTilesX.push_back( ( w + tile_width - 1 ) / tile_width );
+    numTilesY.push_back( ( h + tile_height - 1 ) / tile_height );
+    lastTileXDim.push_back( w % tile_width );
+    lastTileYDim.push_back( h % tile_height );
+    native_level_to_use.push_back( native );
+    downsample_in_level.push_back( downsample );
+
+    // Stop once the whole image fits within the smallest level
+    if( w <= max_w && h <= max_h ) break;
+
+    // Halve, losing the last pixel of odd sizes
+    w >>= 1;
+    h >>= 1;
+
+    // Read from the smallest native level still at least this size
+    if( w <= widths[native+1] && h <= heights[native+1] ){
+      downsample = 1;
+      while( w <= widths[native+1] && h <= heights[native+1] ) native++;
+    }
+    else downsample <<= 1;
+  }
+
+  numResolutions = numTilesX.size();
+}
+
+
+
+size_t VirtualPyramidImage::getMemoryUsage(){
+  size_t size = IIPImage::getMemoryUsage() + sizeof(VirtualPyramidImage) - sizeof(IIPImage);
+  size += ( numTilesX.capacity() + numTilesY.capacity() + lastTileXDim.capacity() + lastTileYDim.capacity() ) * sizeof(size_t);
+  size += ( native_level_to_use.capacity() + downsample_in_level.capacity() ) * sizeof(uint32_t);
+  return size;
+}
+
+
+
+RawTilePtr VirtualPyramidImage::getTile( int /*x*/, int /*y*/, unsigned int iipres, int /*layers*/, unsigned int tile ){
+
+  if( iipres > numResolutions - 1 ){
+    ostringstream error;
+    error << getDescription() << " :: Asked for non-existent resolution: " << iipres;
+    throw file_error( error.str() );
+  }
+
+  uint32_t level = numResolutions - 1 - iipres;
+
+  size_t ntlx = numTilesX[level];
+  size_t ntly = numTilesY[level];
+  if( tile >= ntlx * ntly ){
+    ostringstream error;
+    error << getDescription() << " :: Asked for non-existent tile: " << tile;
+    throw file_error( error.str() );
+  }
+
+  return getCachedTile( tile % ntlx, tile / ntlx, iipres );
+}
+
+
+
+RawTilePtr VirtualPyramidImage::getCachedTile( const size_t tilex, const size_t tiley, const uint32_t iipres ){
+
+  uint32_t level = numResolutions - 1 - iipres;
+  uint32_t tid = tiley * numTilesX[level] + tilex;
+
+  if( tileCache ){
+    RawTilePtr cached = tileCache->getObject( TileCache::getIndex( getImageId(), iipres, tid, 0, 0, UNCOMPRESSED, 0 ) );
+    if( cached ) return cached;
+  }
+
+  // Virtual levels, and native levels read in blocks, are built a block at a time
+  size_t bw, bh;
+  blockTiles( level, bw, bh );
+  if( downsample_in_level[level] > 1 || bw * bh > 1 ) return getVirtualTile( tilex, tiley, iipres );
+
+  // Time the tile production. The cost is used for cost-aware cache eviction
+  Timer cost_timer;
+  cost_timer.start();
+  RawTilePtr rt = getNativeTile( tilex, tiley, iipres );
+  if( rt ) rt->cost = cost_timer.getTime();
+  return rt;
+}
+
+
+
+void VirtualPyramidImage::readNativeRegion( uint32_t level, size_t x, size_t y, size_t w, size_t h, uint8_t* buffer ){
+
+  uint32_t iipres = numResolutions - 1 - level;
+
+  for( size_t ty = y / tile_height; ty * tile_height < y + h && ty < numTilesY[level]; ty++ ){
+    for( size_t tx = x / tile_width; tx * tile_width < x + w && tx < numTilesX[level]; tx++ ){
+
+      // Read native tiles directly rather than through getCachedTile(), which may
+      // itself read this level in blocks
+      RawTilePtr tile;
+      if( tileCache ){
+        tile = tileCache->getObject( TileCache::getIndex( getImageId(), iipres, ty * numTilesX[level] + tx, 0, 0, UNCOMPRESSED, 0 ) );
+      }
+      if( !tile ) tile = getNativeTile( tx, ty, iipres );
+      copyTile( tile, tx, ty, x, y, w, h, buffer );
+    }
+  }
+}
+
+
+
+void VirtualPyramidImage::copyTile( const RawTilePtr& tile, size_t tx, size_t ty,
+                                    size_t x, size_t y, size_t w, size_t h, uint8_t* buffer ){
+
+  if( !tile || !tile->data ) return;
+
+  size_t pixel = pixelBytes();
+  size_t stride = w * pixel;
+  size_t left = std::max( x, tx * tile_width );
+  size_t right = std::min( x + w, tx * tile_width + tile->width );
+  size_t top = std::max( y, ty * tile_height );
+  size_t bottom = std::min( y + h, ty * tile_height + tile->height );
+  if( right <= left ) return;
+
+  const uint8_t* src = (const uint8_t*) tile->data;
+  for( size_t row = top; row < bottom; row++ ){
+    memcpy( buffer + ( row - y ) * stride + ( left - x ) * pixel,
+            src + ( ( row - ty * tile_height ) * tile->width + ( left - tx * tile_width ) ) * pixel,
+            ( right - left ) * pixel );
+  }
+}
+
+
+
+void VirtualPyramidImage::readScaledRegion( uint32_t level, size_t scale, size_t /*x*/, size_t /*y*/,
+					    size_t /*w*/, size_t /*h*/, uint8_t* /*buffer*/ ){
+  ostringstream error;
+  error << getDescription() << " :: Cannot read level " << level << " reduced by " << scale;
+  throw file_error( error.str() );
+}
+
+
+
+void VirtualPyramidImage::blockTiles( uint32_t level, size_t& bw, size_t& bh ){
+  size_t downsample = downsample_in_level[level];
+  if( downsample == 1 ){
+    nativeBlockTiles( level, bw, bh );
+    bw = std::max( (size_t) 1, bw );
+    bh = std::max( (size_t) 1, bh );
+  }
+  else{
+    bw = std::max( (size_t) 1, VIRTUAL_PYRAMID_BLOCK / ( tile_width * downsample ) );
+    bh = std::max( (size_t) 1, VIRTUAL_PYRAMID_BLOCK / ( tile_height * downsample ) );
+  }
+}
+
+
+
+RawTilePtr VirtualPyramidImage::getVirtualTile( const size_t tilex, const size_t tiley, const uint32_t iipres ){
+
+  uint32_t level = numResolutions - 1 - iipres;
+
+  // Tiles in each direction per block
+  size_t bw, bh;
+  blockTiles( level, bw, bh );
+  size_t blockx = tilex / bw;
+  size_t blocky = tiley / bh;
+  size_t block = blocky * ( ( numTilesX[level] + bw - 1 ) / bw ) + blockx;
+  uint32_t tid = tiley * numTilesX[level] + tilex;
+
+  // Requests for tiles of a block being built wait for it
+  vector<RawTilePtr> tiles = blockBuilds.run( make_pair( level, block ), [&]() -> vector<RawTilePtr> {
+      vector<RawTilePtr> built = buildBlock( level, blockx, blocky );
+      // Our caller caches the tile it asked for
+      if( tileCache ){
+        for( size_t i = 0; i < built.size(); i++ ){
+          if( built[i]->tileNum != (int) tid ) tileCache->insert( built[i] );
+        }
+      }
+      return built;
+    } );
+
+  for( size_t i = 0; i < tiles.size(); i++ ){
+    if( tiles[i]->tileNum == (int) tid ) return tiles[i];
+  }
+
+  ostringstream error;
+  error << getDescription() << " :: Unable to build tile " << tid << " at resolution " << iipres;
+  throw file_error( error.str() );
+}
+
+
+
+/// Box filter a row of output pixels from downsample rows of 16 or 32 bit samples
+/** Each output sample is the mean of a downsample x downsample square, rounded for integers
+    @param src first of the downsample native rows
+    @param native_w width of the native rows
+    @param w width of the output row
+    @param sums w * channels sums
+    @param out output row
+ */
+template <typename T, typename Sum>
+static void boxFilter( const uint8_t* src, size_t native_w, size_t w, unsigned int channels, size_t downsample,
+                       vector<Sum>& sums, uint8_t* out ){
+  std::fill( sums.begin(), sums.end(), 0 );
+  for( size_t m = 0; m < downsample; m++ ){
+    const T* row = (const T*) src + m * native_w * channels;
+    Sum* sum = &sums[0];
+    for( size_t i = 0; i < w; i++, sum += channels ){
+      for( size_t s = 0; s < downsample; s++, row += channels ){
+        for( unsigned int c = 0; c < channels; c++ ) sum[c] += row[c];
+      }
+    }
+  }
+  Sum area = (Sum) ( downsample * downsample );
+  T* result = (T*) out;
+  for( size_t i = 0; i < w * channels; i++ ){
+    result[i] = (T) ( std::numeric_limits<T>::is_integer ? ( sums[i] + area / 2 ) / area : sums[i] / area );
+  }
+}
+
+
+
+vector<RawTilePtr> VirtualPyramidImage::buildBlock( uint32_t level, size_t blockx, size_t blocky ){
+
+  Timer timer;
+  timer.start();
+
+  size_t downsample = downsample_in_level[level];
+  uint32_t iipres = numResolutions - 1 - level;
+
+  // The level we read from is the one with the same native level and no downsample
+  uint32_t native = level;
+  for( size_t d = downsample; d > 1; d >>= 1 ) native--;
+
+  // The tiles of this block
+  size_t bw, bh;
+  blockTiles( level, bw, bh );
+  size_t tx0 = blockx * bw, ty0 = blocky * bh;
+  size_t tx1 = std::min( tx0 + bw, numTilesX[level] );
+  size_t ty1 = std::min( ty0 + bh, numTilesY[level] );
+  size_t ncols = tx1 - tx0;
+
+  // and their pixels
+  size_t x0 = tx0 * tile_width, y0 = ty0 * tile_height;
+  size_t w = std::min( (size_t) image_widths[level], tx1 * tile_width ) - x0;
+  size_t h = std::min( (size_t) image_heights[level], ty1 * tile_height ) - y0;
+
+  // Bytes per pixel
+  size_t pixel = pixelBytes();
+
+  vector<RawTilePtr> tiles;
+  for( size_t ty = ty0; ty < ty1; ty++ ){
+    for( size_t tx = tx0; tx < tx1; tx++ ){
+      size_t tw = tileWidthAt( level, tx );
+      size_t th = tileHeightAt( level, ty );
+      RawTilePtr rt( new RawTile( ty * numTilesX[level] + tx, iipres, 0, 0, tw, th, channels, bpc ) );
+      rt->dataLength = tw * th * pixel;
+      rt->sampleType = sampleType;
+      rt->filename = getImagePath();
+      rt->timestamp = timestamp;
+      rt->data = rt->allocate( rt->dataLength );
+      rt->memoryManaged = 1;
+      tiles.push_back( rt );
+    }
+  }
+
+  // The native level may be read already reduced by scale. From here on,
+  // downsample is what is left to box filter
+  size_t scale = ( downsample > 1 ) ? nativeScale( native, downsample ) : 1;
+  if( scale < 1 || downsample % scale ) scale = 1;
+  downsample /= scale;
+
+  // Read the native level in bands of whole output rows. Keep bands to whole
+  // rows of native tiles where memory allows, so that no tile is read twice
+  size_t native_w = w * downsample;
+  size_t rows = std::max( (size_t) 1, (size_t) VIRTUAL_PYRAMID_BAND / ( native_w * downsample ) );
+  size_t align = tile_height / ( downsample * scale );
+  if( align > 1 && rows > align ) rows -= rows % align;
+
+  vector<uint8_t> band( native_w * rows * downsample * std::max( (size_t) 4, pixel ) );
+  vector<uint16_t> partial( bpc == 8 && downsample > 2 ? native_w * channels : 0 );
+  vector<uint32_t> sums( bpc == 8 && downsample > 2 ? w * channels : 0 );
+  vector<uint8_t> out( w * pixel );
+
+  // Sums for wider samples
+  vector<uint64_t> wideSums( bpc > 8 && sampleType != FLOATINGPOINT && downsample > 1 ? w * channels : 0 );
+  vector<double> realSums( bpc > 8 && sampleType == FLOATINGPOINT && downsample > 1 ? w * channels : 0 );
+
+  // Box filter: each output pixel is the rounded mean of a downsample x downsample square
+  uint32_t area = downsample * downsample;
+
+  for( size_t r = 0; r < h; r += rows ){
+
+    size_t n = std::min( rows, h - r );
+    if( scale > 1 ) readScaledRegion( native, scale, x0 * downsample, ( y0 + r ) * downsample, native_w, n * downsample, &band[0] );
+    else readNativeRegion( native, x0 * downsample, ( y0 + r ) * downsample, native_w, n * downsample, &band[0] );
+
+    for( size_t j = 0; j < n; j++ ){
+
+      const uint8_t* src = &band[ j * downsample * native_w * pixel ];
+
+      // Rows of a level with no downsample left are used as they are
+      const uint8_t* result = ( downsample == 1 ) ? src : &out[0];
+
+      if( bpc > 8 && downsample > 1 ){
+        if( sampleType == FLOATINGPOINT ) boxFilter<float>( src, native_w, w, channels, downsample, realSums, &out[0] );
+        else if( bpc == 16 ) boxFilter<uint16_t>( src, native_w, w, channels, downsample, wideSums, &out[0] );
+        else boxFilter<uint32_t>( src, native_w, w, channels, downsample, wideSums, &out[0] );
+      }
+      else if( downsample == 2 ){
+        PixelKernels::halfsample( src, src + native_w * channels, &out[0], w, channels );
+      }
+      else if( downsample > 2 ){
+        // Sum columns in 16 bits, which holds up to 257 rows, then sum across each square
+        std::fill( sums.begin(), sums.end(), 0 );
+        for( size_t k = 0; k < downsample; k += 256 ){
+          std::fill( partial.begin(), partial.end(), 0 );
+          for( size_t m = k; m < std::min( downsample, k + 256 ); m++ ){
+            PixelKernels::accumulate( src + m * native_w * channels, &partial[0], native_w * channels );
+          }
+          const uint16_t* p = &partial[0];
+          uint32_t* sum = &sums[0];
+          for( size_t i = 0; i < w; i++, sum += channels ){
+            for( size_t s = 0; s < downsample; s++, p += channels ){
+              for( unsigned int c = 0; c < channels; c++ ) sum[c] += p[c];
+            }
+          }
+        }
+        for( size_t i = 0; i < w * channels; i++ ) out[i] = (uint8_t) ( ( sums[i] + area / 2 ) / area );
+      }
+
+      // Scatter the row across the tiles of its block row
+      size_t y = r + j;
+      size_t row = y % tile_height;
+      for( size_t c = 0; c < ncols; c++ ){
+        RawTilePtr& tile = tiles[ ( y / tile_height ) * ncols + c ];
+        memcpy( (uint8_t*) tile->data + row * tile->width * pixel, result + c * tile_width * pixel,
+                tile->width * pixel );
+      }
+    }
+  }
+
+  // Share the cost of the block between its tiles
+  double cost = timer.getTime() / (double) tiles.size();
+  for( size_t i = 0; i < tiles.size(); i++ ) tiles[i]->cost = cost;
+
+  return tiles;
+}
@@ -0,0 +1,235 @@
+// Virtual Pyramid Image class
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _VIRTUALPYRAMIDIMAGE_H
+#define _VIRTUALPYRAMIDIMAGE_H
+
+
+#include <vector>
+#include <utility>
+#include <inttypes.h>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "SingleFlight.h"
+
+
+/// Edge in pixels of the block of a native level read to build virtual tiles
+#define VIRTUAL_PYRAMID_BLOCK 2048
+
+/// Maximum number of native pixels held in memory at once while building virtual tiles
+#define VIRTUAL_PYRAMID_BAND (4*1024*1024)
+
+
+
+/// Base class for images whose resolutions are synthesised from a few native levels
+/** iipsrv expects a pyramid halving in size at each resolution, whereas slide
+    formats read through libraries such as OpenSlide and BioFormats have only
+    a few native levels with arbitrary downsamples. This class builds a power
+    of two pyramid whose levels each map to the nearest larger native level
+    and a power of two downsample within it.
+
+    Tiles of a native level are read by the subclass through getNativeTile().
+    Tiles of a virtual level are built directly from their native level in a
+    single pass: a block of about VIRTUAL_PYRAMID_BLOCK native pixels square is
+    read and box filtered, and every output tile it covers is put into the tile
+    cache. Zooming out through virtual levels therefore costs one read per
+    block rather than a cascade through each intermediate level. Native reads
+    are made in bands, so memory use is bounded however large the downsample.
+    Subclasses may also have levels with no downsample read in blocks, where
+    their files are tiled differently from our tiles, and may decode a native
+    level already reduced in size where that is cheaper than box filtering.
+
+    Pixels have channels samples each of bpc bits: 8 or 16 bit unsigned
+    integers, or 32 bit unsigned integers or floating point according to
+    sampleType. Levels are numbered from 0 at full resolution, the opposite of
+    iipsrv resolution numbers.
+ */
+class VirtualPyramidImage : public IIPImage {
+
+ protected:
+
+  /// Tile cache in which virtual tiles are stored
+  TileCache* tileCache;
+
+  /// Number of tiles in each direction for each level
+  std::vector<size_t> numTilesX, numTilesY;
+
+  /// Size of the last column and row of tiles for each level, 0 if full size
+  std::vector<size_t> lastTileXDim, lastTileYDim;
+
+  /// Native level from which each level is read, and the downsample within it
+  std::vector<uint32_t> native_level_to_use, downsample_in_level;
+
+  /// Blocks being built, by level and block number
+  SingleFlight< std::pair<uint32_t,size_t>, std::vector<RawTilePtr> > blockBuilds;
+
+
+  /// Build our level tables
+  /** Halves the full resolution size until it fits within max_w x max_h,
+      mapping each level to the smallest native level at least as large
+      @param native_widths widths of the native levels, largest first
+      @param native_heights heights of the native levels, largest first
+      @param max_w width the smallest level must fit within
+      @param max_h height the smallest level must fit within
+   */
+  void buildLevels( const std::vector<int64_t>& native_widths, const std::vector<int64_t>& native_heights,
+                    unsigned int max_w, unsigned int max_h );
+
+  /// Return the number of bytes in each of our pixels
+  size_t pixelBytes(){ return channels * ( bpc / 8 ); };
+
+  /// Return the width of a tile in a level
+  size_t tileWidthAt( uint32_t level, size_t tilex ){
+    return ( tilex == numTilesX[level] - 1 && lastTileXDim[level] ) ? lastTileXDim[level] : tile_width;
+  };
+
+  /// Return the height of a tile in a level
+  size_t tileHeightAt( uint32_t level, size_t tiley ){
+    return ( tiley == numTilesY[level] - 1 && lastTileYDim[level] ) ? lastTileYDim[level] : tile_height;
+  };
+
+  /// Return a tile from the tile cache, or read or build it
+  /** @param tilex tile column
+      @param tiley tile row
+      @param iipres iipsrv resolution number
+   */
+  RawTilePtr getCachedTile( const size_t tilex, const size_t tiley, const uint32_t iipres );
+
+  /// Read a tile from a native level: implemented by the subclass
+  /** @param tilex tile column
+      @param tiley tile row
+      @param iipres iipsrv resolution number of a level with no downsample
+   */
+  virtual RawTilePtr getNativeTile( const size_t tilex, const size_t tiley, const uint32_t iipres ) = 0;
+
+  /// Read a region of a native level as packed pixels
+  /** By default, copies the region from the level's tiles. Overloaded by
+      subclasses whose library can read arbitrary regions in one call
+      @param level level with no downsample
+      @param x left of the region in the level's pixels
+      @param y top of the region in the level's pixels
+      @param w region width
+      @param h region height
+      @param buffer output with room for w * h * 4 bytes, so that 32 bit pixels may be converted in place,
+             or w * h * pixelBytes() where pixels are larger
+   */
+  virtual void readNativeRegion( uint32_t level, size_t x, size_t y, size_t w, size_t h, uint8_t* buffer );
+
+  /// Copy the part of a native tile within a region read by readNativeRegion()
+  /** @param tile tile, which may be empty
+      @param tx tile column
+      @param ty tile row
+      @param x left of the region
+      @param y top of the region
+      @param w region width
+      @param h region height
+      @param buffer region of packed pixels
+   */
+  void copyTile( const RawTilePtr& tile, size_t tx, size_t ty, size_t x, size_t y, size_t w, size_t h, uint8_t* buffer );
+
+  /// Return the factor by which a native level can be read already reduced in size
+  /** By default 1. Overloaded by subclasses which can decode a level at a
+      reduced size for much less than at full size, such as JPEG tiles decoded
+      with a reduced inverse DCT. The rest of the downsample is box filtered
+      @param level level with no downsample
+      @param downsample downsample wanted, a power of two
+      @return a power of two dividing downsample
+   */
+  virtual size_t nativeScale( uint32_t /*level*/, size_t /*downsample*/ ){ return 1; };
+
+  /// Read a region of a native level reduced by a factor from nativeScale()
+  /** @param level level with no downsample
+      @param scale reduction in each direction
+      @param x left of the region in pixels of the reduced level
+      @param y top of the region in pixels of the reduced level
+      @param w region width
+      @param h region height
+      @param buffer output with room for w * h * 4 bytes
+   */
+  virtual void readScaledRegion( uint32_t level, size_t scale, size_t x, size_t y, size_t w, size_t h, uint8_t* buffer );
+
+  /// Return the number of tiles in each direction to read at once from a level with no downsample
+  /** By default 1, so that native tiles are read one at a time through getNativeTile().
+      Overloaded by subclasses whose files are tiled differently from our tiles, so that
+      each of their tiles is decoded once for several of ours
+      @param level level with no downsample
+      @param bw tiles per block horizontally
+      @param bh tiles per block vertically
+   */
+  virtual void nativeBlockTiles( uint32_t /*level*/, size_t& bw, size_t& bh ){ bw = bh = 1; };
+
+  /// Return the number of tiles in each direction of the blocks in which a level is built
+  void blockTiles( uint32_t level, size_t& bw, size_t& bh );
+
+  /// Build the block of tiles containing a tile, caching the others
+  /** @param tilex tile column
+      @param tiley tile row
+      @param iipres iipsrv resolution number
+   */
+  RawTilePtr getVirtualTile( const size_t tilex, const size_t tiley, const uint32_t iipres );
+
+  /// Build all the tiles of a block
+  std::vector<RawTilePtr> buildBlock( uint32_t level, size_t blockx, size_t blocky );
+
+
+ public:
+
+  /// Default constructor
+  VirtualPyramidImage() : IIPImage(), tileCache( NULL ) {};
+
+  /// Constructor
+  /** @param image IIPImage object
+      @param tile_cache tile cache in which to store virtual tiles
+   */
+  VirtualPyramidImage( const IIPImage& image, TileCache* tile_cache ) : IIPImage( image ), tileCache( tile_cache ) {};
+
+  /// Constructor
+  /** @param path image path
+      @param tile_cache tile cache in which to store virtual tiles
+   */
+  VirtualPyramidImage( const std::string& path, TileCache* tile_cache ) : IIPImage( path ), tileCache( tile_cache ) {};
+
+  /// Copy constructor - copies our level tables but not any blocks being built
+  VirtualPyramidImage( const VirtualPyramidImage& image ) : IIPImage( image ),
+    tileCache( image.tileCache ),
+    numTilesX( image.numTilesX ),
+    numTilesY( image.numTilesY ),
+    lastTileXDim( image.lastTileXDim ),
+    lastTileYDim( image.lastTileYDim ),
+    native_level_to_use( image.native_level_to_use ),
+    downsample_in_level( image.downsample_in_level ) {};
+
+  /// Add our level tables to the memory usage
+  virtual size_t getMemoryUsage();
+
+  /// Return a tile, reading it from its native level or building it from the nearest one
+  /** @param x horizontal sequence angle (ignored)
+      @param y vertical sequence angle (ignored)
+      @param r resolution
+      @param l number of quality layers to decode (ignored)
+      @param t tile number
+   */
+  virtual RawTilePtr getTile( int x, int y, unsigned int r, int l, unsigned int t );
+
+};
+
+
+#endif
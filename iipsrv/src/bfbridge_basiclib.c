@@ -477,6 +477,7 @@ bfbridge_error_t *bfbridge_make_instance(
     printf("c: makeinstance0\n");
     // Ease of freeing
     dest->bfbridge = NULL;
+    dest->communication_buffer_object = NULL;
     printf("c: makeinstance01\n");
     dest->communication_buffer = communication_buffer;
     printf("c: makeinstance02\n");
@@ -577,11 +578,14 @@ bfbridge_error_t *bfbridge_make_instance(
     BFENVA(env, CallVoidMethod, bfbridge, thread->BFSetCommunicationBuffer, buffer);
     */
     BFENVA(env, CallVoidMethod, bfbridge, thread->BFSetCommunicationBuffer, buffer);
+    // Should be freed: bfbridge, buffer (kept to be set again by bf_open_bytes_to)
+    jobject buffer_global = (jobject)BFENVA(env, NewGlobalRef, buffer);
     BFENVA(env, DeleteLocalRef, buffer);
     printf("c: makeinstance4\n");
 
     // Ease of freeing: keep null until we can return without error
     dest->bfbridge = bfbridge;
+    dest->communication_buffer_object = buffer_global;
     return NULL;
 }
 
@@ -596,11 +600,13 @@ void bfbridge_move_instance(bfbridge_instance_t *dest, bfbridge_instance_t *thre
         *dest = *thread;
         thread->bfbridge = NULL;
         thread->communication_buffer = NULL;
+        thread->communication_buffer_object = NULL;
     }
     else
     {
         dest->bfbridge = NULL;
         dest->communication_buffer = NULL;
+        dest->communication_buffer_object = NULL;
     }
 }
 
@@ -612,6 +618,11 @@ void bfbridge_free_instance(
     {
         BFENVA(thread->env, DeleteGlobalRef, instance->bfbridge);
         instance->bfbridge = NULL;
+        if (instance->communication_buffer_object)
+        {
+            BFENVA(thread->env, DeleteGlobalRef, instance->communication_buffer_object);
+            instance->communication_buffer_object = NULL;
+        }
     }
 }
 
@@ -887,6 +898,43 @@ int bf_open_bytes(
     return BFFUNC(BFOpenBytes, Int, plane, x, y, w, h);
 }
 
+int bf_open_bytes_to(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h,
+    char *dest, int dest_len)
+{
+    // Local references are only freed when a thread returns to Java,
+    // which ours never do, so this one is deleted explicitly below
+    jobject target = BFENVA(BFENV, NewDirectByteBuffer, dest, dest_len);
+    if (!target || !instance->communication_buffer_object)
+    {
+        // Receive into the communication buffer and copy instead
+        if (BFENVAV(BFENV, ExceptionCheck) == 1)
+        {
+            BFENVAV(BFENV, ExceptionClear);
+        }
+        if (target)
+        {
+            BFENVA(BFENV, DeleteLocalRef, target);
+        }
+        int len = bf_open_bytes(instance, thread, plane, x, y, w, h);
+        if (len > 0 && len <= dest_len)
+        {
+            memcpy(dest, instance->communication_buffer, len);
+        }
+        return len;
+    }
+
+    BFENVA(BFENV, CallVoidMethod, BFINSTC, thread->BFSetCommunicationBuffer, target);
+    int len = BFFUNC(BFOpenBytes, Int, plane, x, y, w, h);
+    // Error messages are written to the communication buffer,
+    // so give it back before the caller asks for one
+    BFENVA(BFENV, CallVoidMethod, BFINSTC, thread->BFSetCommunicationBuffer,
+        instance->communication_buffer_object);
+    BFENVA(BFENV, DeleteLocalRef, target);
+    return len;
+}
+
 int bf_open_thumb_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int w, int h)
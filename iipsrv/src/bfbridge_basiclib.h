@@ -188,6 +188,9 @@ typedef struct bfbridge_instance
 {
     jobject bfbridge;
     char *communication_buffer;
+    // Direct ByteBuffer wrapping communication_buffer, to give it back to
+    // Java after bf_open_bytes_to has lent it another
+    jobject communication_buffer_object;
 #ifndef BFBRIDGE_KNOW_BUFFER_LEN
     int communication_buffer_len;
 #endif
@@ -372,6 +375,16 @@ BFBRIDGE_INLINE_ME int bf_open_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int x, int y, int w, int h);
 
+// Like bf_open_bytes, but receives the bytes into dest rather than the
+// communication buffer, so that they need not be copied out of it.
+// dest is wrapped in a direct ByteBuffer for the duration of the call.
+// Errors are still read from the communication buffer with bf_get_error_length
+// returns: the number of bytes written to dest, or a negative error code
+BFBRIDGE_INLINE_ME int bf_open_bytes_to(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h,
+    char *dest, int dest_len);
+
 BFBRIDGE_INLINE_ME int bf_open_thumb_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int w, int h);